@@ -0,0 +1,115 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#include "../hmm/ls.h"
+
+// Results and hand-off state shared between the workers
+struct batchstate {
+    int n;
+    int width;
+    std::unique_ptr<float*[]> results;
+    std::unique_ptr<std::atomic<bool>[]> ready;
+    std::mutex wlock;
+    std::atomic<int> next;
+    // Finished results waiting for their turn, and the most there ever were
+    std::atomic<int> held;
+    std::atomic<int> peak;
+    // Next block to hand out, and what waits for next to move
+    std::mutex gate;
+    std::condition_variable moved;
+    int cursor;
+};
+
+// Hands every consecutive finished result starting at B->next to out. Whoever
+// finishes a block tries to flush; only one thread writes at a time, and the
+// re-check after unlocking makes sure a result finished while someone else
+// held the lock isn't left behind. Workers waiting for next to move are woken
+// once it has.
+static void flush(batchstate* B, std::vector<std::string>& ids,
+    batch_sink& out) {
+    while (true) {
+        if (!B->wlock.try_lock()) { return; }
+        int i = B->next;
+        int from = i;
+        while (i < B->n && B->ready[i]) {
+            out(i, ids[i], B->results[i]);
+            B->results[i] = NULL;
+            i += 1;
+        }
+        B->next = i;
+        B->held -= i - from;
+        B->wlock.unlock();
+        if (i > from) {
+            // Taking the gate orders this against a worker about to wait
+            { std::lock_guard<std::mutex> lk(B->gate); }
+            B->moved.notify_all();
+        }
+        if (!(i < B->n && B->ready[i])) { return; }
+    }
+}
+
+int ls_batch(genome_t sample, std::vector<std::string>& ids, lspanel* P,
+    workpool* pool, bool linear, batch_sink out) {
+    batchstate B;
+    B.n = ids.size();
+    B.results.reset(new float*[B.n]);
+    B.ready.reset(new std::atomic<bool>[B.n]);
+    for (int i = 0 ; i < B.n ; i += 1) {
+        B.results[i] = NULL;
+        B.ready[i] = false;
+    }
+    B.next = 0;
+    B.held = 0;
+    B.peak = 0;
+    B.cursor = 0;
+
+    // Blocks of consecutive haplotypes, narrowed so every worker gets one
+    B.width = (B.n + pool->nthread - 1) / pool->nthread;
+    if (B.width > LS_BATCH_WIDTH) { B.width = LS_BATCH_WIDTH; }
+    if (B.width < 1) { B.width = 1; }
+    int nblock = (B.n + B.width - 1) / B.width;
+    int ahead = LS_BATCH_AHEAD * pool->nthread;
+
+    // Blocks go out in order, and never more than ahead past the one holding
+    // the next result due, so a slow early block can't leave the rest of the
+    // input finished and waiting behind it
+    pool->team([&](int tid) {
+        while (true) {
+            int k;
+            {
+                std::unique_lock<std::mutex> lk(B.gate);
+                B.moved.wait(lk, [&]{
+                    return B.cursor >= nblock
+                        || B.cursor < B.next / B.width + ahead;
+                });
+                if (B.cursor >= nblock) { return; }
+                k = B.cursor;
+                B.cursor += 1;
+            }
+
+            int lo = k * B.width;
+            int nt = std::min(B.width, B.n - lo);
+            uint8_t* s[LS_MULTI_MAX];
+            for (int b = 0 ; b < nt ; b += 1) {
+                s[b] = P->sample(sample, ids[lo + b]);
+            }
+            ls_multi(P, s, nt, linear, &B.results[lo]);
+            int held = (B.held += nt);
+            int peak = B.peak;
+            while (held > peak && !B.peak.compare_exchange_weak(peak, held)) {}
+            for (int b = 0 ; b < nt ; b += 1) {
+                delete[] s[b];
+                B.ready[lo + b] = true;
+            }
+            flush(&B, ids, out);
+        }
+    });
+
+    flush(&B, ids, out);
+    return B.peak;
+}
@@ -0,0 +1,55 @@
+/* Sample-level parallel driver for imputing many haplotypes against one
+ * reference panel.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../plinker/genome_c.h"
+#include "../pool/pool.h"
+#include "../hmm/panel.h"
+
+/* Called once per haplotype with its position in the input, its id and its
+ * posterior matrix: probabilities if ls_batch() was asked for linear output,
+ * and their logs (as returned by ls()) if not. Calls are made strictly in
+ * input order and never concurrently, though not necessarily from the
+ * calling thread. The sink owns P and must free it.
+ */
+typedef std::function<void(int, const std::string&, float*)> batch_sink;
+
+// Haplotypes ls_batch() hands ls_multi() at once, unless that would leave
+// workers idle. Past this the interleaved rows of a block stop fitting in L1.
+#define LS_BATCH_WIDTH 16
+
+// Blocks ls_batch() lets each worker get ahead of the next result due
+#define LS_BATCH_AHEAD 2
+
+/* Runs every haplotype ids[i] of sample against the prepared panel P,
+ * spreading blocks of consecutive haplotypes over the workers of pool, each
+ * block through ls_multi() so it shares its reads of the panel. P and sample
+ * are only read, so one copy of the panel is shared by every worker. Results
+ * are handed to out in the order of ids as soon as every earlier haplotype has
+ * been handed over, as probabilities if linear is set and as their logs if
+ * not. Linear output skips a log() of every cell, and imputing from it an
+ * exp(), so it's the one to ask for unless the sink needs logs.
+ *
+ * Blocks are taken in input order, and a worker waits rather than start one
+ * more than LS_BATCH_AHEAD blocks per worker past the block of the next
+ * result due, so at most that many blocks of up to LS_BATCH_WIDTH results
+ * are ever held at once, however many haplotypes there are. Returns the most
+ * results that were.
+ *
+ * This doesn't use workpool::run(), whose workers steal from each other's
+ * queues: stealing hands out blocks from the far end of the input, which
+ * then wait for everything before them, so nothing bounds what's held.
+ * Taking blocks from one in-order cursor costs a lock per block, which is
+ * nothing next to running one.
+ */
+int ls_batch(genome_t sample, std::vector<std::string>& ids, lspanel* P,
+    workpool* pool, bool linear, batch_sink out);
+
+#endif
@@ -0,0 +1,299 @@
+/* Local deduplication.
+ *
+ * References that are identical over a window have the same emissions at
+ * every SNP of it, so in the linear-space recurrence
+ *   fw[i][j] = e[i][j] * (a * fw[i-1][j] / c[i-1] + b)
+ * each of them is the same affine function of its own entry in the forward
+ * row before the window:
+ *   fw[i][j] = A[i][g] * in[j] + B[i][g]
+ * for all j in state g, with
+ *   A[i][g] = e[i][g] * a * A[i-1][g] / c[i-1]
+ *   B[i][g] = e[i][g] * (a * B[i-1][g] / c[i-1] + b).
+ * The row sum c[i] is then sum over g of A[i][g] * IN[g] + n_g * B[i][g],
+ * where IN[g] sums in over state g and n_g is its size: the jump into a
+ * state counts once per reference in it. So the HMM runs on the states alone,
+ * with only the entry row of each window expanded to single references, and
+ * nothing is approximated. The backward pass is the same in reverse.
+ *
+ * Posteriors are fw[i][j] * bw[i+1][j], a product of two such functions, so
+ * the mass of a state is
+ *   Af * Ab * sum(in * out) + Af * Bb * sum(in) + Bf * Ab * sum(out)
+ *     + Bf * Bb * n_g
+ * over its references, and allele posteriors come from those four sums per
+ * state without ever expanding a row.
+ */
+
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+
+#include "dedup.h"
+#include "panel.h"
+#include "../plinker/hapmat.h"
+
+lsdedup::lsdedup(lspanel* P_, int window_) {
+    P = P_;
+    window = window_;
+    const hapmat* S = P->ref.get();
+    int n = P->nsample;
+
+    for (int s = 0 ; s < P->nsnp ; s += window) { start.push_back(s); }
+    start.push_back(P->nsnp);
+    int nwin = start.size() - 1;
+
+    // Refine one state into up to four by the alleles at every SNP in turn
+    std::vector<int> remap;
+    off.push_back(0);
+    for (int w = 0 ; w < nwin ; w += 1) {
+        std::vector<int> grp(n, 0);
+        int ng = 1;
+        for (int i = start[w] ; i < start[w+1] ; i += 1) {
+            remap.assign(4 * ng, -1);
+            int next = 0;
+            for (int j = 0 ; j < n ; j += 1) {
+                int key = 4 * grp[j] + S->get(i, j);
+                if (remap[key] == -1) { remap[key] = next++; }
+                grp[j] = remap[key];
+            }
+            ng = next;
+        }
+
+        std::vector<int> rep(ng, -1);
+        std::vector<int> sz(ng, 0);
+        for (int j = 0 ; j < n ; j += 1) {
+            sz[grp[j]] += 1;
+            if (rep[grp[j]] == -1) { rep[grp[j]] = j; }
+        }
+        int len = start[w+1] - start[w];
+        std::vector<uint8_t> al((size_t)len * ng);
+        for (int k = 0 ; k < len ; k += 1) {
+            for (int g = 0 ; g < ng ; g += 1) {
+                al[(size_t)k * ng + g] = S->get(start[w] + k, rep[g]);
+            }
+        }
+
+        group.push_back(grp);
+        size.push_back(sz);
+        allele.push_back(al);
+        off.push_back(off.back() + (size_t)len * ng);
+    }
+}
+
+double lsdedup::states() const {
+    if (P->nsnp == 0) { return 0.0; }
+    return (double)off.back() / P->nsnp;
+}
+
+void lsdedup::forward(uint8_t* snps, std::vector<float>& a,
+        std::vector<float>& b, std::vector<float>& in) {
+    int n = P->nsample;
+    int nwin = start.size() - 1;
+    const float* E = P->pemiss;
+    a.resize(off[nwin]);
+    b.resize(off[nwin]);
+    in.assign((size_t)nwin * n, 0.0f);
+
+    std::vector<double> IN;
+    for (int w = 0 ; w < nwin ; w += 1) {
+        int ng = size[w].size();
+        int len = start[w+1] - start[w];
+        const int* grp = group[w].data();
+        const int* sz = size[w].data();
+        const float* fin = &in[(size_t)w * n];
+        IN.assign(ng, 0.0);
+        for (int j = 0 ; j < n ; j += 1) { IN[grp[j]] += fin[j]; }
+
+        // The row before the window is normalized
+        double inv = 1.0;
+        float* ar = NULL;
+        float* br = NULL;
+        for (int k = 0 ; k < len ; k += 1) {
+            int i = start[w] + k;
+            const uint8_t* al = &allele[w][(size_t)k * ng];
+            float* ap = ar;
+            float* bp = br;
+            ar = &a[off[w] + (size_t)k * ng];
+            br = &b[off[w] + (size_t)k * ng];
+            double sum = 0.0;
+            for (int g = 0 ; g < ng ; g += 1) {
+                float e = E[al[g] != snps[i]];
+                if (i == 0) {
+                    // From the uniform prior
+                    ar[g] = 0.0f;
+                    br[g] = e / n;
+                }
+                else if (k == 0) {
+                    ar[g] = e * P->stay[i-1];
+                    br[g] = e * P->jump[i-1];
+                }
+                else {
+                    ar[g] = e * (float)(P->stay[i-1] * ap[g] * inv);
+                    br[g] = e * (float)(P->stay[i-1] * bp[g] * inv
+                        + P->jump[i-1]);
+                }
+                sum += ar[g] * IN[g] + sz[g] * (double)br[g];
+            }
+            inv = 1.0 / sum;
+        }
+
+        if (w + 1 < nwin) {
+            float* fout = &in[(size_t)(w + 1) * n];
+            for (int j = 0 ; j < n ; j += 1) {
+                fout[j] = (ar[grp[j]] * fin[j] + br[grp[j]]) * inv;
+            }
+        }
+    }
+}
+
+double lsdedup::backward(uint8_t* snps, int w, const std::vector<float>& out,
+        std::vector<float>& a, std::vector<float>& b) {
+    int n = P->nsample;
+    int ng = size[w].size();
+    int len = start[w+1] - start[w];
+    const int* grp = group[w].data();
+    const int* sz = size[w].data();
+    const float* E = P->pemiss;
+    a.resize((size_t)len * ng);
+    b.resize((size_t)len * ng);
+
+    std::vector<double> OUT(ng, 0.0);
+    if (start[w+1] < P->nsnp) {
+        for (int j = 0 ; j < n ; j += 1) { OUT[grp[j]] += out[j]; }
+    }
+
+    double sum = 0.0;
+    for (int k = len - 1 ; k >= 0 ; k -= 1) {
+        int i = start[w] + k;
+        const uint8_t* al = &allele[w][(size_t)k * ng];
+        float* ar = &a[(size_t)k * ng];
+        float* br = &b[(size_t)k * ng];
+        const float* an = ar + ng;
+        const float* bn = br + ng;
+        double inv = k < len - 1 ? 1.0 / sum : 1.0;
+        sum = 0.0;
+        for (int g = 0 ; g < ng ; g += 1) {
+            float e = E[al[g] != snps[i]];
+            if (i == P->nsnp - 1) {
+                // Nothing after the last SNP, as in ls_lin()
+                ar[g] = 0.0f;
+                br[g] = e;
+            }
+            else if (k == len - 1) {
+                ar[g] = e * P->stay[i];
+                br[g] = e * P->jump[i];
+            }
+            else {
+                ar[g] = e * (float)(P->stay[i] * an[g] * inv);
+                br[g] = e * (float)(P->stay[i] * bn[g] * inv + P->jump[i]);
+            }
+            sum += ar[g] * OUT[g] + sz[g] * (double)br[g];
+        }
+    }
+    return sum;
+}
+
+void lsdedup::smooth(uint8_t* snps, const dsink& emit) {
+    int n = P->nsample;
+    int nwin = start.size() - 1;
+    std::vector<float> fa, fb, in;
+    forward(snps, fa, fb, in);
+
+    std::vector<float> ba, bb;
+    std::vector<float> out(n, 0.0f);
+    std::vector<float> prev(n);
+    std::vector<float> one;
+    std::vector<float> zero;
+    for (int w = nwin - 1 ; w >= 0 ; w -= 1) {
+        int ng = size[w].size();
+        int len = start[w+1] - start[w];
+        double c = backward(snps, w, out, ba, bb);
+        one.assign(ng, 1.0f);
+        zero.assign(ng, 0.0f);
+
+        for (int k = 0 ; k < len ; k += 1) {
+            int i = start[w] + k;
+            // The backward row after i: the next in the window, or out after
+            // the window's last SNP, or nothing at all after the last SNP
+            const float* ab = one.data();
+            const float* bb1 = zero.data();
+            if (i == P->nsnp - 1) {
+                ab = zero.data();
+                bb1 = one.data();
+            }
+            else if (k + 1 < len) {
+                ab = &ba[(size_t)(k + 1) * ng];
+                bb1 = &bb[(size_t)(k + 1) * ng];
+            }
+            emit(w, i, &fa[off[w] + (size_t)k * ng],
+                &fb[off[w] + (size_t)k * ng], ab, bb1, &in[(size_t)w * n],
+                out.data());
+        }
+
+        // The normalized backward row at the window's start, for the one
+        // before it
+        const int* grp = group[w].data();
+        for (int j = 0 ; j < n ; j += 1) {
+            prev[j] = (ba[grp[j]] * out[j] + bb[grp[j]]) / c;
+        }
+        out.swap(prev);
+    }
+}
+
+float* lsdedup::run(uint8_t* snps, bool linear) {
+    int n = P->nsample;
+    float* R = (float*)malloc(sizeof(float) * P->nsnp * n);
+    smooth(snps, [&](int w, int i, const float* af, const float* bf,
+            const float* ab, const float* bb, const float* in,
+            const float* out) {
+        const int* grp = group[w].data();
+        float* row = &R[(size_t)i * n];
+        double sum = 0.0;
+        for (int j = 0 ; j < n ; j += 1) {
+            int g = grp[j];
+            row[j] = (af[g] * in[j] + bf[g]) * (ab[g] * out[j] + bb[g]);
+            sum += row[j];
+        }
+        float inv = 1.0 / sum;
+        for (int j = 0 ; j < n ; j += 1) {
+            row[j] = linear ? row[j] * inv : log(row[j] * inv);
+        }
+    });
+    return R;
+}
+
+float* lsdedup::alleles(uint8_t* snps) {
+    int n = P->nsample;
+    float* D = (float*)malloc(sizeof(float) * P->nsnp * 4);
+
+    // Sums of in * out, in and out over each state, for the current window
+    int cur = -1;
+    std::vector<double> sio, si, so;
+    smooth(snps, [&](int w, int i, const float* af, const float* bf,
+            const float* ab, const float* bb, const float* in,
+            const float* out) {
+        int ng = size[w].size();
+        const int* sz = size[w].data();
+        if (w != cur) {
+            const int* grp = group[w].data();
+            sio.assign(ng, 0.0);
+            si.assign(ng, 0.0);
+            so.assign(ng, 0.0);
+            for (int j = 0 ; j < n ; j += 1) {
+                sio[grp[j]] += in[j] * out[j];
+                si[grp[j]] += in[j];
+                so[grp[j]] += out[j];
+            }
+            cur = w;
+        }
+
+        const uint8_t* al = &allele[w][(size_t)(i - start[w]) * ng];
+        double p[4] = { 0.0, 0.0, 0.0, 0.0 };
+        for (int g = 0 ; g < ng ; g += 1) {
+            p[al[g]] += af[g] * ab[g] * sio[g] + af[g] * bb[g] * si[g]
+                + bf[g] * ab[g] * so[g] + bf[g] * bb[g] * (double)sz[g];
+        }
+        double sum = p[0] + p[1] + p[2] + p[3];
+        for (int a = 0 ; a < 4 ; a += 1) { D[i * 4 + a] = p[a] / sum; }
+    });
+    return D;
+}
@@ -0,0 +1,97 @@
+/* Local deduplication: running the Li-Stephens model on one weighted state per
+ * set of references that are identical over a window of SNPs, rather than one
+ * per reference.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+class lspanel;
+
+// Default window length, in SNPs
+#define LS_DEDUP_WINDOW 8
+
+// The constructor groups the references and fills in every public field;
+// run() and alleles() only read them, and they're public so that callers
+// can see how far the panel merged. Nothing outside the constructor should
+// write to them, or the states stop matching P.
+class lsdedup {
+public:
+    // The panel, not owned
+    lspanel* P;
+    int window;
+    // Window w is SNPs [start[w], start[w+1])
+    std::vector<int> start;
+    // group[w][j] is the state of reference j in window w, and size[w][g]
+    // the number of references in state g
+    std::vector<std::vector<int>> group;
+    std::vector<std::vector<int>> size;
+    // allele[w][k * size[w].size() + g] is the allele of state g at SNP
+    // start[w] + k
+    std::vector<std::vector<uint8_t>> allele;
+
+    // Groups the references of P (which must outlive this) by window. This
+    // only depends on the panel, so it's done once for any number of targets.
+    lsdedup(lspanel* P_, int window_ = LS_DEDUP_WINDOW);
+
+    // Mean number of states per SNP, the effective panel size
+    double states() const;
+
+    /* Same as ls_lin(P, snps, linear, NULL), with the HMM itself run on the
+     * states. Rows are expanded back to every reference at the end, so this
+     * still takes and returns the whole matrix.
+     */
+    float* run(uint8_t* snps, bool linear);
+
+    /* Posterior probability of every allele at every SNP, as a malloc'd array
+     * D[s][4], with D[i][a] for allele a at SNP i (see impute_alleles()).
+     * Only sums over each state are ever needed for these, so nothing is
+     * expanded to single references but once a window.
+     */
+    float* alleles(uint8_t* snps);
+
+private:
+    /* Forward pass over states. For every SNP i of window w, row i of the
+     * forward matrix of ls_lin() is, for reference j in state g,
+     *   a[i][g] * in[w][j] + b[i][g]
+     * up to scale, where in[w] is the normalized forward row before the
+     * window. a and b are laid out window by window at off[w], a row of
+     * size[w].size() per SNP.
+     */
+    void forward(uint8_t* snps, std::vector<float>& a, std::vector<float>& b,
+        std::vector<float>& in);
+
+    /* Backward pass over the states of window w alone, given the normalized
+     * backward row after the window in out (unused for the last window).
+     * Rows are laid out as in forward(), from 0 for the window, and row k of
+     * the backward matrix is a[k][g] * out[j] + b[k][g] up to scale. Returns
+     * the scale of row 0: the sum of what it stands for.
+     */
+    double backward(uint8_t* snps, int w, const std::vector<float>& out,
+        std::vector<float>& a, std::vector<float>& b);
+
+    /* Called for every SNP i of window w with the forward coefficients of
+     * its row (af, bf) and the backward ones of the row after it (ab, bb),
+     * and the window's entry rows in and out, so that the posterior of
+     * reference j in state g is proportional to
+     *   (af[g] * in[j] + bf[g]) * (ab[g] * out[j] + bb[g])
+     */
+    typedef std::function<void(int, int, const float*, const float*,
+        const float*, const float*, const float*, const float*)> dsink;
+
+    // Runs forward() and then backward() on every window, last to first,
+    // handing emit every SNP of each
+    void smooth(uint8_t* snps, const dsink& emit);
+
+    // Offsets of the windows in forward()'s rows
+    std::vector<size_t> off;
+
+    lsdedup(const lsdedup&);
+    lsdedup& operator=(const lsdedup&);
+};
+
+#endif
@@ -0,0 +1,188 @@
+/* Reduced state space.
+ *
+ * The chromosome is cut into windows of `window` SNPs (a last window shorter
+ * than half that is merged into the one before it). Each window runs the
+ * linear-space engine on a panel of just the k references nearest the target
+ * over the window and `overlap` SNPs either side, so every window starts and
+ * ends with some burn-in. Around a boundary, rows fade linearly from the
+ * earlier window's posterior to the later one's over h = overlap / 2 SNPs
+ * either side (at most window / 4), which keeps every row a distribution.
+ *
+ * Picking the nearest references counts mismatches for all of them, which
+ * would cost about as much as a step of the full HMM if done a reference at a
+ * time. Instead the counts are bit-sliced: plane b of word w holds bit b of
+ * the counts of the 64 references in word w, and adding a SNP's mismatch word
+ * is a ripple-carry add, which usually stops after a plane or two. That's a
+ * couple of word operations per 64 references per SNP.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#include "knn.h"
+#include "panel.h"
+#include "../plinker/hapmat.h"
+
+lsknn::lsknn(genome_t ref_, int k_, float g_, float theta_, int window_,
+        int overlap_) {
+    ref = ref_;
+    k = k_;
+    g = g_;
+    theta = theta_;
+    window = window_;
+    overlap = overlap_;
+}
+
+std::vector<int> lsknn::nearest(uint8_t* snps, int lo, int hi) const {
+    const hapmat* S = ref->haps.get();
+    int n = S->nhap;
+    int nbit = 1;
+    while ((1 << nbit) <= hi - lo) { nbit += 1; }
+
+    std::vector<uint64_t> cnt((size_t)S->nword * nbit, 0);
+    for (int i = lo ; i < hi ; i += 1) {
+        for (int w = 0 ; w < S->nword ; w += 1) {
+            uint64_t carry = S->mismatch(i, w, snps[i]);
+            uint64_t* c = &cnt[(size_t)w * nbit];
+            for (int b = 0 ; carry != 0 && b < nbit ; b += 1) {
+                uint64_t x = c[b];
+                c[b] = x ^ carry;
+                carry &= x;
+            }
+        }
+    }
+
+    std::vector<int> dist(n);
+    for (int j = 0 ; j < n ; j += 1) {
+        const uint64_t* c = &cnt[(size_t)(j >> 6) * nbit];
+        int d = 0;
+        for (int b = 0 ; b < nbit ; b += 1) {
+            d |= (int)((c[b] >> (j & 63)) & 1) << b;
+        }
+        dist[j] = d;
+    }
+
+    // Ties go to the earlier reference, so the pick is deterministic
+    std::vector<int> idx(n);
+    std::iota(idx.begin(), idx.end(), 0);
+    if (k < n) {
+        std::nth_element(idx.begin(), idx.begin() + k, idx.end(),
+            [&](int x, int y) {
+                return dist[x] < dist[y] || (dist[x] == dist[y] && x < y);
+            });
+        idx.resize(k);
+        std::sort(idx.begin(), idx.end());
+    }
+    return idx;
+}
+
+void lsknn::run(uint8_t* snps, bool linear, ls_sink sink) const {
+    const hapmat* S = ref->haps.get();
+    int nsnp = S->nsnp;
+    int h = overlap / 2 < window / 4 ? overlap / 2 : window / 4;
+    float none = linear ? 0.0f : -INFINITY;
+    std::vector<float> row(S->nhap, none);
+
+    // The previous window's references, first SNP and result
+    std::vector<int> psel;
+    int plo = 0;
+    float* prev = NULL;
+
+    int c0 = 0;
+    while (c0 < nsnp) {
+        int c1 = c0 + window < nsnp ? c0 + window : nsnp;
+        if (nsnp - c1 < window / 2) { c1 = nsnp; }
+        int lo = c0 > overlap ? c0 - overlap : 0;
+        int hi = c1 + overlap < nsnp ? c1 + overlap : nsnp;
+
+        std::vector<int> sel = nearest(snps, lo, hi);
+        int m = sel.size();
+        auto haps = std::make_shared<hapmat>(hi - lo, m);
+        for (int i = lo ; i < hi ; i += 1) {
+            for (int j = 0 ; j < m ; j += 1) {
+                haps->set(i - lo, j, S->get(i, sel[j]));
+            }
+        }
+        std::vector<float> dists(hi - lo);
+        for (int i = lo ; i < hi - 1 ; i += 1) {
+            dists[i - lo] = g_rec_dist(ref, i);
+        }
+        lspanel W(haps, dists.data(), g, theta);
+        float* cur = ls_lin(&W, snps + lo, true, NULL);
+
+        // Fade in from the previous window over [c0 - h, c0 + h), then this
+        // window alone up to where the fade to the next one starts
+        int start = c0 == 0 ? 0 : c0 - h;
+        int end = c1 == nsnp ? nsnp : c1 - h;
+        for (int i = start ; i < end ; i += 1) {
+            float w = c0 > 0 && i < c0 + h ? (i - start + 0.5f) / (2 * h)
+                                           : 1.0f;
+            const float* cr = &cur[(size_t)(i - lo) * m];
+            for (int j = 0 ; j < m ; j += 1) { row[sel[j]] = 0.0f; }
+            if (w < 1.0f) {
+                const float* pr = &prev[(size_t)(i - plo) * psel.size()];
+                for (size_t j = 0 ; j < psel.size() ; j += 1) {
+                    row[psel[j]] = 0.0f;
+                }
+                for (size_t j = 0 ; j < psel.size() ; j += 1) {
+                    row[psel[j]] += (1.0f - w) * pr[j];
+                }
+            }
+            for (int j = 0 ; j < m ; j += 1) { row[sel[j]] += w * cr[j]; }
+
+            if (!linear) {
+                for (int j = 0 ; j < m ; j += 1) {
+                    row[sel[j]] = log(row[sel[j]]);
+                }
+                // References in both sets are already logged
+                for (size_t j = 0 ; w < 1.0f && j < psel.size() ; j += 1) {
+                    int r = psel[j];
+                    if (!std::binary_search(sel.begin(), sel.end(), r)) {
+                        row[r] = log(row[r]);
+                    }
+                }
+            }
+            sink(i, row.data());
+
+            for (int j = 0 ; j < m ; j += 1) { row[sel[j]] = none; }
+            for (size_t j = 0 ; w < 1.0f && j < psel.size() ; j += 1) {
+                row[psel[j]] = none;
+            }
+        }
+
+        free(prev);
+        prev = cur;
+        psel.swap(sel);
+        plo = lo;
+        c0 = c1;
+    }
+    free(prev);
+}
+
+double lsknn::loss(uint8_t* snps, lspanel* full, double* worst) const {
+    const hapmat* S = ref->haps.get();
+    int n = full->nsample;
+    float* P = ls_lin(full, snps, true, NULL);
+    double sum = 0.0;
+    double most = 0.0;
+    run(snps, true, [&](int i, const float* r) {
+        // Posterior of each allele, reduced minus exact
+        double diff[4] = { 0.0, 0.0, 0.0, 0.0 };
+        for (int j = 0 ; j < n ; j += 1) {
+            diff[S->get(i, j)] += r[j] - P[(size_t)i * n + j];
+        }
+        double tv = 0.0;
+        for (int a = 0 ; a < 4 ; a += 1) { tv += fabs(diff[a]); }
+        tv /= 2;
+        sum += tv;
+        if (tv > most) { most = tv; }
+    });
+    free(P);
+
+    if (worst != NULL) { *worst = most; }
+    return sum / full->nsnp;
+}
@@ -0,0 +1,64 @@
+/* Reduced state space: running the Li-Stephens model window by window on
+ * just the K reference haplotypes nearest the target in each window, so the
+ * cost per SNP scales with K rather than with the panel.
+ */
+
+#ifndef KNN_H
+#define KNN_H
+
+#include <cstdint>
+#include <vector>
+#include "../plinker/genome_c.h"
+#include "ls.h"
+
+class lspanel;
+
+// Default window length and overlap, in SNPs
+#define LS_KNN_WINDOW 1000
+#define LS_KNN_OVERLAP 100
+
+// The fields are the settings the constructor was given, public so callers
+// can read them back; nothing should change them. Every method is const, so
+// one lsknn serves any number of targets.
+class lsknn {
+public:
+    // The full reference panel
+    genome_t ref;
+    float g;
+    float theta;
+    // References kept per window
+    int k;
+    // SNPs per window, and SNPs of context run on either side of one
+    int window;
+    int overlap;
+
+    lsknn(genome_t ref_, int k_, float g_, float theta_,
+        int window_ = LS_KNN_WINDOW, int overlap_ = LS_KNN_OVERLAP);
+
+    // The k references nearest snps (by Hamming distance) over SNPs
+    // [lo, hi), in increasing order
+    std::vector<int> nearest(uint8_t* snps, int lo, int hi) const;
+
+    /* Runs the HMM for snps (nsnp alleles of ref, as from lspanel::sample)
+     * and hands sink a row of probabilities (or their logs, unless linear is
+     * set) over every reference of ref for every SNP, in increasing order.
+     * Each window runs on its nearest() references over itself and overlap
+     * SNPs either side; references not picked get 0. Within half the overlap
+     * of the boundary between two windows, rows fade linearly from one
+     * window's to the next's, so the result doesn't jump between state sets.
+     * Same arithmetic as ls_lin().
+     */
+    void run(uint8_t* snps, bool linear, ls_sink sink) const;
+
+    /* Accuracy lost to the reduced state space, for snps: the mean and (if
+     * worst isn't NULL) largest over SNPs of the total variation distance
+     * between the allele distributions that rows from run() and the exact
+     * posteriors from full (a panel of all of ref) give, which is what
+     * imputation sees. Distances between the rows themselves say little, as
+     * near-identical references trade mass freely. Exact rows come from
+     * ls_lin(), which agrees with ls() to 1e-4.
+     */
+    double loss(uint8_t* snps, lspanel* full, double* worst) const;
+};
+
+#endif
@@ -4,8 +4,11 @@
 #include "../plinker/genome_c.h"
 #include <stdlib.h>
 #include <math.h>
+#include "../pool/pool.h"
 
-#define EMISS(o1, o2, g) log(o1 == o2 ? (1 - g) : g)
+#include "ls.h"
+#include "panel.h"
+#include "../plinker/hapmat.h"
 
 // Adds two log-scaled probabilities
 float logadd(float x, float y) {
@@ -33,105 +36,125 @@ void logrownorm(float* A, int n) {
   return;
 }
 
+/* Row i of the forward matrix, into out: from row i-1 in prev, which must be
+ * normalized, or just the emissions for prev NULL (the first row).
+ */
+static void fwrow(lspanel* P, uint8_t* s, int i, const float* prev,
+    float* out) {
+  int n_ref = P->nsample;
+  const float* E = P->emiss; // log emissions for a match and a mismatch
+  const hapmat* S = P->ref.get();
+  uint64_t m = 0; // mismatch bits for the current word of references
+  float c = P->c; // probability of jumping to given ref
+
+  if (prev == NULL) {
+    for (int j = 0; j < n_ref; j++) {
+      if ((j & 63) == 0) m = S->mismatch(i, j >> 6, s[i]);
+      out[j] = EMISSBIT((m >> (j & 63)) & 1, E);
+    }
+    return;
+  }
+
+  // Jump probabilities come precomputed with the panel
+  float nJ = P->nJ[i-1];
+  float J = P->J[i-1];
+  for (int j = 0; j < n_ref; j++) {
+    if ((j & 63) == 0) m = S->mismatch(i, j >> 6, s[i]);
+    float alpha = logadd((prev[j] + nJ),(J + c));
+    out[j] = alpha + EMISSBIT((m >> (j & 63)) & 1, E);
+  }
+}
+
+/* Row i of the backward matrix, into out: from row i+1 in next, which must be
+ * normalized, or just the emissions for next NULL (the last row). next may
+ * be out itself, as every entry only depends on the same one in row i+1.
+ */
+static void bwrow(lspanel* P, uint8_t* s, int i, const float* next,
+    float* out) {
+  int n_ref = P->nsample;
+  const float* E = P->emiss; // log emissions for a match and a mismatch
+  const hapmat* S = P->ref.get();
+  uint64_t m = 0; // mismatch bits for the current word of references
+  float c = P->c; // probability of jumping to given ref
+
+  if (next == NULL) {
+    for (int j = 0; j < n_ref; j++) {
+      if ((j & 63) == 0) m = S->mismatch(i, j >> 6, s[i]);
+      out[j] = EMISSBIT((m >> (j & 63)) & 1, E);
+    }
+    return;
+  }
+
+  // Reverse jump probabilities come precomputed with the panel
+  float nJ = P->nJ[i];
+  float J = P->J[i];
+  for (int j = 0; j < n_ref; j++) {
+    if ((j & 63) == 0) m = S->mismatch(i, j >> 6, s[i]);
+    float alpha = logadd(J + c, nJ + next[j]);
+    out[j] = alpha + EMISSBIT((m >> (j & 63)) & 1, E);
+  }
+}
+
 /* Forward algorithm
  * Note that the memory it returns (same form as ls) is heap-allocated and so
  * must be freed.  fw[i][j] is the probability that we are in the jth state
  * given SNPs [0,i].
  * Note also that the probabilities it returns are ln-scaled.
  */
-float* forward(genome_t sample, std::string id, genome_t ref, float g, float theta) {
-  int n_ref = g_nsample(ref);
-  int n_snp = g_nsnp(ref);
+float* forward(lspanel* P, uint8_t* s) {
+  int n_ref = P->nsample;
+  int n_snp = P->nsnp;
 
   // Initialize memory
   float* fw = (float*)malloc(sizeof(float) * n_snp * n_ref);
 
-  // Get snp arrays
-  snp_t* s = g_plookup(sample,id);
-  snp_t** S = new snp_t*[n_ref];
-  int i = 0;
-  for (auto id : *ref) {
-    S[i] = g_plookup(ref,id.first);
-    i++;
-  }
-
   // Initialize the first row
-  float c = log(1.0f / ((float)n_ref)); // probability of jumping to given ref
-  for (int i = 0; i < n_ref; i++) fw[i] = EMISS(s[0], S[i][0], g);
+  fwrow(P, s, 0, NULL, fw);
 
   // For each iteration
   for (int i = 1; i < n_snp; i++) {
-    // Precompute jump probability
     logrownorm(&(fw[(i-1)* n_ref]),n_ref);
-    float nJ = -1 * theta * g_rec_dist(ref, i-1);
-    float J = logsub1(nJ);
-
-    // Calculate values
-    for (int j = 0; j < n_ref; j++) {
-      float alpha = logadd((fw[((i-1)*n_ref)+j] + nJ),(J + c));
-      fw[i * n_ref + j] = alpha + EMISS(s[i],S[j][i],g);
-    }
+    fwrow(P, s, i, &(fw[(i-1) * n_ref]), &(fw[i * n_ref]));
   }
   return fw;
 }
 
-/* Backward algorithm
- * Note that the memory it returns (same form as ls) is heap-allocated and so
- * must be freed. bw[i][j] is the probability that we observe SNPs [i,n]
- * given that we are in state j at time i.
- * Note also that the probabilities it returns are ln-scaled.
+/* Backward algorithm, fused with smoothing
+ * Turns the forward matrix fw (as returned by forward()) into smoothed
+ * probabilities in place, in the same form as ls(). Only the current backward
+ * row is kept: bw[i][j], the probability that we observe SNPs [i,n] given
+ * that we are in state j at time i, is computed over bw[i+1][j], right after
+ * row i of fw has been combined with it. If sink isn't empty, each row is
+ * passed to it as soon as it's done, from the last SNP to the first.
+ * Note also that the probabilities are ln-scaled.
  */
-float* backward(genome_t sample, std::string id, genome_t ref, float g, float theta) {
-  int n_ref = g_nsample(ref);
-  int n_snp = g_nsnp(ref);
+void smoothback(lspanel* P, uint8_t* s, float* fw, const ls_sink& sink) {
+  int n_ref = P->nsample;
+  int n_snp = P->nsnp;
 
   // Initialize memory
-  float* bw = (float*)malloc(sizeof(float) * n_snp * n_ref);
-
-  // Get snp arrays
-  snp_t* s = g_plookup(sample,id);
-  snp_t** S = new snp_t*[n_ref];
-  int i = 0;
-  for (auto id : *ref) {
-    S[i] = g_plookup(ref,id.first);
-    i++;
-  }
+  float* bw = (float*)malloc(sizeof(float) * n_ref);
+
+  // The last row has nothing after it
+  float* row = &(fw[(n_snp - 1) * n_ref]);
+  logrownorm(row, n_ref);
+  if (sink) sink(n_snp - 1, row);
 
   // Initialize the last row
-  float c = log(1.0f / ((float)n_ref)); // probability of jumping to given ref
-  for (int i = 0; i < n_ref; i++)
-    bw[i + (n_snp - 1) * n_ref] = EMISS(s[n_snp - 1],S[i][n_snp - 1],g);
+  bwrow(P, s, n_snp - 1, NULL, bw);
 
   // For each iteration
   for (int i = n_snp - 2; i >= 0; i--) {
-    // Precompute reverse jump probability
-    logrownorm(&(bw[(i+1)* n_ref]),n_ref);
-    float nJ = -1 * theta * g_rec_dist(ref, i);
-    float J = logsub1(nJ);
+    // Smooth row i with row i+1 of bw
+    logrownorm(bw, n_ref);
+    row = &(fw[i * n_ref]);
+    for (int j = 0; j < n_ref; j++) row[j] += bw[j];
+    logrownorm(row, n_ref);
+    if (sink) sink(i, row);
 
-    // Calculate values
-    for (int j = 0; j < n_ref; j++) {
-      float alpha = logadd(J + c, nJ + bw[(i+1) * n_ref + j]);
-      bw[i * n_ref + j] = alpha + EMISS(s[i],S[j][i],g);
-    }
+    bwrow(P, s, i, bw, bw);
   }
-  return bw;
-}
-
-/* Returns smoothed Li-Stephens probabilities in the same form they are returned
- * by ls().  Takes forward and backward matrices, handles freeing of them,
- * returns a heap-allocated array.
- */
-float* smooth(float* fw, float* bw, int n_snp, int n_ref) {
-  for (int i = 0; i < (n_snp-1); i++) {
-    for (int j = 0; j < n_ref; j++) {
-      fw[i * n_ref + j] = fw[i * n_ref + j] + bw[(i+1) * n_ref + j];
-    }
-    logrownorm(fw + (i * n_ref), n_ref);
-  }
-  logrownorm(fw + ((n_snp-1) * n_ref), n_ref);
   free(bw);
-  return fw;
 }
 
 /* Returns smoothed Li-Stephens probabilities as a two-dimensional,
@@ -148,16 +171,113 @@ float* smooth(float* fw, float* bw, int n_snp, int n_ref) {
  *   reference from which it comes.
  * theta - Recombination rate constant, s.t. jump probability is
  *   1-e^{-theta d}, where d is distance in centimorgans
+ * (all three are taken from the prepared panel P here)
  */
-float* ls(genome_t sample, std::string id, genome_t ref, float g, float theta) {
+float* ls(lspanel* P, uint8_t* snps) {
   // Forward pass
-  float* fw = forward(sample, id, ref, g, theta);
+  float* fw = forward(P, snps);
+
+  // Backward and smoothing passes
+  smoothback(P, snps, fw, ls_sink());
+  return fw;
+}
+
+void ls(lspanel* P, uint8_t* snps, ls_sink sink) {
+  float* fw = forward(P, snps);
+  smoothback(P, snps, fw, sink);
+  free(fw);
+}
+
+/* The forward sweep for ls_meet(): stores normalized rows [0, mid) in A, then
+ * (once the backward sweep has stored its half) smooths rows [mid, n_snp)
+ * itself as it reaches them.
+ */
+static void meetforward(lspanel* P, uint8_t* s, float* A, int mid,
+    barrier* bar) {
+  int n_ref = P->nsample;
+  int n_snp = P->nsnp;
+  float* cur = (float*)malloc(sizeof(float) * n_ref);
+  float* prev = (float*)malloc(sizeof(float) * n_ref);
+
+  for (int i = 0; i < n_snp; i++) {
+    if (i == mid) bar->wait();
+    fwrow(P, s, i, i == 0 ? NULL : prev, cur);
+    logrownorm(cur, n_ref);
+
+    float* row = &(A[i * n_ref]);
+    if (i < mid) {
+      for (int j = 0; j < n_ref; j++) row[j] = cur[j];
+    }
+    else if (i < n_snp - 1) {
+      // Row i+1 holds the backward row until it's smoothed in turn
+      float* bw = &(A[(i+1) * n_ref]);
+      for (int j = 0; j < n_ref; j++) row[j] = cur[j] + bw[j];
+      logrownorm(row, n_ref);
+    }
+    else {
+      for (int j = 0; j < n_ref; j++) row[j] = cur[j];
+    }
 
-  // Backward pass
-  float* bw = backward(sample, id, ref, g, theta);
+    float* t = prev;
+    prev = cur;
+    cur = t;
+  }
+  if (mid >= n_snp) bar->wait();
+  free(cur);
+  free(prev);
+}
+
+/* The backward sweep for ls_meet(): stores normalized rows (mid, n_snp) in A,
+ * then smooths rows [0, mid) over the forward rows stored there.
+ */
+static void meetbackward(lspanel* P, uint8_t* s, float* A, int mid,
+    barrier* bar) {
+  int n_ref = P->nsample;
+  int n_snp = P->nsnp;
+  float* bw = (float*)malloc(sizeof(float) * n_ref);
+
+  bwrow(P, s, n_snp - 1, NULL, bw);
+  bool met = false;
+  for (int i = n_snp - 2; i >= 0; i--) {
+    logrownorm(bw, n_ref);
+    if (i >= mid) {
+      float* row = &(A[(i+1) * n_ref]);
+      for (int j = 0; j < n_ref; j++) row[j] = bw[j];
+    }
+    else {
+      if (!met) bar->wait();
+      met = true;
+      float* row = &(A[i * n_ref]);
+      for (int j = 0; j < n_ref; j++) row[j] += bw[j];
+      logrownorm(row, n_ref);
+    }
+    if (i > 0) bwrow(P, s, i, bw, bw);
+  }
+  if (!met) bar->wait();
+  free(bw);
+}
+
+float* ls_meet(lspanel* P, uint8_t* snps, workpool* pool) {
+  if (pool->nthread < 2) return ls(P, snps);
+
+  int n_snp = P->nsnp;
+  int mid = n_snp / 2;
+  float* A = (float*)malloc(sizeof(float) * n_snp * P->nsample);
+  barrier bar(2);
+  pool->team([&](int tid) {
+    if (tid == 0) meetforward(P, snps, A, mid, &bar);
+    if (tid == 1) meetbackward(P, snps, A, mid, &bar);
+  });
+  return A;
+}
+
+// Convenience wrapper that prepares a throwaway panel for a single haplotype
+float* ls(genome_t sample, std::string id, genome_t ref, float g, float theta) {
+  lspanel P(ref, g, theta);
+  uint8_t* s = P.sample(sample, id);
 
-  // Smoothing pass
-  float* P = smooth(fw,bw, g_nsnp(ref), g_nsample(ref));
+  float* A = ls(&P, s);
 
-  return P;
+  delete[] s;
+  return A;
 }
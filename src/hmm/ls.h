@@ -5,6 +5,22 @@
 #define LS_H
 
 //#include <plinker/genome_c.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+class workpool;
+class lspanel;
+
+// Emission for a reference whose mismatch bit (see hapmat::mismatch) is m,
+// looked up in a panel's table of the two (lspanel::emiss or pemiss)
+#define EMISSBIT(m, E) ((E)[(m)])
+
+// Log-space helpers, shared by the sequential and parallel engines
+float logadd(float x, float y);
+float logsum(float* A, int n);
+float logsub1(float x);
+void logrownorm(float* A, int n);
 
 /* Returns smoothed Li-Stephens probabilities as a two-dimensional,
  * heap-allocated array A[s][n], where s is the number of SNPs and n the number
@@ -19,4 +35,171 @@
  */
 float* ls(genome_t sample, std::string id, genome_t ref, float g, float theta);
 
+/* Same as above, for haplotype snps (as returned by lspanel::sample) against
+ * a prepared panel. Nothing about the panel is recomputed, so this is the one
+ * to call when imputing more than one haplotype against the same reference.
+ */
+float* ls(lspanel* P, uint8_t* snps);
+
+/* Receives row i of smoothed probabilities (n floats, one per reference). The
+ * row is only valid for the duration of the call.
+ */
+typedef std::function<void(int, const float*)> ls_sink;
+
+/* Same as above, but hands each row to sink (in decreasing SNP order) instead
+ * of returning them all. The backward pass keeps only its current row and
+ * smooths as it goes, so this holds just the forward matrix, and nothing is
+ * left to free.
+ */
+void ls(lspanel* P, uint8_t* snps, ls_sink sink);
+
+/* Same as ls(), but splits every SNP row across the threads of pool: each
+ * thread reduces and updates its own contiguous block of reference genomes,
+ * and the per-block log sums are combined after a barrier. Results agree with
+ * ls() up to float reassociation in the row sums.
+ */
+float* ls_par(genome_t sample, std::string id, genome_t ref, float g,
+    float theta, workpool* pool);
+float* ls_par(lspanel* P, uint8_t* snps, workpool* pool);
+
+/* Same as ls(), with the forward and backward sweeps running at once on two
+ * threads of pool (the rest sit this one out), meeting in the middle: each
+ * stores its first half of the rows, and once both are halfway each smooths
+ * the other's stored half as its own sweep reaches it. Same arithmetic as
+ * ls(), so results are identical, in about half the time for one haplotype,
+ * and the result matrix is the only memory of that size. With fewer than two
+ * threads in pool, it's just ls().
+ */
+float* ls_meet(lspanel* P, uint8_t* snps, workpool* pool);
+
+// Instruction sets the vectorized engine has kernels for, in increasing order
+enum lsisa { LS_SCALAR, LS_AVX2, LS_AVX512 };
+
+// Best instruction set this CPU supports
+lsisa ls_vec_isa();
+
+/* Same as ls(), on vectorized row kernels (8 references per instruction with
+ * AVX2, 16 with AVX-512) picked at runtime. exp and log are polynomial
+ * approximations and row sums are reassociated, so results agree with ls() to
+ * within 1e-4 absolute in probability (not log) space rather than exactly.
+ * (ls() itself drifts by about 1e-5 from exact on rows a few hundred wide.)
+ * The isa overload caps the instruction set used, which is mostly useful for
+ * testing and benchmarking.
+ */
+float* ls_vec(genome_t sample, std::string id, genome_t ref, float g,
+    float theta);
+float* ls_vec(lspanel* P, uint8_t* snps);
+float* ls_vec(lspanel* P, uint8_t* snps, lsisa isa);
+
+/* Same as ls(), computed in linear space with per-row scaling instead of in
+ * log space, so each cell is a couple of multiplies and adds. With linear set
+ * the result holds probabilities rather than their logs. If loglik isn't
+ * NULL, it gets the log-likelihood of snps under the model (with a uniform
+ * prior over references), recovered from the forward scales.
+ *
+ * Results agree with ls() to within 1e-4 absolute in probability space, but
+ * probabilities below float range (about 1e-38) come back as 0, i.e. -inf in
+ * log space, where ls() would give a very negative log.
+ */
+float* ls_lin(genome_t sample, std::string id, genome_t ref, float g,
+    float theta);
+float* ls_lin(lspanel* P, uint8_t* snps);
+float* ls_lin(lspanel* P, uint8_t* snps, bool linear, double* loglik);
+
+// Same as ls_lin() on just SNPs [lo, hi) of the panel, as though it had no
+// others, giving hi - lo rows: row i is for SNP lo + i
+float* ls_lin(lspanel* P, uint8_t* snps, int lo, int hi, bool linear);
+
+// Most targets ls_multi() runs at once
+#define LS_MULTI_MAX 32
+
+/* Runs nt (at most LS_MULTI_MAX) haplotypes snps[0..nt) against the panel at
+ * once, with their rows interleaved so every panel read and emission lookup
+ * is shared by the whole batch, and sets out[b] to the result for snps[b], in
+ * the same form as ls(), or as probabilities with linear set. Same arithmetic
+ * as ls_lin(), so the same caveats apply. Takes about as much working memory
+ * as the nt results themselves.
+ */
+void ls_multi(lspanel* P, uint8_t** snps, int nt, bool linear, float** out);
+
+/* Same as ls_lin(), without ever holding the whole result: each smoothed row
+ * is handed to sink as soon as it's known, in decreasing SNP order, and
+ * forward rows are only checkpointed every k SNPs and recomputed a segment at
+ * a time on the way back. The engine uses at most budget bytes of working
+ * memory (not counting the panel), and as little as ls_ckpt_min() for one
+ * extra forward pass; a budget of 0 means use the least. Returns false,
+ * without calling sink, if budget is too small.
+ */
+bool ls_ckpt(lspanel* P, uint8_t* snps, size_t budget, bool linear,
+    ls_sink sink);
+
+// Least working memory, in bytes, ls_ckpt() can run in for a panel this size
+size_t ls_ckpt_min(int nsnp, int nref);
+
+// Burn-in ls_chunk() runs either side of a window, as a fraction of its width
+#define LS_CHUNK_BURNIN 0.25f
+
+// Windows ls_chunk() lets each thread get ahead of the next one due
+#define LS_CHUNK_AHEAD 2
+
+/* Same as ls_lin(), with the SNPs cut into windows that run in parallel on
+ * the threads of pool, for the latency of a single haplotype. A window
+ * starts at the first SNP at least width (genetic distance, as in dists)
+ * past the start of the one before, and runs as if the panel held just its
+ * own SNPs and burnin either side, whose rows are thrown away. Each row goes
+ * to sink once every earlier one has, in increasing SNP order, never
+ * concurrently but not necessarily from the calling thread.
+ *
+ * Windows forget everything outside their burn-in, so rows differ from
+ * ls_lin()'s, most near the window edges and least with burnin well past
+ * 1/theta. Windows are started in order, and none more than
+ * LS_CHUNK_AHEAD per thread past the next one due, so at most that many
+ * windows' rows (their own SNPs plus burn-in, a row of nsample floats each)
+ * are held at once, however long the chromosome.
+ */
+void ls_chunk(lspanel* P, uint8_t* snps, float width, float burnin,
+    workpool* pool, bool linear, ls_sink sink);
+
+// Default beam width and mass threshold of ls_beam()
+#define LS_BEAM_WIDTH 64
+#define LS_BEAM_EPS 1e-5f
+
+/* Same as ls_lin(), tracking only a beam of states per row: at most width of
+ * them, and none under eps of the row's mass (so never more than 1 / eps).
+ * Every other reference only gets the uniform jump, with the stay mass it
+ * would have had spread over the whole row. States join the beam from the
+ * rest by the longest current run of matches to the target.
+ *
+ * With a width of at least the panel's size and eps 0 nothing is pruned, and
+ * results agree with ls_lin(). Otherwise they're approximate, and if lost
+ * isn't NULL, lost[i] gets the mass the forward and backward steps at SNP i
+ * spread or changed to keep to the beam, as a share of the row. Each step's
+ * row is at most twice its part away from the exact step's, in L1.
+ */
+float* ls_beam(lspanel* P, uint8_t* snps, int width, float eps, bool linear,
+    float* lost);
+
+/* Smoothed probabilities cut down to the likeliest states of each SNP, in
+ * compressed sparse row form: row i keeps the states col[ptr[i]] up to (not
+ * including) col[ptr[i+1]], likeliest first, with probabilities (never logs)
+ * in val, and rest[i] is what's left for all the others together.
+ */
+struct lscsr {
+  int nsnp;
+  int nref;
+  int* ptr; // nsnp + 1 offsets into col and val
+  int* col;
+  float* val;
+  float* rest;
+};
+
+/* Same probabilities as ls_lin(), keeping at most k states per SNP (any
+ * number for k 0) and none under eps. Rows are cut down inside the smoothing
+ * pass of ls_ckpt(), at its least memory, so the dense matrix is never held,
+ * for the cost of one more forward pass. Returns NULL if that fails; free the
+ * result with lscsr_free().
+ */
+lscsr* ls_top(lspanel* P, uint8_t* snps, int k, float eps);
+void lscsr_free(lscsr* R);
+
 #endif /* LS_H */
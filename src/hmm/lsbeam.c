@@ -0,0 +1,434 @@
+/* Beam-pruned Li-Stephens model.
+ *
+ * Most of the mass of a row sits on a handful of references, and everything
+ * the recurrence does for the rest is the uniform jump plus a stay term too
+ * small to matter. So each sweep only tracks a beam of states exactly; every
+ * other reference is background, with the value e[i][j] * x[i] before
+ * normalization. That's exact for the jump part. The stay mass of the
+ * background goes into the jump, since
+ *   sum over j of (a * fw[i-1][j] / c + b) = a + n * b = 1
+ * whichever states it's spread over, so x[i] = b + a * bg[i-1] / (c * n),
+ * where bg[i-1] is the background's share of row i-1.
+ *
+ * States join the beam from the background by the longest run of matches to
+ * the target ending at the current SNP, the ones the exact recurrence would
+ * be growing fastest. They're valued by the history since their last
+ * mismatch: one table T[r] per sweep, for every run length r, follows the
+ * recurrence the way a state matching all along would. The runs are counted
+ * with saturating bit-sliced counters, a bit of every plane per reference.
+ *
+ * What a step spreads and what it changes for the states joining or leaving
+ * the beam are counted per SNP. Together they can't move the row further
+ * than twice their sum from where the exact step would have put it, in L1.
+ *
+ * A row costs O(width log width) for the beam and O(n / 64) words for the
+ * background, and the dense result is the only O(n) work per SNP: the
+ * background of a smoothed row takes one of four values, set by whether the
+ * reference matches the target at this SNP and at the next.
+ */
+
+#include "../plinker/genome_c.h"
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "ls.h"
+#include "panel.h"
+#include "../plinker/hapmat.h"
+
+// Width of the match-run counters: runs saturate at RUNMAX
+#define RUNBITS 8
+#define RUNMAX ((1 << RUNBITS) - 1)
+
+// States from the background need to beat the beam by this factor to join it,
+// or identical references would keep trading places
+#define JOINMARGIN 0.999f
+
+// A row of one sweep: the states in its beam with their values, and x, with
+// e[j] * x for every other state j. c is the sum of the row and bg the
+// background's part of it.
+struct beamrow {
+  std::vector<int> idx;
+  std::vector<float> val;
+  float x;
+  double c;
+  double bg;
+};
+
+// Everything a sweep carries from one row to the next
+struct sweep {
+  lspanel* P;
+  uint8_t* snps;
+  int width;
+  float eps;
+  int nword;
+  std::vector<uint64_t> m; // mismatch bits at the current SNP
+  std::vector<uint64_t> in; // beam membership, a bit per reference
+  std::vector<uint64_t> run; // RUNBITS planes of nword words
+  std::vector<float> T; // value of a background state by its match run
+  std::vector<uint64_t> pre; // scratch for admit()
+  std::vector<uint64_t> take;
+  std::vector<int> order;
+  std::vector<int> cidx;
+  std::vector<float> cval;
+};
+
+static void sweepinit(sweep* W, lspanel* P, uint8_t* snps, int width,
+    float eps) {
+  W->P = P;
+  W->snps = snps;
+  W->width = width;
+  W->eps = eps;
+  W->nword = P->ref->nword;
+  W->m.assign(W->nword, 0);
+  W->in.assign(W->nword, 0);
+  W->run.assign((size_t)RUNBITS * W->nword, 0);
+  W->T.assign(RUNMAX + 1, 0.0f);
+  W->pre.assign(W->nword, 0);
+  W->take.assign(W->nword, 0);
+}
+
+// Loads the mismatch bits of snp and extends or resets the match runs
+static void sweepload(sweep* W, int snp) {
+  const hapmat* S = W->P->ref.get();
+  int nw = W->nword;
+  for (int w = 0; w < nw; w++) {
+    uint64_t m = S->mismatch(snp, w, W->snps[snp]);
+    W->m[w] = m;
+
+    // Add 1 to every matching counter, saturating, then zero the rest
+    uint64_t carry = ~m;
+    for (int b = 0; b < RUNBITS; b++) {
+      uint64_t& p = W->run[(size_t)b * nw + w];
+      uint64_t t = p & carry;
+      p ^= carry;
+      carry = t;
+    }
+    for (int b = 0; b < RUNBITS; b++) {
+      uint64_t& p = W->run[(size_t)b * nw + w];
+      p = (p | carry) & ~m;
+    }
+  }
+}
+
+// Current match run of reference j
+static int runof(const sweep* W, int j) {
+  int r = 0;
+  for (int b = 0; b < RUNBITS; b++) {
+    r |= ((W->run[(size_t)b * W->nword + (j >> 6)] >> (j & 63)) & 1) << b;
+  }
+  return r;
+}
+
+/* Appends to out the need states set in W->pre with the longest match runs,
+ * picking them a bit plane at a time from the top. W->pre must have at least
+ * need states, and is left with scratch.
+ */
+static void admit(sweep* W, int need, std::vector<int>& out) {
+  int nw = W->nword;
+  std::vector<uint64_t>& pre = W->pre;
+  std::vector<uint64_t>& take = W->take;
+  for (int w = 0; w < nw; w++) take[w] = 0;
+  for (int b = RUNBITS - 1; b >= 0 && need > 0; b--) {
+    const uint64_t* p = &(W->run[(size_t)b * nw]);
+    int cnt = 0;
+    for (int w = 0; w < nw; w++) cnt += __builtin_popcountll(pre[w] & p[w]);
+    if (cnt >= need) {
+      for (int w = 0; w < nw; w++) pre[w] &= p[w];
+    }
+    else {
+      for (int w = 0; w < nw; w++) {
+        take[w] |= pre[w] & p[w];
+        pre[w] &= ~p[w];
+      }
+      need -= cnt;
+    }
+  }
+  for (int w = 0; w < nw; w++) {
+    for (uint64_t t = take[w]; t != 0; t &= t - 1) {
+      out.push_back(64 * w + __builtin_ctzll(t));
+    }
+    for (uint64_t t = pre[w]; t != 0 && need > 0; t &= t - 1, need--) {
+      out.push_back(64 * w + __builtin_ctzll(t));
+    }
+  }
+}
+
+// Loads W->pre with the background states that match the target at the
+// current SNP, or those that don't with mismatch set, and returns how many
+static int background(sweep* W, bool mismatch) {
+  int n = W->P->nsample;
+  int nw = W->nword;
+  int avail = 0;
+  for (int w = 0; w < nw; w++) {
+    W->pre[w] = (mismatch ? W->m[w] : ~W->m[w]) & ~W->in[w];
+    // Padding bits always mismatch
+    if (w == nw - 1 && (n & 63) != 0) {
+      W->pre[w] &= ((uint64_t)1 << (n & 63)) - 1;
+    }
+    avail += __builtin_popcountll(W->pre[w]);
+  }
+  return avail;
+}
+
+/* Row snp of a sweep into out, from the row before it (in sweep order) in
+ * prev, with stay a and jump b, or from every state at x0 for prev NULL.
+ * Returns the mass the step moved: the background's stay mass spread over
+ * every state, and the mass dropped from the beam or given to states joining
+ * it, as shares of their rows.
+ */
+static double beamstep(sweep* W, int snp, const beamrow* prev, float a,
+    float b, float x0, beamrow* out) {
+  int n = W->P->nsample;
+  int nw = W->nword;
+  const float* E = W->P->pemiss;
+  sweepload(W, snp);
+  const uint64_t* m = W->m.data();
+
+  double moved = 0.0;
+  float x = x0;
+  int np = 0;
+  std::vector<int>& cidx = W->cidx;
+  std::vector<float>& cval = W->cval;
+  cidx.clear();
+  cval.clear();
+  std::vector<float>& T = W->T;
+  if (prev != NULL) {
+    float inv = 1.0 / prev->c;
+    x = b + (float)(a * prev->bg * inv / n);
+    moved += a * prev->bg * inv;
+    np = prev->idx.size();
+    for (int k = 0; k < np; k++) {
+      int j = prev->idx[k];
+      float e = EMISSBIT((m[j >> 6] >> (j & 63)) & 1, E);
+      cidx.push_back(j);
+      cval.push_back(e * (a * prev->val[k] * inv + x));
+    }
+    T[RUNMAX] = E[0] * (a * T[RUNMAX] * inv + x);
+    for (int r = RUNMAX - 1; r >= 1; r--) {
+      T[r] = E[0] * (a * T[r-1] * inv + x);
+    }
+  }
+  else {
+    for (int r = 1; r <= RUNMAX; r++) T[r] = E[0] * x;
+  }
+  // Nothing before a mismatch is kept
+  T[0] = E[1] * x;
+
+  // Background states at a match and at a mismatch, as the row's sum sees
+  // them
+  float vm = E[0] * x;
+  float vx = E[1] * x;
+  int nmatch = 0;
+  int nbgmatch = 0;
+  for (int w = 0; w < nw; w++) {
+    nmatch += __builtin_popcountll(~m[w]);
+    nbgmatch += __builtin_popcountll(~m[w] & ~W->in[w]);
+  }
+  double total = (double)vm * nbgmatch + (double)vx * (n - np - nbgmatch);
+  for (int k = 0; k < np; k++) total += cval[k];
+  float thresh = W->eps * total;
+
+  // Background matches with the longest runs compete with the beam for its
+  // places, valued by the history since their last mismatch
+  int need = background(W, false);
+  if (need > W->width) need = W->width;
+  admit(W, need, cidx);
+  for (size_t k = np; k < cidx.size(); k++) {
+    cval.push_back(T[runof(W, cidx[k])]);
+  }
+
+  std::vector<int>& order = W->order;
+  order.resize(cidx.size());
+  for (size_t k = 0; k < order.size(); k++) order[k] = k;
+  std::sort(order.begin(), order.end(),
+      [&](int p, int q) {
+        float vp = p < np ? cval[p] : cval[p] * JOINMARGIN;
+        float vq = q < np ? cval[q] : cval[q] * JOINMARGIN;
+        return vp > vq;
+      });
+
+  // Keep the width best over thresh; the rest drop to the background
+  out->idx.clear();
+  out->val.clear();
+  int nc = order.size();
+  int keep = 0;
+  while (keep < nc && keep < W->width && cval[order[keep]] >= thresh) keep++;
+  double shift = 0.0;
+  for (int k = 0; k < nc; k++) {
+    int c = order[k];
+    int j = cidx[c];
+    float e = EMISSBIT((m[j >> 6] >> (j & 63)) & 1, E);
+    if (k < keep) {
+      out->idx.push_back(j);
+      out->val.push_back(cval[c]);
+      if (c >= np) shift += fabs(cval[c] - e * x);
+    }
+    else if (c < np) {
+      shift += fabs(cval[c] - e * x);
+    }
+  }
+
+  // Mismatches only ever fill what's left, which takes a beam about as wide
+  // as the panel
+  int slots = W->width - keep;
+  if (slots > 0 && vx >= thresh) {
+    if (prev != NULL) {
+      for (int j : prev->idx) W->in[j >> 6] &= ~((uint64_t)1 << (j & 63));
+    }
+    for (int j : out->idx) W->in[j >> 6] |= (uint64_t)1 << (j & 63);
+    int avail = background(W, true);
+    admit(W, avail < slots ? avail : slots, out->idx);
+    out->val.resize(out->idx.size(), vx);
+  }
+
+  if (prev != NULL) {
+    for (int j : prev->idx) W->in[j >> 6] &= ~((uint64_t)1 << (j & 63));
+  }
+  int beammatch = 0;
+  double sum = 0.0;
+  for (size_t k = 0; k < out->idx.size(); k++) {
+    int j = out->idx[k];
+    W->in[j >> 6] |= (uint64_t)1 << (j & 63);
+    beammatch += !((m[j >> 6] >> (j & 63)) & 1);
+    sum += out->val[k];
+  }
+  int nbg = n - out->idx.size();
+  out->x = x;
+  out->bg = (double)vm * (nmatch - beammatch)
+      + (double)vx * (nbg - (nmatch - beammatch));
+  out->c = sum + out->bg;
+
+  // Joining states can bring more than the background had for them, so this
+  // is a share of whichever row is bigger
+  moved += shift / (out->c > total ? out->c : total);
+  return moved;
+}
+
+/* Smoothed row i into row, from forward row f at SNP i and backward row bw at
+ * SNP i + 1 (bw NULL at the last SNP). mark must be n zeros, and is left
+ * that way.
+ */
+static void beamsmooth(lspanel* P, uint8_t* snps, int i, const beamrow* f,
+    const beamrow* bw, std::vector<int>& mark, bool linear, float* row) {
+  int n = P->nsample;
+  const hapmat* S = P->ref.get();
+  const float* E = P->pemiss;
+  int nw = S->nword;
+
+  // Background classes by mismatch at i (bit 0) and at i + 1 (bit 1)
+  double cls[4];
+  int cnt[4] = { 0, 0, 0, 0 };
+  for (int k = 0; k < 4; k++) {
+    double bv = bw == NULL ? (k < 2 ? 1.0 : 0.0) : E[k >> 1] * bw->x;
+    cls[k] = E[k & 1] * f->x * bv;
+  }
+  for (int w = 0; w < nw; w++) {
+    uint64_t mi = S->mismatch(i, w, snps[i]);
+    uint64_t mn = bw == NULL ? 0 : S->mismatch(i + 1, w, snps[i+1]);
+    uint64_t valid = w < nw - 1 || (n & 63) == 0 ? ~(uint64_t)0
+        : ((uint64_t)1 << (n & 63)) - 1;
+    cnt[0] += __builtin_popcountll(~mi & ~mn & valid);
+    cnt[1] += __builtin_popcountll(mi & ~mn & valid);
+    cnt[2] += __builtin_popcountll(~mi & mn & valid);
+    cnt[3] += __builtin_popcountll(mi & mn & valid);
+  }
+  double sum = 0.0;
+  for (int k = 0; k < 4; k++) sum += cnt[k] * cls[k];
+
+  // States in either beam, as (state, value, class) in order, with mark set
+  // to 1 + their place in bw's beam while finding those in both
+  auto klass = [&](int j) {
+    int k = S->get(i, j) != snps[i];
+    if (bw != NULL) k |= (S->get(i + 1, j) != snps[i+1]) << 1;
+    return k;
+  };
+  std::vector<int> who;
+  std::vector<double> val;
+  int nb = bw == NULL ? 0 : bw->idx.size();
+  for (int k = 0; k < nb; k++) mark[bw->idx[k]] = k + 1;
+  for (size_t k = 0; k < f->idx.size(); k++) {
+    int j = f->idx[k];
+    int c = klass(j);
+    double bv = mark[j] > 0 ? bw->val[mark[j] - 1]
+        : (bw == NULL ? 1.0 : E[c >> 1] * bw->x);
+    mark[j] = -1;
+    who.push_back(j);
+    val.push_back(f->val[k] * bv);
+    sum += val.back() - cls[c];
+  }
+  for (int k = 0; k < nb; k++) {
+    int j = bw->idx[k];
+    if (mark[j] != -1) {
+      int c = klass(j);
+      who.push_back(j);
+      val.push_back(E[c & 1] * f->x * bw->val[k]);
+      sum += val.back() - cls[c];
+    }
+    mark[j] = 0;
+  }
+  for (int j : f->idx) mark[j] = 0;
+
+  double inv = 1.0 / sum;
+  float fill[4];
+  for (int k = 0; k < 4; k++) {
+    fill[k] = linear ? cls[k] * inv : log(cls[k] * inv);
+  }
+  for (int w = 0; w < nw; w++) {
+    uint64_t mi = S->mismatch(i, w, snps[i]);
+    uint64_t mn = bw == NULL ? 0 : S->mismatch(i + 1, w, snps[i+1]);
+    int lo = 64 * w;
+    int hi = lo + 64 < n ? lo + 64 : n;
+    for (int j = lo; j < hi; j++) {
+      row[j] = fill[((mi >> (j & 63)) & 1) | (((mn >> (j & 63)) & 1) << 1)];
+    }
+  }
+  for (size_t k = 0; k < who.size(); k++) {
+    row[who[k]] = linear ? val[k] * inv : log(val[k] * inv);
+  }
+}
+
+float* ls_beam(lspanel* P, uint8_t* snps, int width, float eps, bool linear,
+    float* lost) {
+  int n_ref = P->nsample;
+  int n_snp = P->nsnp;
+  float* A = (float*)malloc(sizeof(float) * n_snp * (size_t)n_ref);
+
+  // Forward sweep, keeping every row's beam
+  std::vector<beamrow> fw(n_snp);
+  std::vector<double> moved(n_snp, 0.0);
+  sweep W;
+  sweepinit(&W, P, snps, width, eps);
+  for (int i = 0; i < n_snp; i++) {
+    if (i == 0) {
+      moved[i] = beamstep(&W, 0, NULL, 0.0f, 0.0f, 1.0f / n_ref, &fw[0]);
+    }
+    else {
+      moved[i] = beamstep(&W, i, &fw[i-1], P->stay[i-1], P->jump[i-1], 0.0f,
+          &fw[i]);
+    }
+  }
+
+  // Backward sweep, smoothing each row as soon as the one after it is known;
+  // the last row is just the emission, as in ls_lin()
+  sweepinit(&W, P, snps, width, eps);
+  std::vector<int> mark(n_ref, 0);
+  beamrow bw, next;
+  for (int i = n_snp - 1; i >= 0; i--) {
+    beamsmooth(P, snps, i, &fw[i], i == n_snp - 1 ? NULL : &bw, mark, linear,
+        &(A[(size_t)i * n_ref]));
+    if (i == n_snp - 1) {
+      moved[i] += beamstep(&W, i, NULL, 0.0f, 0.0f, 1.0f, &next);
+    }
+    else {
+      moved[i] += beamstep(&W, i, &bw, P->stay[i], P->jump[i], 0.0f, &next);
+    }
+    std::swap(bw, next);
+  }
+
+  if (lost != NULL) {
+    for (int i = 0; i < n_snp; i++) lost[i] = moved[i];
+  }
+  return A;
+}
@@ -0,0 +1,126 @@
+/* Chunk-parallel Li-Stephens model.
+ *
+ * A forward row needs the sum of the one before it, so one haplotype's sweep
+ * is serial in SNPs however many threads there are. Cutting the chromosome
+ * into windows breaks that chain: jump probabilities approach 1 over a
+ * few multiples of 1/theta, so a forward (or backward) sweep started a
+ * burn-in's distance away from a window from a uniform prior has mostly
+ * forgotten the prior by the time it reaches the window. Each window then
+ * runs the whole linear-space engine on its own thread, and its core rows
+ * are handed on in order.
+ */
+
+#include "../plinker/genome_c.h"
+#include "../pool/pool.h"
+#include <stdlib.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ls.h"
+#include "panel.h"
+
+// Rows and ranges of the windows, shared between the workers
+struct chunks {
+  int n_ref;
+  std::vector<int> core; // window w is SNPs [core[w], core[w+1])
+  std::vector<int> start; // first SNP window w ran over, burn-in included
+  std::unique_ptr<float*[]> rows;
+  std::unique_ptr<std::atomic<bool>[]> ready;
+  std::atomic<int> next;
+  std::mutex wlock;
+  // Next window to hand out, and what waits for next to move
+  std::mutex gate;
+  std::condition_variable moved;
+  int cursor;
+};
+
+// Hands the core rows of every consecutive finished window starting at
+// C->next to sink, the way ls_batch() hands out results: one thread at a
+// time, with a re-check after unlocking so nothing finished meanwhile is
+// left behind. Workers waiting for next to move are woken once it has.
+static void flush(chunks* C, ls_sink& sink) {
+  int nwin = C->core.size() - 1;
+  while (true) {
+    if (!C->wlock.try_lock()) return;
+    int w = C->next;
+    while (w < nwin && C->ready[w]) {
+      for (int i = C->core[w]; i < C->core[w+1]; i++) {
+        sink(i, &(C->rows[w][(size_t)(i - C->start[w]) * C->n_ref]));
+      }
+      free(C->rows[w]);
+      C->rows[w] = NULL;
+      w++;
+    }
+    int from = C->next;
+    C->next = w;
+    C->wlock.unlock();
+    if (w > from) {
+      // Taking the gate orders this against a worker about to wait
+      { std::lock_guard<std::mutex> lk(C->gate); }
+      C->moved.notify_all();
+    }
+    if (!(w < nwin && C->ready[w])) return;
+  }
+}
+
+void ls_chunk(lspanel* P, uint8_t* snps, float width, float burnin,
+    workpool* pool, bool linear, ls_sink sink) {
+  int n_snp = P->nsnp;
+
+  // Genetic position of every SNP
+  std::vector<double> pos(n_snp);
+  for (int i = 1; i < n_snp; i++) pos[i] = pos[i-1] + P->dists[i-1];
+
+  chunks C;
+  C.n_ref = P->nsample;
+  C.core.push_back(0);
+  for (int i = 1; i < n_snp; i++) {
+    if (pos[i] - pos[C.core.back()] >= width) C.core.push_back(i);
+  }
+  C.core.push_back(n_snp);
+
+  int nwin = C.core.size() - 1;
+  C.start.resize(nwin);
+  C.rows.reset(new float*[nwin]);
+  C.ready.reset(new std::atomic<bool>[nwin]);
+  for (int w = 0; w < nwin; w++) {
+    C.rows[w] = NULL;
+    C.ready[w] = false;
+  }
+  C.next = 0;
+  C.cursor = 0;
+  int ahead = LS_CHUNK_AHEAD * pool->nthread;
+
+  // Windows go out in order, and never ahead or more past the next one due
+  // to sink, so a slow early window can't leave the rest of the chromosome
+  // finished and waiting behind it
+  pool->team([&](int tid) {
+    while (true) {
+      int w;
+      {
+        std::unique_lock<std::mutex> lk(C.gate);
+        C.moved.wait(lk, [&]{
+          return C.cursor >= nwin || C.cursor < C.next + ahead;
+        });
+        if (C.cursor >= nwin) return;
+        w = C.cursor;
+        C.cursor++;
+      }
+
+      int lo = C.core[w];
+      int hi = C.core[w+1];
+      while (lo > 0 && pos[C.core[w]] - pos[lo-1] <= burnin) lo--;
+      while (hi < n_snp && pos[hi] - pos[C.core[w+1]-1] <= burnin) hi++;
+
+      C.start[w] = lo;
+      C.rows[w] = ls_lin(P, snps, lo, hi, linear);
+      C.ready[w] = true;
+      flush(&C, sink);
+    }
+  });
+
+  flush(&C, sink);
+}
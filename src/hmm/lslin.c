@@ -0,0 +1,251 @@
+/* Scaled linear-space implementation of the Li-Stephens model.
+ *
+ * Every row is renormalized on the next step anyway, so there's no need to
+ * stay in log space: with a = e^{nJ} (no jump) and b = (1 - a)/n (jump to any
+ * one reference), a forward step is
+ *   fw[i][j] = e[i][j] * (a * fw[i-1][j] / c[i-1] + b),
+ * where c[i-1] is the sum of row i-1, and a backward step is the same with
+ * bw[i+1] in place of fw[i-1]. That's two multiplies and an add per cell,
+ * against a log and an exp for logadd. Rows are never allowed to drift
+ * far from sum 1, so they stay well inside float range.
+ *
+ * The forward scales also give the log-likelihood of the target: starting
+ * from a uniform prior, log P(snps) = sum over i of log c[i].
+ *
+ * ls_ckpt() runs the same recurrences without keeping the forward matrix:
+ * the forward pass keeps only the first row of every segment of k SNPs, and
+ * the backward pass recomputes one segment at a time from its checkpoint,
+ * smoothing and handing off each row as soon as its backward row is known.
+ * That's nseg + k + 1 rows of memory for one extra forward pass.
+ */
+
+#include "../plinker/genome_c.h"
+#include <stdlib.h>
+#include <math.h>
+
+#include "ls.h"
+#include "panel.h"
+#include "../plinker/hapmat.h"
+
+/* out[j] = e[j] * (a * in[j] * inv + b), where e[j] is the emission of
+ * reference j at snp for target allele t, looked up in E (see
+ * lspanel::pemiss). With in NULL, out[j] = e[j] * b. Returns the sum of the
+ * row.
+ */
+static double linstep(float* out, const float* in, float inv, float a,
+    float b, const hapmat* S, int snp, int t, const float* E) {
+  int n = S->nhap;
+  double sum = 0.0;
+  for (int w = 0; w < S->nword; w++) {
+    uint64_t m = S->mismatch(snp, w, t);
+    int lo = 64 * w;
+    int hi = lo + 64 < n ? lo + 64 : n;
+    float part = 0.0f;
+    for (int j = lo; j < hi; j++) {
+      float e = EMISSBIT((m >> (j & 63)) & 1, E);
+      float x = in == NULL ? b : a * in[j] * inv + b;
+      out[j] = e * x;
+      part += out[j];
+    }
+    sum += part;
+  }
+  return sum;
+}
+
+/* ls_lin() over SNPs [lo, hi) of the panel alone, as if it had no others:
+ * row i of the result is SNP lo + i.
+ */
+static float* linrange(lspanel* P, uint8_t* snps, int lo, int hi,
+    bool linear, double* loglik) {
+  int n_ref = P->nsample;
+  int n_snp = hi - lo;
+  const float* E = P->pemiss;
+  const hapmat* S = P->ref.get();
+
+  float* fw = (float*)malloc(sizeof(float) * n_snp * n_ref);
+  float* bw = (float*)malloc(sizeof(float) * n_snp * n_ref);
+
+  // Forward pass, from a uniform prior
+  double ll = 0.0;
+  double c = linstep(fw, NULL, 0.0f, 0.0f, 1.0f / n_ref, S, lo, snps[lo], E);
+  ll += log(c);
+  for (int i = 1; i < n_snp; i++) {
+    float a = P->stay[lo+i-1];
+    float b = P->jump[lo+i-1];
+    c = linstep(&(fw[i * n_ref]), &(fw[(i-1) * n_ref]), 1.0 / c, a, b,
+        S, lo + i, snps[lo+i], E);
+    ll += log(c);
+  }
+  if (loglik != NULL) *loglik = ll;
+
+  // Backward pass; the last row is just the emission, as in ls()
+  c = linstep(&(bw[(n_snp-1) * n_ref]), NULL, 0.0f, 0.0f, 1.0f,
+      S, hi - 1, snps[hi-1], E);
+  for (int i = n_snp - 2; i >= 0; i--) {
+    float a = P->stay[lo+i];
+    float b = P->jump[lo+i];
+    c = linstep(&(bw[i * n_ref]), &(bw[(i+1) * n_ref]), 1.0 / c, a, b,
+        S, lo + i, snps[lo+i], E);
+  }
+
+  // Smoothing pass
+  for (int i = 0; i < n_snp; i++) {
+    float* row = &(fw[i * n_ref]);
+    double sum = 0.0;
+    if (i < n_snp - 1) {
+      for (int j = 0; j < n_ref; j++) row[j] *= bw[(i+1) * n_ref + j];
+    }
+    for (int j = 0; j < n_ref; j++) sum += row[j];
+    float inv = 1.0 / sum;
+    if (linear) {
+      for (int j = 0; j < n_ref; j++) row[j] *= inv;
+    }
+    else {
+      for (int j = 0; j < n_ref; j++) row[j] = log(row[j] * inv);
+    }
+  }
+
+  free(bw);
+  return fw;
+}
+
+float* ls_lin(lspanel* P, uint8_t* snps, bool linear, double* loglik) {
+  return linrange(P, snps, 0, P->nsnp, linear, loglik);
+}
+
+float* ls_lin(lspanel* P, uint8_t* snps, int lo, int hi, bool linear) {
+  return linrange(P, snps, lo, hi, linear, NULL);
+}
+
+/* Length of the segments ls_ckpt() should use for n_snp rows of n_ref floats
+ * in budget bytes: the longest that fits, since only the last segment is
+ * never recomputed, or ceil(sqrt(n_snp)) (the least memory) for a budget of
+ * 0. Returns 0 if nothing fits.
+ */
+static int ckptlen(int n_snp, int n_ref, size_t budget) {
+  if (budget == 0) {
+    int k = (int)ceil(sqrt((double)n_snp));
+    return k < 1 ? 1 : k;
+  }
+  size_t rows = budget / (sizeof(float) * n_ref);
+  for (int k = n_snp; k >= 1; k--) {
+    if ((size_t)((n_snp + k - 1) / k + k + 1) <= rows) return k;
+  }
+  return 0;
+}
+
+size_t ls_ckpt_min(int nsnp, int nref) {
+  int k = ckptlen(nsnp, nref, 0);
+  return sizeof(float) * nref * (size_t)((nsnp + k - 1) / k + k + 1);
+}
+
+bool ls_ckpt(lspanel* P, uint8_t* snps, size_t budget, bool linear,
+    ls_sink sink) {
+  int n_ref = P->nsample;
+  int n_snp = P->nsnp;
+  const float* E = P->pemiss;
+  const hapmat* S = P->ref.get();
+
+  int k = ckptlen(n_snp, n_ref, budget);
+  if (k == 0) return false;
+  int nseg = (n_snp + k - 1) / k;
+
+  // Row i of the segment being worked on is seg[i % k]; the forward pass
+  // also uses it as scratch, so the last segment is left there at the end
+  float* ckpt = (float*)malloc(sizeof(float) * nseg * (size_t)n_ref);
+  float* seg = (float*)malloc(sizeof(float) * k * (size_t)n_ref);
+  float* bw = (float*)malloc(sizeof(float) * n_ref);
+  if (ckpt == NULL || seg == NULL || bw == NULL) {
+    free(ckpt);
+    free(seg);
+    free(bw);
+    return false;
+  }
+
+  // Forward pass, saving the first row of every segment normalized
+  double c = 0.0;
+  for (int i = 0; i < n_snp; i++) {
+    float* row = &(seg[(size_t)(i % k) * n_ref]);
+    if (i == 0) {
+      c = linstep(row, NULL, 0.0f, 0.0f, 1.0f / n_ref, S, 0, snps[0], E);
+    }
+    else {
+      float a = P->stay[i-1];
+      float b = P->jump[i-1];
+      c = linstep(row, &(seg[(size_t)((i-1) % k) * n_ref]), 1.0 / c, a, b,
+          S, i, snps[i], E);
+    }
+    if (i % k == 0) {
+      float* cp = &(ckpt[(size_t)(i / k) * n_ref]);
+      float inv = 1.0 / c;
+      for (int j = 0; j < n_ref; j++) cp[j] = row[j] * inv;
+    }
+  }
+
+  // Backward pass, a segment at a time from the last
+  double cb = 0.0;
+  for (int s = nseg - 1; s >= 0; s--) {
+    int lo = s * k;
+    int hi = lo + k < n_snp ? lo + k : n_snp;
+
+    if (s < nseg - 1) {
+      for (int j = 0; j < n_ref; j++) seg[j] = ckpt[(size_t)s * n_ref + j];
+      double cf = 1.0;
+      for (int i = lo + 1; i < hi; i++) {
+        float a = P->stay[i-1];
+        float b = P->jump[i-1];
+        float* row = &(seg[(size_t)(i - lo) * n_ref]);
+        cf = linstep(row, row - n_ref, 1.0 / cf, a, b, S, i, snps[i], E);
+      }
+    }
+
+    for (int i = hi - 1; i >= lo; i--) {
+      // bw holds row i+1 here, except at the last SNP
+      float* row = &(seg[(size_t)(i - lo) * n_ref]);
+      double sum = 0.0;
+      if (i < n_snp - 1) {
+        for (int j = 0; j < n_ref; j++) row[j] *= bw[j];
+      }
+      for (int j = 0; j < n_ref; j++) sum += row[j];
+      float inv = 1.0 / sum;
+      if (linear) {
+        for (int j = 0; j < n_ref; j++) row[j] *= inv;
+      }
+      else {
+        for (int j = 0; j < n_ref; j++) row[j] = log(row[j] * inv);
+      }
+      sink(i, row);
+
+      // Each entry only depends on the same entry of the last row, so this
+      // is safe in place
+      if (i == n_snp - 1) {
+        cb = linstep(bw, NULL, 0.0f, 0.0f, 1.0f, S, i, snps[i], E);
+      }
+      else {
+        float a = P->stay[i];
+        float b = P->jump[i];
+        cb = linstep(bw, bw, 1.0 / cb, a, b, S, i, snps[i], E);
+      }
+    }
+  }
+
+  free(ckpt);
+  free(seg);
+  free(bw);
+  return true;
+}
+
+float* ls_lin(lspanel* P, uint8_t* snps) {
+  return ls_lin(P, snps, false, NULL);
+}
+
+float* ls_lin(genome_t sample, std::string id, genome_t ref, float g,
+    float theta) {
+  lspanel P(ref, g, theta);
+  uint8_t* s = P.sample(sample, id);
+
+  float* A = ls_lin(&P, s);
+
+  delete[] s;
+  return A;
+}
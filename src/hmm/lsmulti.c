@@ -0,0 +1,138 @@
+/* Batched implementation of the Li-Stephens model, running several target
+ * haplotypes against the same panel at once.
+ *
+ * This is the scaled linear-space engine of lslin.c with the rows of nt
+ * targets interleaved: cell (i, j) of every target is stored next to the
+ * others, as row[j * nt + b]. Each reference allele is then decoded once per
+ * SNP for all of the targets, the emission for target b is a lookup in a small
+ * per-SNP table (one entry per allele and target), and the innermost loop runs
+ * over targets on contiguous floats with no branches, which the compiler turns
+ * into straight vector arithmetic. Jump constants, scales and the panel reads
+ * are all shared across the batch.
+ */
+
+#include "../plinker/genome_c.h"
+#include <stdlib.h>
+#include <math.h>
+
+#include "ls.h"
+#include "panel.h"
+#include "../plinker/hapmat.h"
+
+/* Fills E[r * nt + b] with the emission of a reference with allele r for
+ * target b at snp, from the panel's table pe (see lspanel::pemiss).
+ */
+static void emittable(float* E, uint8_t** snps, int nt, int snp,
+    const float* pe) {
+  for (int r = 0; r < 4; r++) {
+    for (int b = 0; b < nt; b++) {
+      E[r * nt + b] = EMISSBIT(snps[b][snp] != r, pe);
+    }
+  }
+}
+
+/* out[j][b] = E[r_j][b] * (a * in[j][b] * inv[b] + bb), where r_j is the
+ * allele of reference j at snp, or E[r_j][b] * bb with in NULL. Leaves the
+ * row sums in sum. out may be in.
+ */
+static void multistep(float* out, const float* in, const float* inv, float a,
+    float bb, const hapmat* S, int snp, const float* E, int nt, double* sum) {
+  int n = S->nhap;
+  float part[LS_MULTI_MAX];
+  for (int b = 0; b < nt; b++) sum[b] = 0.0;
+  for (int w = 0; w < S->nword; w++) {
+    uint64_t lo = S->bits[(size_t)2 * snp * S->nword + w];
+    uint64_t hi = S->bits[(size_t)(2 * snp + 1) * S->nword + w];
+    int jlo = 64 * w;
+    int jhi = jlo + 64 < n ? jlo + 64 : n;
+    for (int b = 0; b < nt; b++) part[b] = 0.0f;
+    for (int j = jlo; j < jhi; j++) {
+      int r = ((lo >> (j & 63)) & 1) | (((hi >> (j & 63)) & 1) << 1);
+      const float* e = &(E[r * nt]);
+      float* o = &(out[(size_t)j * nt]);
+      if (in == NULL) {
+        for (int b = 0; b < nt; b++) {
+          o[b] = e[b] * bb;
+          part[b] += o[b];
+        }
+      }
+      else {
+        const float* x = &(in[(size_t)j * nt]);
+        for (int b = 0; b < nt; b++) {
+          o[b] = e[b] * (a * x[b] * inv[b] + bb);
+          part[b] += o[b];
+        }
+      }
+    }
+    for (int b = 0; b < nt; b++) sum[b] += part[b];
+  }
+}
+
+void ls_multi(lspanel* P, uint8_t** snps, int nt, bool linear, float** out) {
+  int n_ref = P->nsample;
+  int n_snp = P->nsnp;
+  const float* pe = P->pemiss;
+  const hapmat* S = P->ref.get();
+  size_t rowlen = (size_t)n_ref * nt;
+
+  float* fw = (float*)malloc(sizeof(float) * n_snp * rowlen);
+  float* bw = (float*)malloc(sizeof(float) * rowlen);
+  float E[4 * LS_MULTI_MAX];
+  float inv[LS_MULTI_MAX];
+  double c[LS_MULTI_MAX];
+
+  // Forward pass, from a uniform prior
+  emittable(E, snps, nt, 0, pe);
+  multistep(fw, NULL, inv, 0.0f, 1.0f / n_ref, S, 0, E, nt, c);
+  for (int i = 1; i < n_snp; i++) {
+    float a = P->stay[i-1];
+    float bb = P->jump[i-1];
+    for (int b = 0; b < nt; b++) inv[b] = 1.0 / c[b];
+    emittable(E, snps, nt, i, pe);
+    multistep(&(fw[i * rowlen]), &(fw[(i-1) * rowlen]), inv, a, bb,
+        S, i, E, nt, c);
+  }
+
+  for (int b = 0; b < nt; b++) {
+    out[b] = (float*)malloc(sizeof(float) * n_snp * n_ref);
+  }
+
+  // Backward pass, smoothing each row into out as soon as it's done
+  for (int i = n_snp - 1; i >= 0; i--) {
+    float* row = &(fw[i * rowlen]);
+    if (i < n_snp - 1) {
+      for (size_t k = 0; k < rowlen; k++) row[k] *= bw[k];
+    }
+    double sum[LS_MULTI_MAX];
+    for (int b = 0; b < nt; b++) sum[b] = 0.0;
+    for (int j = 0; j < n_ref; j++) {
+      for (int b = 0; b < nt; b++) sum[b] += row[(size_t)j * nt + b];
+    }
+    for (int b = 0; b < nt; b++) inv[b] = 1.0 / sum[b];
+    for (int b = 0; b < nt; b++) {
+      float* o = &(out[b][i * n_ref]);
+      const float* x = &(row[b]);
+      if (linear) {
+        for (int j = 0; j < n_ref; j++) o[j] = x[(size_t)j * nt] * inv[b];
+      }
+      else {
+        for (int j = 0; j < n_ref; j++) o[j] = log(x[(size_t)j * nt] * inv[b]);
+      }
+    }
+
+    // The last row is just the emission, as in ls()
+    emittable(E, snps, nt, i, pe);
+    if (i == n_snp - 1) {
+      multistep(bw, NULL, inv, 0.0f, 1.0f, S, i, E, nt, c);
+    }
+    else {
+      float a = P->stay[i];
+      float bb = P->jump[i];
+      for (int b = 0; b < nt; b++) inv[b] = 1.0 / c[b];
+      multistep(bw, bw, inv, a, bb, S, i, E, nt, c);
+    }
+  }
+
+  free(fw);
+  free(bw);
+}
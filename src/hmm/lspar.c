@@ -0,0 +1,139 @@
+/* Multithreaded CPU implementation of the Li-Stephens model.
+ */
+
+#include "../plinker/genome_c.h"
+#include "../pool/pool.h"
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+
+#include "ls.h"
+#include "panel.h"
+#include "../plinker/hapmat.h"
+
+// Folds the first n per-thread partial sums in part into a single log sum.
+// Every thread folds in the same order, so every thread sees the same value.
+static float foldparts(float* part, int n) {
+  float x = part[0];
+  for (int t = 1; t < n; t++) x = logadd(x, part[t]);
+  return x;
+}
+
+/* Runs the forward, backward and smoothing passes on the calling team.
+ * Thread tid owns reference genomes [lo, hi) of every row; nwork is the number
+ * of threads that own a nonempty block. part holds two banks of per-thread
+ * partial sums, alternated between rows so that a single barrier per row is
+ * enough to keep a fast thread from overwriting a sum still being read.
+ */
+static void lsteam(int tid, lspanel* P, uint8_t* s, float* fw, float* bw,
+    float* part, int nwork, barrier* bar) {
+  int n_ref = P->nsample;
+  int n_snp = P->nsnp;
+  const float* E = P->emiss; // log emissions for a match and a mismatch
+  const hapmat* S = P->ref.get();
+  uint64_t m = 0; // mismatch bits for the current word of references
+
+  // Blocks are whole words of the packed panel, so no two threads ever share
+  // a word and every block starts on a fresh mismatch word
+  int nword = S->nword;
+  int lo = 64 * ((nword * tid) / nwork);
+  int hi = 64 * ((nword * (tid + 1)) / nwork);
+  if (hi > n_ref) hi = n_ref;
+  if (tid >= nwork) lo = hi = n_ref;
+
+  float c = P->c; // probability of jumping to given ref
+
+  // Forward pass
+  for (int j = lo; j < hi; j++) {
+    if ((j & 63) == 0) m = S->mismatch(0, j >> 6, s[0]);
+    fw[j] = EMISSBIT((m >> (j & 63)) & 1, E);
+  }
+
+  for (int i = 1; i < n_snp; i++) {
+    float* prev = &(fw[(i-1) * n_ref]);
+    float* bank = &(part[(i & 1) * nwork]);
+    if (hi > lo) bank[tid] = logsum(prev + lo, hi - lo);
+    bar->wait();
+
+    float x = foldparts(bank, nwork);
+    float nJ = P->nJ[i-1];
+    float J = P->J[i-1];
+
+    for (int j = lo; j < hi; j++) {
+      if ((j & 63) == 0) m = S->mismatch(i, j >> 6, s[i]);
+      prev[j] -= x;
+      float alpha = logadd(prev[j] + nJ, J + c);
+      fw[i * n_ref + j] = alpha + EMISSBIT((m >> (j & 63)) & 1, E);
+    }
+  }
+
+  // Backward pass
+  for (int j = lo; j < hi; j++) {
+    if ((j & 63) == 0) m = S->mismatch(n_snp - 1, j >> 6, s[n_snp - 1]);
+    bw[j + (n_snp - 1) * n_ref] = EMISSBIT((m >> (j & 63)) & 1, E);
+  }
+
+  for (int i = n_snp - 2; i >= 0; i--) {
+    float* next = &(bw[(i+1) * n_ref]);
+    float* bank = &(part[(i & 1) * nwork]);
+    if (hi > lo) bank[tid] = logsum(next + lo, hi - lo);
+    bar->wait();
+
+    float x = foldparts(bank, nwork);
+    float nJ = P->nJ[i];
+    float J = P->J[i];
+
+    for (int j = lo; j < hi; j++) {
+      if ((j & 63) == 0) m = S->mismatch(i, j >> 6, s[i]);
+      next[j] -= x;
+      float alpha = logadd(J + c, nJ + next[j]);
+      bw[i * n_ref + j] = alpha + EMISSBIT((m >> (j & 63)) & 1, E);
+    }
+  }
+
+  // Every row of fw and bw must be final before smoothing reads across blocks
+  bar->wait();
+
+  // Smoothing pass; rows are independent, so split them by SNP instead
+  if (tid >= nwork) return;
+  for (int i = tid; i < n_snp; i += nwork) {
+    float* row = &(fw[i * n_ref]);
+    if (i < n_snp - 1) {
+      for (int j = 0; j < n_ref; j++) row[j] += bw[(i+1) * n_ref + j];
+    }
+    logrownorm(row, n_ref);
+  }
+}
+
+float* ls_par(lspanel* P, uint8_t* snps, workpool* pool) {
+  int n_ref = P->nsample;
+  int n_snp = P->nsnp;
+
+  // Initialize memory
+  float* fw = (float*)malloc(sizeof(float) * n_snp * n_ref);
+  float* bw = (float*)malloc(sizeof(float) * n_snp * n_ref);
+
+  int nword = P->ref->nword;
+  int nwork = pool->nthread < nword ? pool->nthread : nword;
+  if (nwork < 1) nwork = 1;
+  std::vector<float> part(2 * nwork);
+  barrier bar(pool->nthread);
+
+  pool->team([&](int tid) {
+    lsteam(tid, P, snps, fw, bw, part.data(), nwork, &bar);
+  });
+
+  free(bw);
+  return fw;
+}
+
+float* ls_par(genome_t sample, std::string id, genome_t ref, float g,
+    float theta, workpool* pool) {
+  lspanel P(ref, g, theta);
+  uint8_t* s = P.sample(sample, id);
+
+  float* A = ls_par(&P, s, pool);
+
+  delete[] s;
+  return A;
+}
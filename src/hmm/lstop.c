@@ -0,0 +1,75 @@
+/* Sparse posterior output.
+ *
+ * A smoothed row is almost all negligible entries, so it's cut down to its
+ * likeliest states as soon as the smoothing pass produces it, and the dense
+ * matrix never exists. Rows come from ls_ckpt(), which hands them out one at
+ * a time from checkpointed forward rows, so the whole run holds O(sqrt(nsnp))
+ * dense rows plus what's kept.
+ */
+
+#include "../plinker/genome_c.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "ls.h"
+#include "panel.h"
+
+lscsr* ls_top(lspanel* P, uint8_t* snps, int k, float eps) {
+  int n_ref = P->nsample;
+  int n_snp = P->nsnp;
+
+  // Kept states of every row, as (probability, state), until they're all in
+  std::vector<std::vector<std::pair<float, int>>> rows(n_snp);
+  std::vector<double> rest(n_snp);
+  std::vector<std::pair<float, int>> cand;
+  bool ok = ls_ckpt(P, snps, 0, true, [&](int i, const float* row) {
+    cand.clear();
+    for (int j = 0; j < n_ref; j++) {
+      if (row[j] >= eps && row[j] > 0.0f) {
+        cand.push_back(std::make_pair(row[j], j));
+      }
+    }
+    auto most = [](const std::pair<float, int>& p,
+        const std::pair<float, int>& q) { return p.first > q.first; };
+    if (k > 0 && (int)cand.size() > k) {
+      std::nth_element(cand.begin(), cand.begin() + k, cand.end(), most);
+      cand.resize(k);
+    }
+    std::sort(cand.begin(), cand.end(), most);
+
+    double kept = 0.0;
+    for (auto& c : cand) kept += c.first;
+    rest[i] = kept < 1.0 ? 1.0 - kept : 0.0;
+    rows[i] = cand;
+  });
+  if (!ok) return NULL;
+
+  lscsr* R = (lscsr*)malloc(sizeof(lscsr));
+  R->nsnp = n_snp;
+  R->nref = n_ref;
+  R->ptr = (int*)malloc(sizeof(int) * (n_snp + 1));
+  R->rest = (float*)malloc(sizeof(float) * n_snp);
+  R->ptr[0] = 0;
+  for (int i = 0; i < n_snp; i++) R->ptr[i+1] = R->ptr[i] + rows[i].size();
+  R->col = (int*)malloc(sizeof(int) * R->ptr[n_snp]);
+  R->val = (float*)malloc(sizeof(float) * R->ptr[n_snp]);
+  for (int i = 0; i < n_snp; i++) {
+    for (size_t c = 0; c < rows[i].size(); c++) {
+      R->col[R->ptr[i] + c] = rows[i][c].second;
+      R->val[R->ptr[i] + c] = rows[i][c].first;
+    }
+    R->rest[i] = rest[i];
+  }
+  return R;
+}
+
+void lscsr_free(lscsr* R) {
+  if (R == NULL) return;
+  free(R->ptr);
+  free(R->col);
+  free(R->val);
+  free(R->rest);
+  free(R);
+}
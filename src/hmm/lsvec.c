@@ -0,0 +1,425 @@
+/* Vectorized sequential implementation of the Li-Stephens model.
+ *
+ * Same passes as ls.c, but every row operation runs on a kernel set that
+ * handles 8 (AVX2) or 16 (AVX-512) references per instruction. The log-space
+ * sums use max-shifted logsumexp, and logadd becomes
+ *   max(a, b) + log(1 + exp(-|a - b|)),
+ * with exp and log replaced by Cephes-style polynomial approximations (about
+ * 1 ulp on the ranges used here). Emissions are a blend between log(g) and
+ * log(1 - g) on the mismatch bits of the packed panel, so nothing calls log()
+ * per cell.
+ *
+ * Which kernel set runs is picked at runtime from what the CPU supports; the
+ * vector kernels are compiled with target attributes, so no build flags are
+ * needed and the binary still runs on machines without AVX.
+ */
+
+#include "../plinker/genome_c.h"
+#include <stdlib.h>
+#include <math.h>
+#include <immintrin.h>
+
+#include "ls.h"
+#include "panel.h"
+#include "../plinker/hapmat.h"
+
+// Row operations of the forward, backward and smoothing passes
+struct lskern {
+  // Log sum of the n values in A
+  float (*lse)(const float* A, int n);
+  // out[j] = emission of reference j at snp, for target allele a
+  void (*emit)(float* out, const hapmat* S, int snp, int a, float lm,
+      float lx);
+  // out[j] = logadd(in[j] + shift, Jc) + emission, as in forward/backward
+  void (*step)(float* out, const float* in, float shift, float Jc,
+      const hapmat* S, int snp, int a, float lm, float lx);
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Scalar kernels: exactly the arithmetic of ls.c
+
+static float lse_scalar(const float* A, int n) {
+  return logsum((float*)A, n);
+}
+
+static void emit_scalar(float* out, const hapmat* S, int snp, int a,
+    float lm, float lx) {
+  uint64_t m = 0;
+  for (int j = 0; j < S->nhap; j++) {
+    if ((j & 63) == 0) m = S->mismatch(snp, j >> 6, a);
+    out[j] = ((m >> (j & 63)) & 1) ? lx : lm;
+  }
+}
+
+static void step_scalar(float* out, const float* in, float shift, float Jc,
+    const hapmat* S, int snp, int a, float lm, float lx) {
+  uint64_t m = 0;
+  for (int j = 0; j < S->nhap; j++) {
+    if ((j & 63) == 0) m = S->mismatch(snp, j >> 6, a);
+    out[j] = logadd(in[j] + shift, Jc) + (((m >> (j & 63)) & 1) ? lx : lm);
+  }
+}
+
+static const lskern kern_scalar = { lse_scalar, emit_scalar, step_scalar };
+
+/////////////////////////////////////////////////////////////////////////////
+// Polynomial constants for exp and log (from Cephes expf/logf)
+
+#define EXP_HI 88.3762626647949f
+#define EXP_LO -88.3762626647949f
+#define LOG2EF 1.44269504088896341f
+#define LN2_HI 0.693359375f
+#define LN2_LO -2.12194440e-4f
+#define SQRTHF 0.707106781186547524f
+
+static const float expp[6] = {
+  1.9875691500E-4f, 1.3981999507E-3f, 8.3334519073E-3f,
+  4.1665795894E-2f, 1.6666665459E-1f, 5.0000001201E-1f
+};
+static const float logp[9] = {
+  7.0376836292E-2f, -1.1514610310E-1f, 1.1676998740E-1f,
+  -1.2420140846E-1f, 1.4249322787E-1f, -1.6668057665E-1f,
+  2.0000714765E-1f, -2.4999993993E-1f, 3.3333331174E-1f
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// AVX2 kernels, 8 references per vector
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+static AVX2 inline __m256 exp8(__m256 x) {
+  x = _mm256_min_ps(x, _mm256_set1_ps(EXP_HI));
+  x = _mm256_max_ps(x, _mm256_set1_ps(EXP_LO));
+
+  // e^x = 2^n e^r, |r| <= ln(2)/2
+  __m256 n = _mm256_floor_ps(
+      _mm256_fmadd_ps(x, _mm256_set1_ps(LOG2EF), _mm256_set1_ps(0.5f)));
+  x = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_HI), x);
+  x = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_LO), x);
+
+  __m256 y = _mm256_set1_ps(expp[0]);
+  for (int k = 1; k < 6; k++) {
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(expp[k]));
+  }
+  y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), x);
+  y = _mm256_add_ps(y, _mm256_set1_ps(1.0f));
+
+  __m256i e = _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127));
+  return _mm256_mul_ps(y, _mm256_castsi256_ps(_mm256_slli_epi32(e, 23)));
+}
+
+// Natural log of x > 0 (only ever called on [1, 2] here)
+static AVX2 inline __m256 log8(__m256 x) {
+  // x = 2^e m, sqrt(1/2) <= m < sqrt(2)
+  __m256i xi = _mm256_castps_si256(x);
+  __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(
+      _mm256_srli_epi32(xi, 23), _mm256_set1_epi32(126)));
+  x = _mm256_castsi256_ps(_mm256_or_si256(
+      _mm256_and_si256(xi, _mm256_set1_epi32(0x807fffff)),
+      _mm256_set1_epi32(0x3f000000)));
+  __m256 small = _mm256_cmp_ps(x, _mm256_set1_ps(SQRTHF), _CMP_LT_OQ);
+  e = _mm256_sub_ps(e, _mm256_and_ps(small, _mm256_set1_ps(1.0f)));
+  x = _mm256_add_ps(_mm256_sub_ps(x, _mm256_set1_ps(1.0f)),
+      _mm256_and_ps(small, x));
+
+  __m256 z = _mm256_mul_ps(x, x);
+  __m256 y = _mm256_set1_ps(logp[0]);
+  for (int k = 1; k < 9; k++) {
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(logp[k]));
+  }
+  y = _mm256_mul_ps(_mm256_mul_ps(y, x), z);
+  y = _mm256_fmadd_ps(e, _mm256_set1_ps(LN2_LO), y);
+  y = _mm256_fnmadd_ps(z, _mm256_set1_ps(0.5f), y);
+  x = _mm256_add_ps(x, y);
+  return _mm256_fmadd_ps(e, _mm256_set1_ps(LN2_HI), x);
+}
+
+static AVX2 inline __m256 logadd8(__m256 a, __m256 b) {
+  __m256 hi = _mm256_max_ps(a, b);
+  __m256 d = _mm256_sub_ps(_mm256_min_ps(a, b), hi);
+  return _mm256_add_ps(hi,
+      log8(_mm256_add_ps(_mm256_set1_ps(1.0f), exp8(d))));
+}
+
+// Lanes of a whose bit in the low 8 bits of m is set take lx, the rest lm
+static AVX2 inline __m256 emit8(uint64_t m, __m256 lm, __m256 lx) {
+  const __m256i sel = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  __m256i b = _mm256_and_si256(_mm256_set1_epi32((int)(m & 0xff)), sel);
+  __m256 k = _mm256_castsi256_ps(_mm256_cmpeq_epi32(b, sel));
+  return _mm256_blendv_ps(lm, lx, k);
+}
+
+static AVX2 float lse_avx2(const float* A, int n) {
+  int nv = n & ~7;
+  __m256 mx = _mm256_set1_ps(-INFINITY);
+  for (int j = 0; j < nv; j += 8) {
+    mx = _mm256_max_ps(mx, _mm256_loadu_ps(A + j));
+  }
+  float buf[8];
+  _mm256_storeu_ps(buf, mx);
+  float M = -INFINITY;
+  for (int k = 0; k < 8; k++) M = fmaxf(M, buf[k]);
+  for (int j = nv; j < n; j++) M = fmaxf(M, A[j]);
+
+  __m256 vM = _mm256_set1_ps(M);
+  __m256 s = _mm256_setzero_ps();
+  for (int j = 0; j < nv; j += 8) {
+    s = _mm256_add_ps(s, exp8(_mm256_sub_ps(_mm256_loadu_ps(A + j), vM)));
+  }
+  _mm256_storeu_ps(buf, s);
+  float S = 0.0f;
+  for (int k = 0; k < 8; k++) S += buf[k];
+  for (int j = nv; j < n; j++) S += expf(A[j] - M);
+  return M + logf(S);
+}
+
+static AVX2 void emit_avx2(float* out, const hapmat* S, int snp, int a,
+    float lm, float lx) {
+  int n = S->nhap;
+  __m256 vm = _mm256_set1_ps(lm);
+  __m256 vx = _mm256_set1_ps(lx);
+  for (int w = 0; w < S->nword; w++) {
+    uint64_t m = S->mismatch(snp, w, a);
+    int j = 64 * w;
+    for (int k = 0; k < 64 && j + k < n; k += 8) {
+      if (j + k + 8 <= n) {
+        _mm256_storeu_ps(out + j + k, emit8(m >> k, vm, vx));
+      }
+      else {
+        for (int t = j + k; t < n; t++) {
+          out[t] = ((m >> (t & 63)) & 1) ? lx : lm;
+        }
+      }
+    }
+  }
+}
+
+static AVX2 void step_avx2(float* out, const float* in, float shift,
+    float Jc, const hapmat* S, int snp, int a, float lm, float lx) {
+  int n = S->nhap;
+  __m256 vs = _mm256_set1_ps(shift);
+  __m256 vJ = _mm256_set1_ps(Jc);
+  __m256 vm = _mm256_set1_ps(lm);
+  __m256 vx = _mm256_set1_ps(lx);
+  for (int w = 0; w < S->nword; w++) {
+    uint64_t m = S->mismatch(snp, w, a);
+    int j = 64 * w;
+    for (int k = 0; k < 64 && j + k < n; k += 8) {
+      if (j + k + 8 <= n) {
+        __m256 x = _mm256_add_ps(_mm256_loadu_ps(in + j + k), vs);
+        x = _mm256_add_ps(logadd8(x, vJ), emit8(m >> k, vm, vx));
+        _mm256_storeu_ps(out + j + k, x);
+      }
+      else {
+        for (int t = j + k; t < n; t++) {
+          out[t] = logadd(in[t] + shift, Jc) +
+            (((m >> (t & 63)) & 1) ? lx : lm);
+        }
+      }
+    }
+  }
+}
+
+static const lskern kern_avx2 = { lse_avx2, emit_avx2, step_avx2 };
+
+/////////////////////////////////////////////////////////////////////////////
+// AVX-512 kernels, 16 references per vector. Same algorithms as AVX2, with
+// the mismatch bits used directly as blend masks.
+
+#define AVX512 __attribute__((target("avx512f")))
+
+static AVX512 inline __m512 exp16(__m512 x) {
+  x = _mm512_min_ps(x, _mm512_set1_ps(EXP_HI));
+  x = _mm512_max_ps(x, _mm512_set1_ps(EXP_LO));
+
+  __m512 n = _mm512_roundscale_ps(
+      _mm512_fmadd_ps(x, _mm512_set1_ps(LOG2EF), _mm512_set1_ps(0.5f)),
+      _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_HI), x);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_LO), x);
+
+  __m512 y = _mm512_set1_ps(expp[0]);
+  for (int k = 1; k < 6; k++) {
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(expp[k]));
+  }
+  y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), x);
+  y = _mm512_add_ps(y, _mm512_set1_ps(1.0f));
+
+  return _mm512_scalef_ps(y, n);
+}
+
+static AVX512 inline __m512 log16(__m512 x) {
+  __m512i xi = _mm512_castps_si512(x);
+  __m512 e = _mm512_cvtepi32_ps(_mm512_sub_epi32(
+      _mm512_srli_epi32(xi, 23), _mm512_set1_epi32(126)));
+  x = _mm512_castsi512_ps(_mm512_or_si512(
+      _mm512_and_si512(xi, _mm512_set1_epi32(0x807fffff)),
+      _mm512_set1_epi32(0x3f000000)));
+  __mmask16 small = _mm512_cmp_ps_mask(x, _mm512_set1_ps(SQRTHF), _CMP_LT_OQ);
+  e = _mm512_mask_sub_ps(e, small, e, _mm512_set1_ps(1.0f));
+  __m512 xm1 = _mm512_sub_ps(x, _mm512_set1_ps(1.0f));
+  x = _mm512_mask_add_ps(xm1, small, xm1, x);
+
+  __m512 z = _mm512_mul_ps(x, x);
+  __m512 y = _mm512_set1_ps(logp[0]);
+  for (int k = 1; k < 9; k++) {
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(logp[k]));
+  }
+  y = _mm512_mul_ps(_mm512_mul_ps(y, x), z);
+  y = _mm512_fmadd_ps(e, _mm512_set1_ps(LN2_LO), y);
+  y = _mm512_fnmadd_ps(z, _mm512_set1_ps(0.5f), y);
+  x = _mm512_add_ps(x, y);
+  return _mm512_fmadd_ps(e, _mm512_set1_ps(LN2_HI), x);
+}
+
+static AVX512 inline __m512 logadd16(__m512 a, __m512 b) {
+  __m512 hi = _mm512_max_ps(a, b);
+  __m512 d = _mm512_sub_ps(_mm512_min_ps(a, b), hi);
+  return _mm512_add_ps(hi,
+      log16(_mm512_add_ps(_mm512_set1_ps(1.0f), exp16(d))));
+}
+
+static AVX512 float lse_avx512(const float* A, int n) {
+  int nv = n & ~15;
+  __mmask16 tail = (__mmask16)((1u << (n - nv)) - 1);
+  __m512 ninf = _mm512_set1_ps(-INFINITY);
+  __m512 mx = ninf;
+  for (int j = 0; j < nv; j += 16) {
+    mx = _mm512_max_ps(mx, _mm512_loadu_ps(A + j));
+  }
+  mx = _mm512_max_ps(mx, _mm512_mask_loadu_ps(ninf, tail, A + nv));
+  float M = _mm512_reduce_max_ps(mx);
+
+  __m512 vM = _mm512_set1_ps(M);
+  __m512 s = _mm512_setzero_ps();
+  for (int j = 0; j < nv; j += 16) {
+    s = _mm512_add_ps(s, exp16(_mm512_sub_ps(_mm512_loadu_ps(A + j), vM)));
+  }
+  __m512 t = exp16(_mm512_sub_ps(_mm512_mask_loadu_ps(ninf, tail, A + nv), vM));
+  s = _mm512_mask_add_ps(s, tail, s, t);
+  return M + logf(_mm512_reduce_add_ps(s));
+}
+
+static AVX512 void emit_avx512(float* out, const hapmat* S, int snp, int a,
+    float lm, float lx) {
+  int n = S->nhap;
+  __m512 vm = _mm512_set1_ps(lm);
+  __m512 vx = _mm512_set1_ps(lx);
+  for (int w = 0; w < S->nword; w++) {
+    uint64_t m = S->mismatch(snp, w, a);
+    int j = 64 * w;
+    for (int k = 0; k < 64 && j + k < n; k += 16) {
+      int left = n - (j + k);
+      __mmask16 st = left >= 16 ? 0xffff : (__mmask16)((1u << left) - 1);
+      __m512 x = _mm512_mask_blend_ps((__mmask16)(m >> k), vm, vx);
+      _mm512_mask_storeu_ps(out + j + k, st, x);
+    }
+  }
+}
+
+static AVX512 void step_avx512(float* out, const float* in, float shift,
+    float Jc, const hapmat* S, int snp, int a, float lm, float lx) {
+  int n = S->nhap;
+  __m512 vs = _mm512_set1_ps(shift);
+  __m512 vJ = _mm512_set1_ps(Jc);
+  __m512 vm = _mm512_set1_ps(lm);
+  __m512 vx = _mm512_set1_ps(lx);
+  for (int w = 0; w < S->nword; w++) {
+    uint64_t m = S->mismatch(snp, w, a);
+    int j = 64 * w;
+    for (int k = 0; k < 64 && j + k < n; k += 16) {
+      int left = n - (j + k);
+      __mmask16 st = left >= 16 ? 0xffff : (__mmask16)((1u << left) - 1);
+      __m512 x = _mm512_maskz_loadu_ps(st, in + j + k);
+      x = logadd16(_mm512_add_ps(x, vs), vJ);
+      x = _mm512_add_ps(x, _mm512_mask_blend_ps((__mmask16)(m >> k), vm, vx));
+      _mm512_mask_storeu_ps(out + j + k, st, x);
+    }
+  }
+}
+
+static const lskern kern_avx512 = { lse_avx512, emit_avx512, step_avx512 };
+
+/////////////////////////////////////////////////////////////////////////////
+// Dispatch
+
+lsisa ls_vec_isa() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return LS_AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return LS_AVX2;
+  }
+  return LS_SCALAR;
+}
+
+static const lskern* kernels(lsisa isa) {
+  lsisa best = ls_vec_isa();
+  if (isa > best) isa = best;
+  switch (isa) {
+    case LS_AVX512: return &kern_avx512;
+    case LS_AVX2: return &kern_avx2;
+    default: return &kern_scalar;
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Engine
+
+float* ls_vec(lspanel* P, uint8_t* snps, lsisa isa) {
+  const lskern* K = kernels(isa);
+  int n_ref = P->nsample;
+  int n_snp = P->nsnp;
+  const hapmat* S = P->ref.get();
+  float lm = P->emiss[0]; // emission for a match
+  float lx = P->emiss[1]; // emission for a mismatch
+
+  float* fw = (float*)malloc(sizeof(float) * n_snp * n_ref);
+  float* bw = (float*)malloc(sizeof(float) * n_snp * n_ref);
+
+  // Forward pass. Rows aren't normalized in place; the previous row's log sum
+  // is folded into the shift instead.
+  K->emit(fw, S, 0, snps[0], lm, lx);
+  for (int i = 1; i < n_snp; i++) {
+    float* prev = &(fw[(i-1) * n_ref]);
+    float x = K->lse(prev, n_ref);
+    K->step(&(fw[i * n_ref]), prev, P->nJ[i-1] - x, P->J[i-1] + P->c,
+        S, i, snps[i], lm, lx);
+  }
+
+  // Backward pass
+  K->emit(&(bw[(n_snp-1) * n_ref]), S, n_snp - 1, snps[n_snp-1], lm, lx);
+  for (int i = n_snp - 2; i >= 0; i--) {
+    float* next = &(bw[(i+1) * n_ref]);
+    float x = K->lse(next, n_ref);
+    K->step(&(bw[i * n_ref]), next, P->nJ[i] - x, P->J[i] + P->c,
+        S, i, snps[i], lm, lx);
+  }
+
+  // Smoothing pass
+  for (int i = 0; i < n_snp; i++) {
+    float* row = &(fw[i * n_ref]);
+    if (i < n_snp - 1) {
+      for (int j = 0; j < n_ref; j++) row[j] += bw[(i+1) * n_ref + j];
+    }
+    float x = K->lse(row, n_ref);
+    for (int j = 0; j < n_ref; j++) row[j] -= x;
+  }
+
+  free(bw);
+  return fw;
+}
+
+float* ls_vec(lspanel* P, uint8_t* snps) {
+  return ls_vec(P, snps, LS_AVX512);
+}
+
+float* ls_vec(genome_t sample, std::string id, genome_t ref, float g,
+    float theta) {
+  lspanel P(ref, g, theta);
+  uint8_t* s = P.sample(sample, id);
+
+  float* A = ls_vec(&P, s);
+
+  delete[] s;
+  return A;
+}
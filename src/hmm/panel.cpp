@@ -0,0 +1,94 @@
+
+
+#include <math.h>
+#include "panel.h"
+#include "ls.h"
+
+lspanel::lspanel(genome_t G, float g_, float theta_) {
+    nsnp = g_nsnp(G);
+    nsample = g_nsample(G);
+
+    g = g_;
+    theta = theta_;
+
+    dists = new float[nsnp];
+    for (int i = 0 ; i < nsnp-1 ; i += 1) {
+        dists[i] = g_rec_dist(G, i);
+    }
+    prepare();
+
+    // The genome's columns are already contiguous and in order
+    ref = G->haps;
+}
+
+lspanel::lspanel(std::shared_ptr<hapmat> haps, const float* dists_, float g_,
+        float theta_) {
+    nsnp = haps->nsnp;
+    nsample = haps->nhap;
+
+    g = g_;
+    theta = theta_;
+
+    dists = new float[nsnp];
+    for (int i = 0 ; i < nsnp-1 ; i += 1) {
+        dists[i] = dists_[i];
+    }
+    prepare();
+
+    ref = haps;
+}
+
+void lspanel::prepare() {
+    nJ = new float[nsnp];
+    J = new float[nsnp];
+    stay = new float[nsnp];
+    jump = new float[nsnp];
+
+    for (int i = 0 ; i < nsnp-1 ; i += 1) {
+        nJ[i] = -1 * theta * dists[i];
+        J[i] = logsub1(nJ[i]);
+        stay[i] = exp(nJ[i]);
+        jump[i] = (1.0f - stay[i]) / nsample;
+    }
+    if (nsnp > 0) {
+        dists[nsnp-1] = 0.0f;
+        nJ[nsnp-1] = 0.0f;
+        J[nsnp-1] = 0.0f;
+        stay[nsnp-1] = 1.0f;
+        jump[nsnp-1] = 0.0f;
+    }
+    c = log(1.0f / ((float)nsample));
+
+    emiss[0] = log(1.0f - g);
+    emiss[1] = log(g);
+    pemiss[0] = 1.0f - g;
+    pemiss[1] = g;
+}
+
+lspanel::~lspanel() {
+    delete[] dists;
+    delete[] nJ;
+    delete[] J;
+    delete[] stay;
+    delete[] jump;
+}
+
+uint8_t* lspanel::sample(genome_t S, std::string id) {
+    int col = g_hapindex(S, id);
+    if (col == -1) { return NULL; }
+
+    auto snps = new uint8_t[nsnp];
+    for (int i = 0 ; i < nsnp ; i += 1) {
+        snps[i] = S->haps->get(i, col);
+    }
+
+    return snps;
+}
+
+float* lspanel::compute(uint8_t* snps) {
+    return ls(this, snps);
+}
+
+float* lspanel::compute(uint8_t* snps, workpool* pool) {
+    return ls_par(this, snps, pool);
+}
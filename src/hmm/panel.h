@@ -0,0 +1,78 @@
+/* Reference panel prepared once for any number of Li-Stephens runs.
+ */
+
+#ifndef PANEL_H
+#define PANEL_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "../plinker/genome_c.h"
+#include "../plinker/hapmat.h"
+
+class workpool;
+
+class lspanel {
+    // XXX: same deal as lsimputer- this is a glorified struct, everything is
+    // public so the engines can read it directly.
+public:
+    int nsnp;
+    int nsample;
+    // Bit-packed reference haplotypes, which are SNP-major already. This is
+    // the input genome's own matrix, shared rather than copied, so reference
+    // j is column j of the genome.
+    std::shared_ptr<hapmat> ref;
+    // dists[i] is the genetic distance between SNPs i and i+1
+    float* dists;
+
+    // Constants for model
+    float g;
+    float theta;
+
+    // Jump constants, precomputed per gap between SNPs i and i+1:
+    // nJ[i] = -theta * dists[i], the log probability of not jumping, and
+    // J[i] = ln(1 - e^{nJ[i]}), the log probability of jumping
+    float* nJ;
+    float* J;
+    // ln(1/nsample), the log probability of jumping to any one reference
+    float c;
+    // The same per gap in linear space: stay[i] = e^{nJ[i]}, and jump[i] =
+    // (1 - stay[i]) / nsample, the probability of jumping to any one reference
+    float* stay;
+    float* jump;
+
+    // Emissions, indexed by a mismatch bit (see hapmat::mismatch): emiss[0] =
+    // ln(1 - g) for a match and emiss[1] = ln(g) for a mismatch, and pemiss
+    // the same as probabilities
+    float emiss[2];
+    float pemiss[2];
+
+    lspanel(genome_t G, float g_, float theta_);
+
+    // Panel of the haplotypes in haps alone, with dists_[i] the genetic
+    // distance between SNPs i and i+1 (so haps->nsnp - 1 of them)
+    lspanel(std::shared_ptr<hapmat> haps, const float* dists_, float g_,
+        float theta_);
+
+    virtual ~lspanel();
+
+    // Returns haplotype id of S as a new[]'d array of nsnp alleles in the
+    // panel's encoding, or NULL if S has no such haplotype
+    uint8_t* sample(genome_t S, std::string id);
+
+    // Returns smoothed probabilities for snps in the same form as ls(). This
+    // runs the sequential engine; lsimputer overrides it with the GPU.
+    virtual float* compute(uint8_t* snps);
+
+    // Same as compute(), split across the threads of pool
+    float* compute(uint8_t* snps, workpool* pool);
+
+private:
+    // Fills in everything else from dists
+    void prepare();
+
+    lspanel(const lspanel&);
+    lspanel& operator=(const lspanel&);
+};
+
+#endif
@@ -0,0 +1,95 @@
+/* Sparse targets.
+ *
+ * The forward-backward pass only visits typed sites, with the recombination
+ * distance between consecutive ones standing in for the whole stretch of
+ * untyped sites between them, so its cost scales with the sites the sample
+ * has rather than with the panel. The smoothed rows at the typed sites are
+ * then blended to give a row for every site in between:
+ *   P[u][j] = (1 - w) * P[l][j] + w * P[r][j],  w = (d_u - d_l) / (d_r - d_l)
+ * where l and r are the typed sites around u and d is genetic distance. That
+ * is one multiply-add per reference instead of an HMM step.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "sparse.h"
+#include "panel.h"
+#include "../plinker/hapmat.h"
+
+lssparse::lssparse(genome_t ref_, genome_t sample, float g, float theta) {
+    ref = ref_;
+
+    // A copy of the genome, filtered, leaves ref itself alone
+    auto t = std::make_shared<struct genome>(*ref);
+    g_filterby(t, sample);
+    typed = new lspanel(t, g, theta);
+
+    auto& data = *(t->map).data;
+    for (int k = 0 ; k < (t->map).nsnp ; k += 1) {
+        site.push_back(g_snpindex(ref, data[k].id));
+    }
+}
+
+lssparse::~lssparse() {
+    delete typed;
+}
+
+uint8_t* lssparse::sample(genome_t S, std::string id) {
+    int col = g_hapindex(S, id);
+    if (col == -1) { return NULL; }
+
+    auto& data = *(ref->map).data;
+    int nsite = site.size();
+    auto snps = new uint8_t[nsite];
+    for (int k = 0 ; k < nsite ; k += 1) {
+        int i = g_snpindex(S, data[site[k]].id);
+        snps[k] = i == -1 ? A : S->haps->get(i, col);
+    }
+
+    return snps;
+}
+
+bool lssparse::run(uint8_t* snps, bool linear, ls_sink sink) {
+    int nsite = site.size();
+    if (nsite == 0) { return false; }
+
+    int n = typed->nsample;
+    float* P = ls_lin(typed, snps, true, NULL);
+    std::vector<float> row(n);
+    auto& data = *(ref->map).data;
+
+    int k = 0; // first typed site at or after the current SNP
+    for (int i = 0 ; i < (ref->map).nsnp ; i += 1) {
+        while (k < nsite && site[k] < i) { k += 1; }
+
+        const float* left = &P[(size_t)(k > 0 ? k - 1 : 0) * n];
+        const float* right = &P[(size_t)(k < nsite ? k : nsite - 1) * n];
+        float w = 0.0f;
+        if (k < nsite && site[k] == i) {
+            left = right;
+        }
+        else if (k > 0 && k < nsite) {
+            double dl = data[site[k - 1]].gdist;
+            double dr = data[site[k]].gdist;
+            w = dr > dl ? (data[i].gdist - dl) / (dr - dl) : 0.5f;
+            w = w < 0.0f ? 0.0f : (w > 1.0f ? 1.0f : w);
+        }
+        else if (k == 0) {
+            left = right;
+        }
+
+        for (int j = 0 ; j < n ; j += 1) {
+            row[j] = left[j] + w * (right[j] - left[j]);
+        }
+        if (!linear) {
+            for (int j = 0 ; j < n ; j += 1) { row[j] = log(row[j]); }
+        }
+        sink(i, row.data());
+    }
+
+    free(P);
+    return true;
+}
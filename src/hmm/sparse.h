@@ -0,0 +1,57 @@
+/* Sparse targets: running the Li-Stephens model on the SNPs a sample actually
+ * has (e.g. the few percent of a panel's sites a genotyping array types) and
+ * filling in the rest of the panel's sites afterwards.
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "../plinker/genome_c.h"
+#include "ls.h"
+
+class lspanel;
+
+// The constructor sets every field and nothing changes them after. They're
+// public so that callers can run the engines on typed themselves and map its
+// rows back to ref through site; they must not write to them. typed belongs
+// to this and goes with it.
+class lssparse {
+public:
+    // The full reference panel
+    genome_t ref;
+    // Panel over just the typed sites, the reference SNPs the sample also
+    // has. Its genetic distances are between consecutive typed sites, so
+    // every untyped stretch is merged into the gap around it.
+    lspanel* typed;
+    // site[k] is the index in ref (bp order) of typed site k
+    std::vector<int> site;
+
+    // Types ref by the SNPs of sample (matched by id)
+    lssparse(genome_t ref_, genome_t sample, float g, float theta);
+
+    ~lssparse();
+
+    // Returns haplotype id of S at the typed sites as a new[]'d array of
+    // alleles, or NULL if S has no such haplotype. S needs every typed SNP,
+    // which it has if it's the sample the panel was typed by.
+    uint8_t* sample(genome_t S, std::string id);
+
+    /* Runs the HMM for snps (as returned by sample()) over the typed sites
+     * and hands sink a row of probabilities (or their logs, unless linear is
+     * set) for every SNP of ref, in increasing order. Rows at typed sites
+     * are the smoothed posteriors; rows between two typed sites are
+     * interpolated linearly in genetic distance between them, and rows
+     * before the first or after the last are copies of it. Returns false,
+     * without calling sink, if no site is typed.
+     */
+    bool run(uint8_t* snps, bool linear, ls_sink sink);
+
+private:
+    lssparse(const lssparse&);
+    lssparse& operator=(const lssparse&);
+};
+
+#endif
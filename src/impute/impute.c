@@ -1,15 +1,124 @@
 /* Imputation from Li-Stephens imputed data
+ *
+ * The posterior mass of each allele at a SNP is a masked sum over the row:
+ * reference j counts towards its allele, whose two bits are bit j of the
+ * SNP's low and high planes in the packed panel. Rather than decode every
+ * allele, each row is summed four ways in one pass: in total, masked by the
+ * low plane, masked by the high plane and masked by both. With allele
+ * a = lo + 2 * hi, those give the mass of T (both), C (low only), G (high
+ * only) and A (the rest) by inclusion-exclusion. Masks come a byte of a plane
+ * at a time from a table of 8-float masks, so the inner loop is contiguous
+ * multiply-adds on 8 lanes, which the compiler vectorizes.
  */
 
 #include "../plinker/genome_c.h"
+#include "../plinker/hapmat.h"
 #include <stdlib.h>
+#include <math.h>
 
-/* Returns the MLE for all ordered SNPs (according to ref) in sample.  It is
- * assumed that
- * a) SNPs in sample are a subset of ref
- * b) the nsample samples in ref are the same as the nsample columns in P
- * c) the nsnp SNPs in sample are the same as the nsnp rows in P
- */
-snp_t* impute(float* P, genome_t* ref, genome_t* sample, int nsample) {
-  return NULL;
+#include "impute.h"
+#include "../hmm/ls.h"
+
+// bytemask.m[b][k] is 1 if bit k of b is set, 0 if not
+static struct masktable {
+  float m[256][8];
+  masktable() {
+    for (int b = 0; b < 256; b++) {
+      for (int k = 0; k < 8; k++) m[b][k] = (b >> k) & 1;
+    }
+  }
+} bytemask;
+
+void impute_row(const float* row, bool linear, const hapmat* ref, int snp,
+    impsnp* out) {
+  int n = ref->nhap;
+  const uint64_t* lo = ref->lo(snp);
+  const uint64_t* hi = ref->hi(snp);
+  float buf[64];
+  double s = 0.0, slo = 0.0, shi = 0.0, sboth = 0.0;
+
+  for (int w = 0; w < ref->nword; w++) {
+    // Padding bits of the planes are clear, so a zero-padded last word is fine
+    int cnt = n - 64 * w < 64 ? n - 64 * w : 64;
+    const float* x = &(row[64 * w]);
+    if (!linear || cnt < 64) {
+      for (int k = 0; k < cnt; k++) buf[k] = linear ? x[k] : exp(x[k]);
+      for (int k = cnt; k < 64; k++) buf[k] = 0.0f;
+      x = buf;
+    }
+
+    float t[8], tl[8], th[8], tb[8];
+    for (int k = 0; k < 8; k++) t[k] = tl[k] = th[k] = tb[k] = 0.0f;
+    for (int q = 0; q < 8; q++) {
+      const float* ml = bytemask.m[(lo[w] >> (8 * q)) & 255];
+      const float* mh = bytemask.m[(hi[w] >> (8 * q)) & 255];
+      const float* v = &(x[8 * q]);
+      for (int k = 0; k < 8; k++) {
+        float vl = v[k] * ml[k];
+        t[k] += v[k];
+        tl[k] += vl;
+        th[k] += v[k] * mh[k];
+        tb[k] += vl * mh[k];
+      }
+    }
+    for (int k = 0; k < 8; k++) {
+      s += t[k];
+      slo += tl[k];
+      shi += th[k];
+      sboth += tb[k];
+    }
+  }
+
+  double p[4];
+  p[T] = sboth;
+  p[C] = slo - sboth;
+  p[G] = shi - sboth;
+  p[A] = s - slo - shi + sboth;
+
+  out->call = A;
+  for (int a = 0; a < 4; a++) {
+    // Differences can come out a hair below 0 in float
+    out->p[a] = p[a] > 0.0 && s > 0.0 ? p[a] / s : 0.0f;
+    if (out->p[a] > out->p[out->call]) out->call = (snp_t)a;
+  }
+}
+
+impsnp* impute(const float* P, bool linear, genome_t ref) {
+  const hapmat* S = ref->haps.get();
+  impsnp* out = (impsnp*)malloc(sizeof(impsnp) * S->nsnp);
+  for (int i = 0; i < S->nsnp; i++) {
+    impute_row(&(P[(size_t)i * S->nhap]), linear, S, i, &(out[i]));
+  }
+  return out;
+}
+
+impsnp* impute_alleles(const float* D, int nsnp) {
+  impsnp* out = (impsnp*)malloc(sizeof(impsnp) * nsnp);
+  for (int i = 0; i < nsnp; i++) {
+    out[i].call = A;
+    for (int a = 0; a < 4; a++) {
+      out[i].p[a] = D[4 * i + a];
+      if (out[i].p[a] > out[i].p[out[i].call]) out[i].call = (snp_t)a;
+    }
+  }
+  return out;
+}
+
+impsnp* impute_csr(const lscsr* R, genome_t ref) {
+  const hapmat* S = ref->haps.get();
+  impsnp* out = (impsnp*)malloc(sizeof(impsnp) * R->nsnp);
+  for (int i = 0; i < R->nsnp; i++) {
+    double p[4] = { 0.0, 0.0, 0.0, 0.0 };
+    for (int k = R->ptr[i]; k < R->ptr[i+1]; k++) {
+      p[S->get(i, R->col[k])] += R->val[k];
+    }
+
+    double s = p[0] + p[1] + p[2] + p[3];
+    out[i].call = A;
+    for (int a = 0; a < 4; a++) {
+      out[i].p[a] = s > 0.0 ? p[a] / s : 0.0f;
+      if (out[i].p[a] > out[i].p[out[i].call]) out[i].call = (snp_t)a;
+    }
+  }
+  return out;
 }
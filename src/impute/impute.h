@@ -5,13 +5,47 @@
 #define IMPUTE_H
 
 //#include <plinker/genome_c.h>
+#include <stdint.h>
 
-/* Returns the MLE for all ordered SNPs (according to ref) in sample.  It is
- * assumed that
- * a) SNPs in sample are a subset of ref
+struct hapmat;
+struct lscsr;
+
+// Imputed allele of one haplotype at one SNP
+struct impsnp {
+  snp_t call; // maximum likelihood allele
+  float p[4]; // posterior probability (dosage) of each allele, indexed by snp_t
+};
+
+/* Imputes row snp of a posterior matrix against the reference haplotypes it
+ * came from: p[a] is the total posterior mass of the references with allele a
+ * at snp, and call the allele with the most. row holds one probability per
+ * reference (or its natural log, unless linear is set), in any normalization.
+ *
+ * This only needs the one row, so it can be fed straight from an ls_sink
+ * while the HMM is still running.
+ */
+void impute_row(const float* row, bool linear, const hapmat* ref, int snp,
+    impsnp* out);
+
+/* Returns the imputed alleles for all nsnp ordered SNPs (according to ref) of
+ * the haplotype P was computed for, as a malloc'd array. It is assumed that
+ * a) P is in the same form as ls(), or holds probabilities if linear is set
  * b) the nsample samples in ref are the same as the nsample columns in P
- * c) the nsnp SNPs in sample are the same as the nsnp rows in P
+ * c) the nsnp SNPs in ref are the same as the nsnp rows in P
+ */
+impsnp* impute(const float* P, bool linear, genome_t ref);
+
+/* Same as impute(), from allele posteriors already summed over references
+ * (as from lsdedup::alleles()): D[4 * i + a] is the probability of allele a
+ * at SNP i, for nsnp SNPs.
+ */
+impsnp* impute_alleles(const float* D, int nsnp);
+
+/* Same as impute(), from posteriors cut down to their likeliest states (as
+ * from ls_top()), renormalized over what was kept. Spreading the rest evenly
+ * over the other references does worse, since the ones nearly as likely as
+ * those kept tend to be copies of them.
  */
-snp_t* impute(float* P, genome_t* ref, genome_t* sample, int nsample);
+impsnp* impute_csr(const lscsr* R, genome_t ref);
 
 #endif /* IMPUTE_H */
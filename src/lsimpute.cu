@@ -3,7 +3,9 @@
 #include <math_constants.h>
 #include "lsimpute.h"
 
-#define EMISS(o1, o2, g) log(o1 == o2 ? (1 - g) : g)
+// Emission for observed alleles o1 and o2, given the log emissions for a
+// match (lm) and a mismatch (lx); a select, not a branch or a log
+#define EMISS(o1, o2, lm, lx) ((o1) == (o2) ? (lm) : (lx))
 
 #define BLOCKMAX 512 // TODO: set to 1024 if compute capability >= 2.0
 #define WARP_SIZE 32
@@ -22,6 +24,15 @@ __device__ float d_logsub1(float x) {
   return logf(1.0f - expf(x));
 }
 
+/* Allele of haplotype i at SNP k of a bit-packed panel with nword words per
+ * plane (see hapmat.h)
+ */
+__device__ uint8_t d_allele(uint64_t* refs, int nword, int k, int i) {
+  uint64_t* lo = refs + ((size_t)2 * k * nword) + (i >> 6);
+  int b = i & 63;
+  return ((lo[0] >> b) & 1) | (((lo[nword] >> b) & 1) << 1);
+}
+
 __device__ bool isPow2(int n) {
   return (n != 0) && (n & (n-1)) == 0;
 }
@@ -89,12 +100,15 @@ __device__ void d_logrownorm(float* A, int n, float* scratch) {
   return;
 }
 
-__device__ void fwKernel(uint8_t* refs, uint8_t* sample, float* dists,
-    float* fw, float g, int nsnp, int nsample, float* scratch) {
+__device__ void fwKernel(uint64_t* refs, int nword, uint8_t* sample,
+    float* nJs, float* Js, float* fw, float g, int nsnp, int nsample,
+    float* scratch) {
   // Initialize first row
   float c = logf(1.0f / ((float)nsample));
+  float lm = logf(1.0f - g); // emission for a match
+  float lx = logf(g);        // emission for a mismatch
   for (int i = threadIdx.x; i < nsample; i += blockDim.x)
-    fw[i] = EMISS(sample[0], refs[i],g);
+    fw[i] = EMISS(sample[0], d_allele(refs, nword, 0, i), lm, lx);
   __syncthreads();
 
   // For each SNP (going forward)
@@ -102,27 +116,31 @@ __device__ void fwKernel(uint8_t* refs, uint8_t* sample, float* dists,
     int K = k * nsample;
     // Precompute jump probability
     float x = row_logsum(&(fw[K-nsample]), nsample, scratch);
-    float nJ = dists[k-1];
-    float J = d_logsub1(nJ);
+    float nJ = nJs[k-1];
+    float J = Js[k-1];
 
     // Calculate values
     for (int i = threadIdx.x; i < nsample; i += blockDim.x) {
       fw[K - nsample + i] -= x;
       float alpha = d_logadd(fw[K - nsample + i] + nJ, J + c);
-      fw[K + i] = alpha + EMISS(sample[k], refs[K+i],g);
+      fw[K + i] = alpha +
+        EMISS(sample[k], d_allele(refs, nword, k, i), lm, lx);
     }
     __syncthreads();
   }
   return;
 }
 
-__device__ void bwKernel(uint8_t* refs, uint8_t* sample, float* dists,
-    float* bw, float g, int nsnp, int nsample, float* scratch) {
+__device__ void bwKernel(uint64_t* refs, int nword, uint8_t* sample,
+    float* nJs, float* Js, float* bw, float g, int nsnp, int nsample,
+    float* scratch) {
   // Initialize last row
   float c = logf(1.0f / ((float)nsample));
+  float lm = logf(1.0f - g); // emission for a match
+  float lx = logf(g);        // emission for a mismatch
   for (int i = threadIdx.x; i < nsample; i += blockDim.x) {
     bw[(nsample * (nsnp - 1)) + i] =
-      EMISS(refs[nsample * (nsnp - 1) + i], sample[nsnp - 1], g);
+      EMISS(d_allele(refs, nword, nsnp - 1, i), sample[nsnp - 1], lm, lx);
   }
 
   // For each SNP (going backward)
@@ -130,14 +148,15 @@ __device__ void bwKernel(uint8_t* refs, uint8_t* sample, float* dists,
     int K = k * nsample;
     // Precompute jump probability
     float x = row_logsum(&(bw[K+nsample]), nsample, scratch);
-    float nJ = dists[k];
-    float J = d_logsub1(nJ);
+    float nJ = nJs[k];
+    float J = Js[k];
 
     // Calculate values
     for (int i = threadIdx.x; i < nsample; i += blockDim.x) {
       bw[K + nsample + i] -= x;
       float alpha = d_logadd(J + c, nJ + bw[K + i + nsample]);
-      bw[K + i] = alpha + EMISS(sample[k], refs[K+i], g);
+      bw[K + i] = alpha +
+        EMISS(sample[k], d_allele(refs, nword, k, i), lm, lx);
     }
     __syncthreads();
   }
@@ -160,52 +179,55 @@ __device__ void smoothKernel(
   return;
 }
 
-__device__ void precomputeKernel(float* dists, int nsnp, float theta) {
-  theta = -1.0 * theta;
-  for (int i = threadIdx.x; i < (nsnp - 1); i += blockDim.x)
-    dists[i] = theta * dists[i];
-}
-
-__global__ void computeKernel(uint8_t* refs, uint8_t* sample, float* dists,
-    float* fw, float* bw, float g, float theta, int nsnp, int nsample,
-    int nscratch) {
+/* Jump constants (nJs and Js) come precomputed with the panel; see lspanel
+ */
+__global__ void computeKernel(uint64_t* refs, int nword, uint8_t* sample,
+    float* nJs, float* Js, float* fw, float* bw, float g, int nsnp,
+    int nsample, int nscratch) {
   extern __shared__ float scratch[];
 
   __syncthreads();
 
-  // Precompute jump constants
-  precomputeKernel(dists, nsnp, theta);
-
   // Forward step
-  fwKernel(refs, sample, dists, fw, g, nsnp, nsample, scratch);
+  fwKernel(refs, nword, sample, nJs, Js, fw, g, nsnp, nsample, scratch);
 
   // Backward step
-  bwKernel(refs, sample, dists, bw, g, nsnp, nsample, scratch);
+  bwKernel(refs, nword, sample, nJs, Js, bw, g, nsnp, nsample, scratch);
 
   // Smoothing step
   smoothKernel(fw, bw, nsnp, nsample, scratch);
   return;
 }
 
-float* lsimputer::compute(uint8_t* snps) {
-  // Allocate space for refs, sample, distances, and return values
-  uint8_t* d_refs;
-  uint8_t* d_sample;
-  float* d_dists;
-  float* d_fw;
-  float* d_bw;
-  cudaMalloc((void **)&d_refs, sizeof(uint8_t) * nsnp * nsample);
+void lsimputer::upload() {
+  size_t nbits = ref->bits.size();
+  cudaMalloc((void **)&d_refs, sizeof(uint64_t) * nbits);
+  cudaMalloc((void **)&d_nJ, sizeof(float) * nsnp);
+  cudaMalloc((void **)&d_J, sizeof(float) * nsnp);
   cudaMalloc((void **)&d_sample, sizeof(uint8_t) * nsnp);
-  cudaMalloc((void **)&d_dists, sizeof(float) * nsnp);
   cudaMalloc((void **)&d_fw, sizeof(float) * nsnp * nsample);
   cudaMalloc((void **)&d_bw, sizeof(float) * nsnp * nsample);
 
-  // Transfer over data
-  cudaMemcpy(d_refs, ref, sizeof(uint8_t) * nsnp * nsample,
+  cudaMemcpy(d_refs, ref->bits.data(), sizeof(uint64_t) * nbits,
       cudaMemcpyHostToDevice);
-  cudaMemcpy(d_sample, snps, sizeof(uint8_t) * nsnp,
+  cudaMemcpy(d_nJ, nJ, sizeof(float) * nsnp,
+      cudaMemcpyHostToDevice);
+  cudaMemcpy(d_J, J, sizeof(float) * nsnp,
       cudaMemcpyHostToDevice);
-  cudaMemcpy(d_dists, dists, sizeof(float) * nsnp,
+}
+
+void lsimputer::release() {
+  cudaFree(d_refs);
+  cudaFree(d_nJ);
+  cudaFree(d_J);
+  cudaFree(d_sample);
+  cudaFree(d_fw);
+  cudaFree(d_bw);
+}
+
+float* lsimputer::compute(uint8_t* snps) {
+  // The panel is already on the device; only the sample goes over
+  cudaMemcpy(d_sample, snps, sizeof(uint8_t) * nsnp,
       cudaMemcpyHostToDevice);
 
   int nthread = npow2(min(BLOCKMAX, max(nsample, 32)));
@@ -213,8 +235,8 @@ float* lsimputer::compute(uint8_t* snps) {
 
   // Run the kernel
   computeKernel<<<1, nthread, nscratch*sizeof(float)>>>
-    (d_refs, d_sample, d_dists, d_fw,
-      d_bw, g, theta, nsnp, nsample, nscratch);
+    (d_refs, ref->nword, d_sample, d_nJ, d_J, d_fw,
+      d_bw, g, nsnp, nsample, nscratch);
   cudaDeviceSynchronize();
 
   // Transfer data off the device
@@ -222,13 +244,5 @@ float* lsimputer::compute(uint8_t* snps) {
   cudaMemcpy(res, d_fw, sizeof(float) * nsnp * nsample,
       cudaMemcpyDeviceToHost);
 
-  // Free device memory
-  cudaFree(d_refs);
-  cudaFree(d_sample);
-  cudaFree(d_dists);
-  cudaFree(d_fw);
-  cudaFree(d_bw);
-
   return res;
 }
-
@@ -6,39 +6,48 @@
 
 #include <cstdint>
 #include "plinker/genome_c.h"
+#include "hmm/panel.h"
 
-class lsimputer {
-    // XXX: coding style: it would be more idiomatic to make these private,
-    // and to follow proper OO design patterns. However, I prefer to use
-    // these as glorified structs, so for now we'll make everything public.
+// A prepared panel that runs on the GPU. The transpose of the panel and the
+// jump constants all come from lspanel, and go to the device once, with the
+// panel, so one lsimputer can serve any number of compute() calls, each of
+// which only copies its sample in and its result out.
+class lsimputer : public lspanel {
 public:
-    int nsnp;
-    int nsample;
-    // SNPs are stored in SNP-major order. The ordering of samples is based on
-    // the internal ordering of the input genome.
-    // For now, SNPs are represented using full 8-bit valued bitvectors. If
-    // memory is a concern, we can fix this.
-    // ref has SNP-major order- the first nsample elements are SNP 0, then
-    // SNP 1, etc
-    uint8_t* ref;
-    float* dists;
-
-    // Constants for model
-    float g;
-    float theta;
-
     lsimputer(genome_t G, float g_, float theta_);
-
     ~lsimputer();
 
-    // This function should probably be defined in the CUDA files, by defining
-    // the function lsimpute::compute in lsimpute.cu (or equivalents)
+    // Defined in lsimpute.cu.
     // Returns a malloc'ed float array
     float* compute(uint8_t* snps);
+
+    // The CPU overloads are still there for callers that want them
+    using lspanel::compute;
+
+private:
+    // Device copies of the packed panel and the jump constants, and buffers
+    // for a sample and its forward and backward matrices, reused by every
+    // compute() call
+    uint64_t* d_refs;
+    float* d_nJ;
+    float* d_J;
+    uint8_t* d_sample;
+    float* d_fw;
+    float* d_bw;
+
+    // Allocate and fill, and free, the device side (defined in lsimpute.cu)
+    void upload();
+    void release();
+
+    lsimputer(const lsimputer&);
+    lsimputer& operator=(const lsimputer&);
 };
 
 float* ls_gpu(genome_t G, genome_t impute, std::string id, int chr,
     float g, float theta);
 
+// Same as above, reusing an already prepared panel
+float* ls_gpu(lsimputer* imp, genome_t impute, std::string id);
+
 #endif
 
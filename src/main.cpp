@@ -1,32 +1,118 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
 
 #include "plinker/genome_c.h"
 #include "hmm/ls.h"
+#include "hmm/sparse.h"
+#include "hmm/knn.h"
+#include "hmm/dedup.h"
+#include "pbwt/pbwt.h"
+#include "pool/pool.h"
+#include "batch/batch.h"
+#include "impute/impute.h"
 #include "lsimpute.h"
 
 #if BENCH
 #include "cycleTimer.h"
 #endif
 
-// Look, geneticists make some long filenames, man
-#define FILENAMEMAX 1024
-
 const char* helpstring =
 "Usage: lsimpute [OPTIONS] [REF] [SAMPLE]\
 Uses the Li-Stephens model to impute sample genomes to a reference panel\n\n\
+REF and SAMPLE are fileset prefixes: PLINK binary (.bed/.bim/.fam), VCF\n\
+(.vcf or .vcf.gz, plus a PLINK .map for genetic distances) or PLINK text\n\
+(.ped/.map).\n\
 Arguments -t and -g are mandatory.\n\
+  -b [N]        Track only the N likeliest references per SNP (approximate,\n\
+                one thread)\n\
+  -d [N]        Merge references identical over windows of N SNPs into one\n\
+                state each (exact, one thread)\n\
   -g [N]        Specify garble parameter.  Must be a float > 0.0, < 1.0\n\
+  -e [N]        With -b or -p, also drop references under this share of a\n\
+                SNP's probability (default: 1e-5)\n\
+  -G            Run on the GPU instead of the CPU\n\
   -h            Print this message\n\
-  -s            Run in sequential mode (much slower)\n\
-  -t [N]        Specify theta.  Must be a float\n";
+  -I            Build the PBWT index of REF and write it to REF.pbwt, then\n\
+                exit (SAMPLE, -g and -t aren't needed)\n\
+  -j [N]        Number of CPU threads (default: all hardware threads)\n\
+  -k [N]        Run the HMM on only the N references nearest each sample in\n\
+                every window of SNPs (one thread)\n\
+  -m [N]        With -s, use at most N MB of working memory per sample,\n\
+                recomputing less the more it has (default: the least -s\n\
+                can run in)\n\
+  -o [FILE]     Write imputed alleles to FILE: a line per haplotype with its\n\
+                id, then the allele and its probability at every SNP\n\
+  -p [N]        Keep only the N likeliest references of every SNP's\n\
+                posteriors, and impute from those (one thread, least memory)\n\
+  -s            Run in sequential mode (one thread, least memory)\n\
+  -S            SAMPLE is typed at only some of REF's SNPs: run the HMM on\n\
+                those and interpolate the rest (one thread)\n\
+  -t [N]        Specify theta.  Must be a float\n\
+  -w [N]        Cut each sample into windows N cM wide, run in parallel with\n\
+                N/4 cM of burn-in either side (approximate)\n";
 
 void printhelp() {
   printf(helpstring);
 }
 
+// Reads the fileset at prefix: PLINK binary if prefix.bed exists, VCF (with
+// genetic distances from prefix.map) if prefix.vcf.gz or prefix.vcf does, and
+// otherwise PLINK text (prefix.ped and prefix.map)
+genome_t readgenome(std::string prefix, int nthread) {
+  if (access((prefix + ".bed").c_str(), R_OK) == 0) {
+    return g_frombed(prefix + ".bed", prefix + ".bim", prefix + ".fam");
+  }
+  if (access((prefix + ".vcf.gz").c_str(), R_OK) == 0) {
+    return g_fromvcf(prefix + ".vcf.gz", prefix + ".map");
+  }
+  if (access((prefix + ".vcf").c_str(), R_OK) == 0) {
+    return g_fromvcf(prefix + ".vcf", prefix + ".map");
+  }
+  return g_fromfile(prefix + ".ped", prefix + ".map", nthread);
+}
+
+// Writes the nsnp imputed alleles of haplotype id to out, as described for -o
+void writecalls(FILE* out, const std::string& id, impsnp* calls, int nsnp) {
+  static const char letters[] = "ACGT";
+  fputs(id.c_str(), out);
+  for (int i = 0; i < nsnp; i++) {
+    snp_t a = calls[i].call;
+    fprintf(out, "\t%c:%.4f", letters[a], calls[i].p[a]);
+  }
+  fputc('\n', out);
+}
+
+// Makes sure prefix.pbwt holds the PBWT index of the panel at prefix: an
+// index already there is kept if it was built from this very panel, and
+// rebuilt otherwise. Returns false if the index couldn't be written.
+bool writeindex(std::string prefix, int nthread) {
+  genome_t ref = readgenome(prefix, nthread);
+  if (ref == NULL) return false;
+  std::string fname = prefix + ".pbwt";
+  if (access(fname.c_str(), R_OK) == 0) {
+    pbwt* P = pbwt::load(fname, ref->haps);
+    if (P != NULL) {
+      printf("PBWT index %s is up to date\n", fname.c_str());
+      delete P;
+      return true;
+    }
+  }
+  pbwt P(ref->haps);
+  if (!P.save(fname)) {
+    fprintf(stderr, "Could not write %s\n", fname.c_str());
+    return false;
+  }
+  printf("Wrote PBWT index of %s to %s (%.1f MB)\n", prefix.c_str(),
+      fname.c_str(), P.bytes() / 1e6);
+  return true;
+}
+
 int main(int argc, char *argv[]) {
   float g = -1.0;
   float theta = -1.0;
@@ -35,9 +121,21 @@ int main(int argc, char *argv[]) {
   int opt;
   char* ref_files, * sam_files;
   bool sequential = false;
+  bool gpu = false;
+  bool sparse = false;
+  int knn = 0;
+  float width = 0.0f;
+  int dedup = 0;
+  int beam = 0;
+  int top = 0;
+  size_t budget = 0;
+  bool index = false;
+  float eps = LS_BEAM_EPS;
+  int nthread = pool_default_threads();
+  FILE* out = NULL;
 
   // Read in and handle command line arguments
-  while ((opt = getopt(argc, argv, "g:t:hs")) != -1) {
+  while ((opt = getopt(argc, argv, "b:d:e:g:t:hsSGIj:k:m:o:p:w:")) != -1) {
     switch(opt) {
       case 'h':
         printhelp();
@@ -74,11 +172,135 @@ int main(int argc, char *argv[]) {
         sequential = true;
 #endif
         break;
+      case 'S':
+#if BENCH
+        fprintf(stderr, "-S not allowed in benchmarking mode!");
+#else
+        sparse = true;
+#endif
+        break;
+      case 'G':
+#if BENCH
+        fprintf(stderr, "-G not allowed in benchmarking mode!");
+#else
+        gpu = true;
+#endif
+        break;
+      case 'b':
+        if (!optarg) {
+          fprintf(stderr,"Must specify value for argument -b!\n");
+          return 1;
+        }
+        beam = atoi(optarg);
+        if (beam < 1) {
+          fprintf(stderr,"Beam width must be at least 1\n");
+          return 1;
+        }
+        break;
+      case 'e':
+        if (!optarg) {
+          fprintf(stderr,"Must specify value for argument -e!\n");
+          return 1;
+        }
+        eps = (float)atof(optarg);
+        if (eps < 0.0 || eps >= 1.0) {
+          fprintf(stderr,"Threshold must have value on range [0,1)\n");
+          return 1;
+        }
+        break;
+      case 'd':
+        if (!optarg) {
+          fprintf(stderr,"Must specify value for argument -d!\n");
+          return 1;
+        }
+        dedup = atoi(optarg);
+        if (dedup < 1) {
+          fprintf(stderr,"Window length must be at least 1\n");
+          return 1;
+        }
+        break;
+      case 'I':
+        index = true;
+        break;
+      case 'j':
+        if (!optarg) {
+          fprintf(stderr,"Must specify value for argument -j!\n");
+          return 1;
+        }
+        nthread = atoi(optarg);
+        if (nthread < 1) {
+          fprintf(stderr,"Number of threads must be at least 1\n");
+          return 1;
+        }
+        break;
+      case 'k':
+        if (!optarg) {
+          fprintf(stderr,"Must specify value for argument -k!\n");
+          return 1;
+        }
+        knn = atoi(optarg);
+        if (knn < 1) {
+          fprintf(stderr,"Number of references must be at least 1\n");
+          return 1;
+        }
+        break;
+      case 'm':
+        if (!optarg) {
+          fprintf(stderr,"Must specify value for argument -m!\n");
+          return 1;
+        }
+        if (atof(optarg) <= 0.0) {
+          fprintf(stderr,"Memory budget must have positive value\n");
+          return 1;
+        }
+        budget = (size_t)(atof(optarg) * 1e6);
+        break;
+      case 'o':
+        if (!optarg) {
+          fprintf(stderr,"Must specify value for argument -o!\n");
+          return 1;
+        }
+        out = fopen(optarg, "w");
+        if (out == NULL) {
+          fprintf(stderr,"Could not open %s for writing\n", optarg);
+          return 1;
+        }
+        break;
+      case 'p':
+        if (!optarg) {
+          fprintf(stderr,"Must specify value for argument -p!\n");
+          return 1;
+        }
+        top = atoi(optarg);
+        if (top < 1) {
+          fprintf(stderr,"Number of references must be at least 1\n");
+          return 1;
+        }
+        break;
+      case 'w':
+        if (!optarg) {
+          fprintf(stderr,"Must specify value for argument -w!\n");
+          return 1;
+        }
+        width = (float)atof(optarg);
+        if (width <= 0.0) {
+          fprintf(stderr,"Window width must have positive value\n");
+          return 1;
+        }
+        break;
       case '?':
         break;
     }
   }
 
+  if (index) {
+    if (optind >= argc) {
+      fprintf(stderr,"Must specify reference files in args\n!");
+      return 1;
+    }
+    return writeindex(argv[argc - 1], nthread) ? 0 : 1;
+  }
+
   if (argc < 3) {
     fprintf(stderr,"Must specify reference and sample files in args\n!");
     return 1;
@@ -102,83 +324,404 @@ int main(int argc, char *argv[]) {
   ////////////////////////////////////////
 
   // Get genome objects
-  char mapname[FILENAMEMAX];
-  char pedname[FILENAMEMAX];
-  int reflen = strlen(ref_files);
-  int samlen = strlen(sam_files);
-  if (samlen > (FILENAMEMAX + 5) || reflen > (FILENAMEMAX + 5)) {
-    fprintf(stderr,"Your filenames are too long, stopping to avoid error.\n");
-    return 1;
-  }
-
 #if BENCH
   double s1 = CycleTimer::currentSeconds();
 #endif
-  strcpy(mapname, ref_files);
-  strcpy(mapname + reflen, ".map");
-  strcpy(pedname, ref_files);
-  strcpy(pedname + reflen, ".ped");
-
-  genome_t ref = g_fromfile(pedname, mapname);
-
+  genome_t ref = readgenome(ref_files, nthread);
+  if (ref == NULL) return 1;
 #if BENCH
   double s2 = CycleTimer::currentSeconds();
   printf("Read reference panel in %.4fs\n", s2-s1);
 #else
-  printf("Read reference panel from %s and %s...\n", mapname, pedname);
+  printf("Read reference panel from %s...\n", ref_files);
 #endif
 
 #if BENCH
   s1 = CycleTimer::currentSeconds();
 #endif
-  strcpy(mapname, sam_files);
-  strcpy(mapname + samlen, ".map");
-  strcpy(pedname, sam_files);
-  strcpy(pedname + samlen, ".ped");
-
-  genome_t sam = g_fromfile(pedname, mapname);
+  genome_t sam = readgenome(sam_files, nthread);
+  if (sam == NULL) return 1;
 #if BENCH
   s2 = CycleTimer::currentSeconds();
   printf("Read imputed samples in %.4fs\n", s2-s1);
 #else
-  printf("Read imputed samples from %s and %s...\n", mapname, pedname);
+  printf("Read imputed samples from %s...\n", sam_files);
 #endif
 
 
+#if !BENCH
+  if (sparse) {
+    // Only the sample's own SNPs go through the HMM; every other reference
+    // SNP is interpolated from the rows around it and imputed as it comes
+    lssparse sp(ref, sam, g, theta);
+    int nsnp = g_nsnp(ref);
+    impsnp* calls = (impsnp*)malloc(sizeof(impsnp) * nsnp);
+    for (auto id : *sam) {
+      printf("Imputing sample %s\n", id.c_str());
+      uint8_t* s = sp.sample(sam, id);
+      bool ok = sp.run(s, true, [&](int i, const float* r) {
+        impute_row(r, true, ref->haps.get(), i, &(calls[i]));
+      });
+      delete[] s;
+      if (!ok) {
+        fprintf(stderr, "Sample has none of the reference's SNPs\n");
+        return 1;
+      }
+      if (out != NULL) writecalls(out, id, calls, nsnp);
+    }
+    free(calls);
+    if (out != NULL) fclose(out);
+    return 0;
+  }
+
+  if (top > 0) {
+    // Posteriors never exist densely: each row is cut down as it's smoothed
+    lspanel panel(ref, g, theta);
+    for (auto id : *sam) {
+      printf("Imputing sample %s\n", id.c_str());
+      uint8_t* s = panel.sample(sam, id);
+      lscsr* R = ls_top(&panel, s, top, eps);
+      delete[] s;
+      if (R == NULL) {
+        fprintf(stderr, "Could not run the HMM for sample %s\n", id.c_str());
+        return 1;
+      }
+      impsnp* calls = impute_csr(R, ref);
+      if (out != NULL) writecalls(out, id, calls, panel.nsnp);
+      free(calls);
+      lscsr_free(R);
+    }
+    if (out != NULL) fclose(out);
+    return 0;
+  }
+
+  if (beam > 0) {
+    lspanel panel(ref, g, theta);
+    for (auto id : *sam) {
+      printf("Imputing sample %s\n", id.c_str());
+      uint8_t* s = panel.sample(sam, id);
+      float* P = ls_beam(&panel, s, beam, eps, true, NULL);
+      impsnp* calls = impute(P, true, ref);
+      if (out != NULL) writecalls(out, id, calls, panel.nsnp);
+      free(calls);
+      free(P);
+      delete[] s;
+    }
+    if (out != NULL) fclose(out);
+    return 0;
+  }
+
+  if (dedup > 0) {
+    // The merged states only depend on the panel, so they're found once; the
+    // imputer only needs their sums, so rows are never expanded
+    lspanel panel(ref, g, theta);
+    lsdedup D(&panel, dedup);
+    printf("Merged %d references into %.1f states per SNP\n",
+        panel.nsample, D.states());
+    for (auto id : *sam) {
+      printf("Imputing sample %s\n", id.c_str());
+      uint8_t* s = panel.sample(sam, id);
+      float* A = D.alleles(s);
+      impsnp* calls = impute_alleles(A, panel.nsnp);
+      if (out != NULL) writecalls(out, id, calls, panel.nsnp);
+      free(calls);
+      free(A);
+      delete[] s;
+    }
+    if (out != NULL) fclose(out);
+    return 0;
+  }
+
+  if (knn > 0) {
+    // Each window of SNPs runs on its own few references
+    lsknn K(ref, knn, g, theta);
+    lspanel panel(ref, g, theta);
+    impsnp* calls = (impsnp*)malloc(sizeof(impsnp) * panel.nsnp);
+    for (auto id : *sam) {
+      printf("Imputing sample %s\n", id.c_str());
+      uint8_t* s = panel.sample(sam, id);
+      K.run(s, true, [&](int i, const float* r) {
+        impute_row(r, true, ref->haps.get(), i, &(calls[i]));
+      });
+      delete[] s;
+      if (out != NULL) writecalls(out, id, calls, panel.nsnp);
+    }
+    free(calls);
+    if (out != NULL) fclose(out);
+    return 0;
+  }
+#endif
+
+  // Prepare the reference panel once for every sample
+#if BENCH
+  s1 = CycleTimer::currentSeconds();
+  lsimputer* panel = new lsimputer(ref, g, theta);
+  s2 = CycleTimer::currentSeconds();
+  printf("Prepared reference panel in %.4fs\n", s2-s1);
+#else
+  lspanel* panel = gpu ? new lsimputer(ref, g, theta)
+                       : new lspanel(ref, g, theta);
+  size_t least = ls_ckpt_min(panel->nsnp, panel->nsample);
+  if (sequential && budget > 0 && budget < least) {
+    fprintf(stderr, "Memory budget must be at least %g MB for this panel\n",
+        least / 1e6);
+    delete panel;
+    return 1;
+  }
+#endif
+
   // Run Li-Stephens
+  workpool pool(nthread);
   float* P;
+#if !BENCH
+  if (!gpu && !sequential && width == 0.0f && g_nsample(sam) >= nthread) {
+    // Enough haplotypes to keep every thread busy with one of its own, which
+    // beats splitting rows of a single haplotype. Each thread takes a block of
+    // up to LS_BATCH_WIDTH haplotypes and runs them together through
+    // ls_multi().
+    ls_batch(sam, sam->names, panel, &pool, true,
+        [&](int i, const std::string& id, float* P) {
+          printf("Imputed sample %s\n", id.c_str());
+          impsnp* calls = impute(P, true, ref);
+          if (out != NULL) writecalls(out, id, calls, panel->nsnp);
+          free(calls);
+          free(P);
+        });
+    if (out != NULL) fclose(out);
+    delete panel;
+    return 0;
+  }
+#endif
   for (auto id : *sam) {
-    printf("Imputing sample %s\n",id.first.c_str());
+    printf("Imputing sample %s\n",id.c_str());
+    uint8_t* s = panel->sample(sam, id);
 #if BENCH
     double gpuStart = CycleTimer::currentSeconds();
+    P = panel->compute(s);
+    double gpuEnd = CycleTimer::currentSeconds();
+    double gpuTime = gpuEnd-gpuStart;
+    fprintf(stderr, "Completed GPU computation in %.4fs.\n", gpuTime);
+    free(P);
+
+    double parStart = CycleTimer::currentSeconds();
+    P = ls_par(panel, s, &pool);
+    double parEnd = CycleTimer::currentSeconds();
+    double parTime = parEnd-parStart;
+    fprintf(stderr,
+        "Completed parallel CPU computation (%d threads) in %.4fs.\n",
+        nthread, parTime);
+    free(P);
+
+    double meetStart = CycleTimer::currentSeconds();
+    P = ls_meet(panel, s, &pool);
+    double meetEnd = CycleTimer::currentSeconds();
+    double meetTime = meetEnd-meetStart;
+    fprintf(stderr,
+        "Completed meet-in-the-middle CPU computation in %.4fs.\n",
+        meetTime);
+    free(P);
+
+    double vecStart = CycleTimer::currentSeconds();
+    P = ls_vec(panel, s);
+    double vecEnd = CycleTimer::currentSeconds();
+    double vecTime = vecEnd-vecStart;
+    fprintf(stderr, "Completed vectorized CPU computation in %.4fs.\n",
+        vecTime);
+    free(P);
+
+    double linStart = CycleTimer::currentSeconds();
+    P = ls_lin(panel, s);
+    double linEnd = CycleTimer::currentSeconds();
+    double linTime = linEnd-linStart;
+    fprintf(stderr, "Completed linear-space CPU computation in %.4fs.\n",
+        linTime);
+    free(P);
+
+    double cpuStart = CycleTimer::currentSeconds();
+    P = ls(panel, s);
+    double cpuEnd = CycleTimer::currentSeconds();
+    double cpuTime = cpuEnd-cpuStart;
+    fprintf(stderr, "Completed CPU computation in %.4fs.\n", cpuTime);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Speedup from GPU: x%.4f\n", cpuTime / gpuTime);
+    fprintf(stderr, "Speedup from parallel CPU: x%.4f\n", cpuTime / parTime);
+    fprintf(stderr, "Speedup from meet-in-the-middle CPU: x%.4f\n",
+        cpuTime / meetTime);
+    fprintf(stderr, "Speedup from vectorized CPU: x%.4f\n", cpuTime / vecTime);
+    fprintf(stderr, "Speedup from linear-space CPU: x%.4f\n",
+        cpuTime / linTime);
+    fprintf(stderr, "Parallel CPU over GPU: x%.4f\n", gpuTime / parTime);
+
+    if (knn > 0) {
+      lsknn K(ref, knn, g, theta);
+      double knnStart = CycleTimer::currentSeconds();
+      K.run(s, true, [](int i, const float* r) {});
+      double knnEnd = CycleTimer::currentSeconds();
+      double worst;
+      double mean = K.loss(s, panel, &worst);
+      fprintf(stderr, "Ran %d nearest references per window in %.4fs "
+          "(x%.4f); allele posteriors off by %.4f on average, %.4f at "
+          "worst.\n", knn, knnEnd-knnStart, cpuTime / (knnEnd-knnStart),
+          mean, worst);
+    }
+
+    if (top > 0) {
+      double topStart = CycleTimer::currentSeconds();
+      lscsr* R = ls_top(panel, s, top, eps);
+      impsnp* tcalls = impute_csr(R, ref);
+      double topEnd = CycleTimer::currentSeconds();
+      float* L = ls_lin(panel, s, true, NULL);
+      impsnp* lcalls = impute(L, true, ref);
+      double tv = 0.0;
+      double rest = 0.0;
+      for (int i = 0; i < panel->nsnp; i++) {
+        for (int a = 0; a < 4; a++) {
+          tv += fabs(tcalls[i].p[a] - lcalls[i].p[a]) / 2;
+        }
+        rest += R->rest[i];
+      }
+      size_t nnz = R->ptr[panel->nsnp];
+      size_t bytes = sizeof(int) * (panel->nsnp + 1 + nnz)
+          + sizeof(float) * (panel->nsnp + nnz);
+      fprintf(stderr, "Kept %.1f references per SNP (%.1f MB against %.1f "
+          "MB dense) and imputed from them in %.4fs (x%.4f); left out %.4f "
+          "of a SNP's probability, allele posteriors off by %.4f, on "
+          "average.\n", (double)nnz / panel->nsnp, bytes / 1e6,
+          sizeof(float) * (double)panel->nsnp * panel->nsample / 1e6,
+          topEnd-topStart, cpuTime / (topEnd-topStart), rest / panel->nsnp,
+          tv / panel->nsnp);
+      lscsr_free(R);
+      free(tcalls);
+      free(L);
+      free(lcalls);
+    }
+
+    if (beam > 0) {
+      // Accuracy against ls_lin(), as the allele posteriors' total variation,
+      // next to the mass the beam says it moved
+      std::vector<float> lost(panel->nsnp);
+      double beamStart = CycleTimer::currentSeconds();
+      float* B = ls_beam(panel, s, beam, eps, true, lost.data());
+      double beamEnd = CycleTimer::currentSeconds();
+      float* L = ls_lin(panel, s, true, NULL);
+      impsnp* bcalls = impute(B, true, ref);
+      impsnp* lcalls = impute(L, true, ref);
+      double tv = 0.0;
+      double worst = 0.0;
+      double moved = 0.0;
+      double most = 0.0;
+      for (int i = 0; i < panel->nsnp; i++) {
+        double d = 0.0;
+        for (int a = 0; a < 4; a++) {
+          d += fabs(bcalls[i].p[a] - lcalls[i].p[a]) / 2;
+        }
+        tv += d;
+        worst = fmax(worst, d);
+        moved += lost[i];
+        most = fmax(most, lost[i]);
+      }
+      fprintf(stderr, "Ran a beam of %d references in %.4fs (x%.4f); allele "
+          "posteriors off by %.4f on average, %.4f at worst; moved %.4f of "
+          "a SNP's mass on average, %.4f at most.\n", beam,
+          beamEnd-beamStart, cpuTime / (beamEnd-beamStart),
+          tv / panel->nsnp, worst, moved / panel->nsnp, most);
+      free(B);
+      free(L);
+      free(bcalls);
+      free(lcalls);
+    }
+
+    if (dedup > 0) {
+      double dedupStart = CycleTimer::currentSeconds();
+      lsdedup D(panel, dedup);
+      double dedupMid = CycleTimer::currentSeconds();
+      float* A = D.alleles(s);
+      impsnp* dcalls = impute_alleles(A, panel->nsnp);
+      double dedupEnd = CycleTimer::currentSeconds();
+      fprintf(stderr, "Merged %d references into %.1f states per SNP in "
+          "%.4fs; imputed from them in %.4fs (x%.4f).\n", panel->nsample,
+          D.states(), dedupMid-dedupStart, dedupEnd-dedupMid,
+          cpuTime / (dedupEnd-dedupMid));
+      free(A);
+      free(dcalls);
+    }
+
+    if (width > 0.0f) {
+      // Penalty for the windows: how far each allele's posterior moves, and
+      // how many calls change, against the same engine unwindowed
+      impsnp* wcalls = (impsnp*)malloc(sizeof(impsnp) * panel->nsnp);
+      double chunkStart = CycleTimer::currentSeconds();
+      ls_chunk(panel, s, width, width * LS_CHUNK_BURNIN, &pool, true,
+          [&](int i, const float* r) {
+            impute_row(r, true, panel->ref.get(), i, &(wcalls[i]));
+          });
+      double chunkEnd = CycleTimer::currentSeconds();
+      float* L = ls_lin(panel, s, true, NULL);
+      impsnp* lcalls = impute(L, true, ref);
+      free(L);
+      double tv = 0.0;
+      int changed = 0;
+      for (int i = 0; i < panel->nsnp; i++) {
+        for (int a = 0; a < 4; a++) {
+          tv += fabs(wcalls[i].p[a] - lcalls[i].p[a]) / 2;
+        }
+        changed += wcalls[i].call != lcalls[i].call;
+      }
+      fprintf(stderr, "Completed chunked CPU computation and imputation "
+          "(%d threads) in %.4fs; allele posteriors off by %.4f on "
+          "average, %d of %d calls changed.\n", nthread,
+          chunkEnd-chunkStart, tv / panel->nsnp, changed, panel->nsnp);
+      free(wcalls);
+      free(lcalls);
+    }
+
+    double impStart = CycleTimer::currentSeconds();
+    impsnp* calls = impute(P, false, ref);
+    double impEnd = CycleTimer::currentSeconds();
+    fprintf(stderr, "Imputed from posteriors in %.4fs.\n", impEnd-impStart);
+    free(P);
 #else
-    if (!sequential) {
-#endif
-      // XXX Note to Cam:
-      // The number after id.first (at the moment) useless
-      P = ls_gpu(ref, sam, id.first, 0, g, theta);
-#if BENCH
-      double gpuEnd = CycleTimer::currentSeconds();
-      double gpuTime = gpuEnd-gpuStart;
-      fprintf(stderr, "Completed GPU computation in %.4fs.\n", gpuTime);
-      double cpuStart = CycleTimer::currentSeconds();
-#else
+    impsnp* calls;
+    if (gpu) {
+      P = panel->compute(s);
+      calls = impute(P, false, ref);
+      free(P);
+    }
+    else if (width > 0.0f) {
+      // Windows of the one haplotype run on every thread at once
+      calls = (impsnp*)malloc(sizeof(impsnp) * panel->nsnp);
+      ls_chunk(panel, s, width, width * LS_CHUNK_BURNIN, &pool, true,
+          [&](int i, const float* r) {
+            impute_row(r, true, panel->ref.get(), i, &(calls[i]));
+          });
+    }
+    else if (sequential) {
+      // Rows go straight to the imputer as they're smoothed, so nothing the
+      // size of the posterior matrix is ever held
+      calls = (impsnp*)malloc(sizeof(impsnp) * panel->nsnp);
+      bool ok = ls_ckpt(panel, s, budget, true, [&](int i, const float* r) {
+        impute_row(r, true, panel->ref.get(), i, &(calls[i]));
+      });
+      if (!ok) {
+        fprintf(stderr, "Could not run the HMM for sample %s\n", id.c_str());
+        free(calls);
+        delete[] s;
+        delete panel;
+        return 1;
+      }
     }
     else {
-#endif
-      P = ls(sam, id.first, ref, g, theta);
-#if BENCH
-      double cpuEnd = CycleTimer::currentSeconds();
-      double cpuTime = cpuEnd-cpuStart;
-      fprintf(stderr, "Completed CPU computation in %.4fs.\n", cpuTime);
-      fprintf(stderr, "\n");
-      fprintf(stderr, "Speedup from GPU: x%.4f\n", cpuTime / gpuTime);
-#else
+      P = ls_par(panel, s, &pool);
+      calls = impute(P, false, ref);
+      free(P);
     }
+    if (out != NULL) writecalls(out, id, calls, panel->nsnp);
 #endif
-    // TODO: impute here
-    free(P);
+    free(calls);
+    delete[] s;
   }
 
+  if (out != NULL) fclose(out);
+  delete panel;
   return 0;
 }
@@ -0,0 +1,271 @@
+/* Positional Burrows-Wheeler transform.
+ *
+ * Building is Durbin's algorithm 2 with four buckets instead of two: one
+ * stable pass over the order before SNP k, dealing haplotypes into buckets by
+ * their allele at k, gives the order before k + 1, and the divergence of
+ * each haplotype from the one before it in its bucket is the largest
+ * divergence passed over since then.
+ *
+ * Matching (Durbin's algorithm 5) keeps the block [f, g) of haplotypes that
+ * share the target's longest suffix. Extending it by a SNP maps both ends
+ * through next(), which is a rank in the packed row of y. When the block
+ * empties, the new longest suffix is shared with a neighbour of the target's
+ * insertion point, and the divergence array widens the block back out from
+ * there.
+ */
+
+#include "pbwt.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#define ERROR(fname,msg) std::cerr << (fname) << ":" << msg
+
+// First bytes of a saved transform, and its format version
+static const char pbwtmagic[8] = { 'L', 'S', 'P', 'B', 'W', 'T', 0, 1 };
+
+pbwt::pbwt(std::shared_ptr<hapmat> panel) : y(panel->nsnp, panel->nhap) {
+    ref = panel;
+    nsnp = panel->nsnp;
+    nhap = panel->nhap;
+    panelhash = hash(*panel);
+    int nword = y.nword;
+
+    // The bulk of the index: nsnp + 1 rows of nhap each in both a and d (see
+    // the memory note in pbwt.h)
+    a.resize((size_t)(nsnp + 1) * nhap);
+    d.resize((size_t)(nsnp + 1) * nhap);
+    occ.resize((size_t)nsnp * (nword + 1) * 4);
+    below.resize((size_t)nsnp * 4);
+    for (int i = 0 ; i < nhap ; i += 1) {
+        a[i] = i;
+        d[i] = 0;
+    }
+
+    std::vector<int32_t> ba[4];
+    std::vector<int32_t> bd[4];
+    for (int k = 0 ; k < nsnp ; k += 1) {
+        const int32_t* ak = &a[(size_t)k * nhap];
+        const int32_t* dk = &d[(size_t)k * nhap];
+        int32_t p[4] = { k + 1, k + 1, k + 1, k + 1 };
+        int32_t* o = &occ[(size_t)k * (nword + 1) * 4];
+        int32_t cnt[4] = { 0, 0, 0, 0 };
+        for (int c = 0 ; c < 4 ; c += 1) {
+            ba[c].clear();
+            bd[c].clear();
+        }
+
+        for (int i = 0 ; i < nhap ; i += 1) {
+            if ((i & 63) == 0) {
+                memcpy(&o[(i >> 6) * 4], cnt, sizeof(cnt));
+            }
+            for (int c = 0 ; c < 4 ; c += 1) {
+                if (dk[i] > p[c]) { p[c] = dk[i]; }
+            }
+            int c = panel->get(k, ak[i]);
+            y.set(k, i, (allele)c);
+            cnt[c] += 1;
+            ba[c].push_back(ak[i]);
+            bd[c].push_back(p[c]);
+            p[c] = 0;
+        }
+        memcpy(&o[nword * 4], cnt, sizeof(cnt));
+
+        int32_t* an = &a[(size_t)(k + 1) * nhap];
+        int32_t* dn = &d[(size_t)(k + 1) * nhap];
+        int n = 0;
+        for (int c = 0 ; c < 4 ; c += 1) {
+            below[k * 4 + c] = n;
+            std::copy(ba[c].begin(), ba[c].end(), an + n);
+            std::copy(bd[c].begin(), bd[c].end(), dn + n);
+            n += ba[c].size();
+        }
+    }
+}
+
+uint64_t pbwt::hash(const hapmat& panel) {
+    // FNV-1a over the shape and the packed words
+    uint64_t h = 14695981039346656037ULL;
+    uint64_t shape[2] = { (uint64_t)panel.nsnp, (uint64_t)panel.nhap };
+    for (int i = 0 ; i < 2 ; i += 1) { h = (h ^ shape[i]) * 1099511628211ULL; }
+    for (uint64_t x : panel.bits) { h = (h ^ x) * 1099511628211ULL; }
+    return h;
+}
+
+size_t pbwt::bytes() const {
+    return sizeof(int32_t) * (a.size() + d.size() + occ.size() + below.size())
+        + sizeof(uint64_t) * y.bits.size();
+}
+
+int pbwt::next(int k, int i, int c) const {
+    int w = i >> 6;
+    int r = occ[((size_t)k * (y.nword + 1) + w) * 4 + c];
+    if (i & 63) {
+        uint64_t m = ~y.mismatch(k, w, c) & ((1ULL << (i & 63)) - 1);
+        r += __builtin_popcountll(m);
+    }
+    return below[k * 4 + c] + r;
+}
+
+int pbwt::restart(const uint8_t* z, int k, int p, int* f, int* g) const {
+    const int32_t* an = &a[(size_t)(k + 1) * nhap];
+    const int32_t* dn = &d[(size_t)(k + 1) * nhap];
+    int c = z[k];
+    int lo = below[k * 4 + c];
+    int hi = c < 3 ? below[k * 4 + c + 1] : nhap;
+
+    // Nobody has z's allele at k, so the only match ending there is empty
+    if (lo == hi) {
+        *f = 0;
+        *g = nhap;
+        return k + 1;
+    }
+
+    // The neighbours of z in its bucket; whichever matches further back
+    // (they match at k by being in the bucket) has the longest suffix
+    int e[2] = { k + 1, k + 1 };
+    int nb[2] = { p - 1, p };
+    for (int t = 0 ; t < 2 ; t += 1) {
+        if (nb[t] < lo || nb[t] >= hi) { continue; }
+        int j = k;
+        while (j > 0 && ref->get(j - 1, an[nb[t]]) == z[j - 1]) { j -= 1; }
+        e[t] = j;
+    }
+    int e1 = e[0] < e[1] ? e[0] : e[1];
+
+    *f = p;
+    *g = p;
+    if (e[0] == e1) {
+        *f = p - 1;
+        while (*f > 0 && dn[*f] <= e1) { *f -= 1; }
+    }
+    if (e[1] == e1) {
+        *g = p + 1;
+        while (*g < nhap && dn[*g] <= e1) { *g += 1; }
+    }
+    return e1;
+}
+
+void pbwt::longest(const uint8_t* z, int* start, int* hap) const {
+    int e = 0;
+    int f = 0;
+    int g = nhap;
+    for (int k = 0 ; k < nsnp ; k += 1) {
+        int f1 = next(k, f, z[k]);
+        int g1 = next(k, g, z[k]);
+        if (f1 < g1) {
+            f = f1;
+            g = g1;
+        }
+        else {
+            e = restart(z, k, f1, &f, &g);
+        }
+        start[k] = e;
+        hap[k] = e <= k ? a[(size_t)(k + 1) * nhap + f] : -1;
+    }
+}
+
+std::vector<pbwtmatch> pbwt::setmaximal(const uint8_t* z) const {
+    std::vector<pbwtmatch> out;
+    int e = 0;
+    int f = 0;
+    int g = nhap;
+    for (int k = 0 ; k < nsnp ; k += 1) {
+        int f1 = next(k, f, z[k]);
+        int g1 = next(k, g, z[k]);
+        if (f1 < g1) {
+            f = f1;
+            g = g1;
+            continue;
+        }
+
+        // Nobody in the block matches at k, so their matches end here. They
+        // are set-maximal unless the longest match through k starts no
+        // later, and so contains them.
+        int f0 = f;
+        int g0 = g;
+        int e0 = e;
+        e = restart(z, k, f1, &f, &g);
+        for (int i = f0 ; i < g0 && e0 < k && e0 < e ; i += 1) {
+            out.push_back({ a[(size_t)k * nhap + i], e0, k });
+        }
+    }
+    for (int i = f ; i < g && e < nsnp ; i += 1) {
+        out.push_back({ a[(size_t)nsnp * nhap + i], e, nsnp });
+    }
+    return out;
+}
+
+bool pbwt::save(std::string fname) const {
+    FILE* fp = fopen(fname.c_str(), "wb");
+    if (fp == NULL) { return false; }
+
+    int32_t shape[2] = { nsnp, nhap };
+    bool ok = fwrite(pbwtmagic, 1, sizeof(pbwtmagic), fp) == sizeof(pbwtmagic)
+        && fwrite(shape, sizeof(int32_t), 2, fp) == 2
+        && fwrite(&panelhash, sizeof(panelhash), 1, fp) == 1
+        && fwrite(a.data(), sizeof(int32_t), a.size(), fp) == a.size()
+        && fwrite(d.data(), sizeof(int32_t), d.size(), fp) == d.size()
+        && fwrite(y.bits.data(), sizeof(uint64_t), y.bits.size(), fp)
+            == y.bits.size()
+        && fwrite(occ.data(), sizeof(int32_t), occ.size(), fp) == occ.size()
+        && fwrite(below.data(), sizeof(int32_t), below.size(), fp)
+            == below.size();
+    return fclose(fp) == 0 && ok;
+}
+
+pbwt* pbwt::load(std::string fname, std::shared_ptr<hapmat> panel) {
+    FILE* fp = fopen(fname.c_str(), "rb");
+    if (fp == NULL) {
+        ERROR(fname, "could not open file\n");
+        return NULL;
+    }
+
+    char magic[sizeof(pbwtmagic)];
+    int32_t shape[2];
+    uint64_t h;
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+            || memcmp(magic, pbwtmagic, sizeof(magic)) != 0
+            || fread(shape, sizeof(int32_t), 2, fp) != 2
+            || fread(&h, sizeof(h), 1, fp) != 1) {
+        ERROR(fname, "not a PBWT index\n");
+        fclose(fp);
+        return NULL;
+    }
+    if (shape[0] != panel->nsnp || shape[1] != panel->nhap
+            || h != hash(*panel)) {
+        ERROR(fname, "index was built from a different panel\n");
+        fclose(fp);
+        return NULL;
+    }
+
+    pbwt* P = new pbwt();
+    P->ref = panel;
+    P->nsnp = shape[0];
+    P->nhap = shape[1];
+    P->panelhash = h;
+    P->y = hapmat(P->nsnp, P->nhap);
+    P->a.resize((size_t)(P->nsnp + 1) * P->nhap);
+    P->d.resize(P->a.size());
+    P->occ.resize((size_t)P->nsnp * (P->y.nword + 1) * 4);
+    P->below.resize((size_t)P->nsnp * 4);
+
+    bool ok = fread(P->a.data(), sizeof(int32_t), P->a.size(), fp)
+            == P->a.size()
+        && fread(P->d.data(), sizeof(int32_t), P->d.size(), fp)
+            == P->d.size()
+        && fread(P->y.bits.data(), sizeof(uint64_t), P->y.bits.size(), fp)
+            == P->y.bits.size()
+        && fread(P->occ.data(), sizeof(int32_t), P->occ.size(), fp)
+            == P->occ.size()
+        && fread(P->below.data(), sizeof(int32_t), P->below.size(), fp)
+            == P->below.size();
+    fclose(fp);
+    if (!ok) {
+        ERROR(fname, "truncated PBWT index\n");
+        delete P;
+        return NULL;
+    }
+    return P;
+}
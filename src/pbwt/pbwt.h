@@ -0,0 +1,116 @@
+/* Positional Burrows-Wheeler transform (Durbin 2014) of a reference panel.
+ */
+
+#ifndef PBWT_H
+#define PBWT_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../plinker/hapmat.h"
+
+// A match between a target and reference haplotype hap over SNPs [start, end)
+struct pbwtmatch {
+    int hap;
+    int start;
+    int end;
+};
+
+/* Before every SNP k, the PBWT sorts the haplotypes of a panel by their
+ * prefixes [0, k) read backwards, so haplotypes that match over a long
+ * stretch ending at k sit next to each other. Matching a target then takes a
+ * couple of rank lookups per SNP to track the block of haplotypes that share
+ * its longest suffix, rather than a scan of the panel.
+ *
+ * Alleles take all four values, not just two: each SNP sorts into four
+ * buckets.
+ *
+ * Memory: the prefix and divergence arrays are kept whole, 8 bytes per
+ * haplotype per SNP, on top of y (the size of the packed panel again) and
+ * occ. That's about 33 times the packed panel: a 60,000 SNP by 250,000
+ * haplotype panel, under 4GB packed, needs 120GB of index. bytes() gives the
+ * exact figure. Sampling a and d every few SNPs would cut that down, but
+ * matching reads them at arbitrary positions of every SNP, and rebuilding a
+ * row from the last sample costs O(nhap) a SNP, which is the scan the index
+ * is there to avoid. So the index is for panels (or windows of them) that
+ * fit in memory that many times over, and is built once, by lsimpute -I,
+ * next to the reference fileset.
+ *
+ * The fields are filled in by the constructor or load() and never change
+ * after; they're public so that tests can check the transform directly.
+ * Nothing else should write to them, and the arrays must stay consistent
+ * with each other and with ref.
+ */
+class pbwt {
+public:
+    int nsnp;
+    int nhap;
+    // The panel itself, shared; matching reads alleles from it
+    std::shared_ptr<hapmat> ref;
+    // a[k * nhap + i] is the i-th haplotype in the order before SNP k, for k
+    // in [0, nsnp]
+    std::vector<int32_t> a;
+    // d[k * nhap + i] is the first SNP of the longest match ending at k - 1
+    // between haplotypes a[k][i] and a[k][i-1] (k if they differ at k - 1,
+    // and k for i = 0)
+    std::vector<int32_t> d;
+    // Row k of y holds the alleles at SNP k in the order before k, packed as
+    // in hapmat, so that ranks come from popcounts of hapmat::mismatch
+    hapmat y;
+    // occ[(k * (nword + 1) + w) * 4 + c] counts allele c among the first 64*w
+    // entries of row k of y, and below[k * 4 + c] alleles less than c
+    std::vector<int32_t> occ;
+    std::vector<int32_t> below;
+    // Hash of the panel the transform was built from, to catch stale files
+    uint64_t panelhash;
+
+    // Builds the transform of panel
+    pbwt(std::shared_ptr<hapmat> panel);
+
+    /* Reads a transform written by save(). Returns NULL (after printing why)
+     * if the file can't be read, or wasn't built from panel.
+     */
+    static pbwt* load(std::string fname, std::shared_ptr<hapmat> panel);
+
+    // Writes the transform to fname. Returns false if it couldn't.
+    bool save(std::string fname) const;
+
+    // Fingerprint of the alleles of a panel, as stored in panelhash
+    static uint64_t hash(const hapmat& panel);
+
+    // Bytes held by the transform (not counting the shared panel)
+    size_t bytes() const;
+
+    /* For every SNP k, sets start[k] to the first SNP of the longest match
+     * between z (nsnp alleles) and any reference ending at k, and hap[k] to
+     * a reference with that match. With no reference matching z at k,
+     * start[k] is k + 1 and hap[k] is -1.
+     */
+    void longest(const uint8_t* z, int* start, int* hap) const;
+
+    /* Set-maximal matches between z and the panel: matches with a reference
+     * that no match with any reference extends in either direction.
+     * Empty matches are left out.
+     */
+    std::vector<pbwtmatch> setmaximal(const uint8_t* z) const;
+
+private:
+    pbwt() : y(0, 0) {}
+
+    // Position in the order before k + 1 of the haplotype at position i
+    // before k, if its allele at k were c
+    int next(int k, int i, int c) const;
+
+    // Matches ending at k with the block [f, g) (positions before k + 1) of
+    // haplotypes sharing z's longest suffix: moves the block past a failed
+    // extension at SNP k, given the insertion point p of z before k + 1, and
+    // returns its new start
+    int restart(const uint8_t* z, int k, int p, int* f, int* g) const;
+
+    pbwt(const pbwt&);
+    pbwt& operator=(const pbwt&);
+};
+
+#endif
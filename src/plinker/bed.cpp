@@ -0,0 +1,234 @@
+/* PLINK binary (.bed/.bim/.fam) reader.
+ *
+ * A SNP-major .bed file stores each SNP as a run of 2-bit genotype codes, four
+ * individuals to a byte, lowest bits first. Individual k's code is therefore
+ * at bits 2k and 2k+1 of its SNP's record, which are exactly the columns of
+ * its two haplotypes in the packed matrix. Decoding is done 32 individuals (one
+ * hapmat word) at a time with a handful of bitwise operations per word.
+ */
+
+#include "genome_c.h"
+#include "hapmat.h"
+#include "mfile.h"
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if DEBUG
+#include <cstdio>
+#define D_PRINTF(args...) fprintf(stderr, args)
+#else
+#define D_PRINTF(args...)
+#endif
+
+#define IFCHK(cond,onfail) if (!(cond)) { onfail; }
+#define ERROR(fname,ln,msg) std::cerr << (fname) << "." << (ln) << ":" << msg
+
+// Every .bed file starts with these; the last byte marks it SNP-major
+static const unsigned char bedmagic[3] = { 0x6c, 0x1b, 0x01 };
+
+// Low bit of every 2-bit genotype code in a word
+#define EVENBITS 0x5555555555555555ULL
+
+/* Reads a .bim file into SNP metadata (in file order) and the two alleles of
+ * every SNP. Alleles that aren't a single A, C, G or T (e.g. the 0 PLINK
+ * writes for monomorphic SNPs) come back as -1.
+ */
+static std::shared_ptr<std::vector<struct snpmeta>> readbim(
+    std::string bimname, std::vector<int>* a1, std::vector<int>* a2) {
+    mfile f(bimname);
+    if (!f.ok) {
+        ERROR(bimname, 0, "could not open file\n");
+        return NULL;
+    }
+
+    auto data =
+        std::shared_ptr<std::vector<struct snpmeta>>
+        (new std::vector<struct snpmeta>);
+
+    const char* p = f.p;
+    const char* end = f.p + f.n;
+    int ln = 0;
+    int ind = 0;
+    while (p < end) {
+        ln += 1;
+        if (emptyline(p, end)) {
+            nextline(&p, end);
+            continue;
+        }
+
+        struct snpmeta s;
+        const char* t;
+        size_t len;
+        long x;
+
+        IFCHK(token(&p, end, &t, &len),
+                ERROR(bimname, ln, "parse error\n");
+                return NULL);
+        IFCHK(parsechrom(t, len, &s.chnum),
+                ERROR(bimname, ln, "chromosome number must be 1-22,X,Y\n");
+                return NULL);
+
+        IFCHK(token(&p, end, &t, &len),
+                ERROR(bimname, ln, "parse error\n");
+                return NULL);
+        s.id.assign(t, len);
+
+        IFCHK(token(&p, end, &t, &len) && parsedouble(t, len, &s.gdist),
+                ERROR(bimname, ln, "parse error\n");
+                return NULL);
+
+        IFCHK(token(&p, end, &t, &len) && parseint(t, len, &x),
+                ERROR(bimname, ln, "parse error\n");
+                return NULL);
+        s.pos = x;
+        s.ind = ind;
+
+        IFCHK(token(&p, end, &t, &len),
+                ERROR(bimname, ln, "parse error\n");
+                return NULL);
+        a1->push_back(len == 1 ? acode(t[0]) : -1);
+        IFCHK(token(&p, end, &t, &len),
+                ERROR(bimname, ln, "parse error\n");
+                return NULL);
+        a2->push_back(len == 1 ? acode(t[0]) : -1);
+
+        (*data).push_back(s);
+        ind += 1;
+        nextline(&p, end);
+    }
+
+    return data;
+}
+
+// Reads the ids of the haplotypes of every individual in a .fam file, in order
+static bool readfam(std::string famname, std::vector<std::string>* names) {
+    mfile f(famname);
+    if (!f.ok) {
+        ERROR(famname, 0, "could not open file\n");
+        return false;
+    }
+
+    const char* p = f.p;
+    const char* end = f.p + f.n;
+    int ln = 0;
+    while (p < end) {
+        ln += 1;
+        if (emptyline(p, end)) {
+            nextline(&p, end);
+            continue;
+        }
+
+        const char* t;
+        size_t len;
+
+        IFCHK(token(&p, end, &t, &len),
+                ERROR(famname, ln, "parse error\n");
+                return false);
+        std::string name(t, len);
+        IFCHK(token(&p, end, &t, &len),
+                ERROR(famname, ln, "parse error\n");
+                return false);
+        name.append("_");
+        name.append(t, len);
+
+        names->push_back(name + "_1");
+        names->push_back(name + "_2");
+        nextline(&p, end);
+    }
+    return true;
+}
+
+genome_t g_frombed(std::string bedname, std::string bimname,
+    std::string famname) {
+    auto result = std::shared_ptr<struct genome>(new struct genome);
+    result->nsample = 0;
+
+    std::vector<int> a1;
+    std::vector<int> a2;
+    auto data = readbim(bimname, &a1, &a2);
+    if (data == NULL) { return NULL; }
+    if (!readfam(famname, &(result->names))) { return NULL; }
+    g_setsnps(result, data);
+
+    int nsnp = (result->map).nsnp;
+    int nhap = result->names.size();
+    int* ids = (result->map).id_arr();
+
+    mfile f(bedname);
+    if (!f.ok) {
+        ERROR(bedname, 0, "could not open file\n");
+        return NULL;
+    }
+    if (f.n < 3 || memcmp(f.p, bedmagic, 3) != 0) {
+        ERROR(bedname, 0, "not a SNP-major PLINK .bed file\n");
+        return NULL;
+    }
+    size_t nbyte = (nhap / 2 + 3) / 4;
+    if (f.n != 3 + nbyte * nsnp) {
+        ERROR(bedname, 0, "file size doesn't match the .bim and .fam files\n");
+        return NULL;
+    }
+
+    auto haps = std::make_shared<struct hapmat>(nsnp, nhap);
+    result->haps = haps;
+    int nword = haps->nword;
+
+    // Codes are 00 (hom. A1), 01 (missing), 10 (het.) and 11 (hom. A2), so
+    // the first haplotype has A2 iff the low bit is set and the second iff
+    // either bit is. Missing genotypes are read as homozygous A2, which is
+    // the major allele in files PLINK wrote.
+    long nmissing = 0;
+    for (int i = 0 ; i < nsnp ; i += 1) {
+        const unsigned char* rec = (const unsigned char*)f.p + 3 + nbyte * i;
+        uint64_t* lo = &(haps->bits[(size_t)2 * ids[i] * nword]);
+        uint64_t* hi = lo + nword;
+
+        // With an unusable allele, every haplotype had better have the other
+        int x1 = a1[i] < 0 ? a2[i] : a1[i];
+        int x2 = a2[i] < 0 ? a1[i] : a2[i];
+        uint64_t lo1 = 0 - (uint64_t)(x1 & 1);
+        uint64_t hi1 = 0 - (uint64_t)((x1 >> 1) & 1);
+        uint64_t dlo = 0 - (uint64_t)((x1 ^ x2) & 1);
+        uint64_t dhi = 0 - (uint64_t)(((x1 ^ x2) >> 1) & 1);
+
+        for (int w = 0 ; w < nword ; w += 1) {
+            // Code bytes are in increasing individual order, so on a
+            // little-endian machine a plain load puts them in column order
+            uint64_t x = 0;
+            size_t n = nbyte - 8 * (size_t)w;
+            memcpy(&x, rec + 8 * (size_t)w, n < 8 ? n : 8);
+
+            uint64_t valid = ~0ULL;
+            if (w == nword - 1 && (nhap & 63)) {
+                valid = (1ULL << (nhap & 63)) - 1;
+            }
+            uint64_t isa2 = (x | ((x & EVENBITS) << 1)) & valid;
+            nmissing += __builtin_popcountll(x & ~(x >> 1) & EVENBITS & valid);
+
+            if ((a1[i] < 0 && (~isa2 & valid)) || (a2[i] < 0 && isa2)) {
+                ERROR(bimname, i + 1, "invalid allele for a genotype\n");
+                throw genomeErr("Unknown allele string.");
+            }
+
+            lo[w] = ((lo1 & valid) ^ (isa2 & dlo));
+            hi[w] = ((hi1 & valid) ^ (isa2 & dhi));
+        }
+    }
+    if (nmissing > 0) {
+        ERROR(bedname, 0, nmissing << " missing genotypes read as "
+                << "homozygous A2\n");
+    }
+
+    for (int i = 0 ; i < nhap ; i += 1) {
+        (result->samples).insert(std::make_pair(result->names[i], i));
+        D_PRINTF("inserting sample name %s\n", result->names[i].c_str());
+    }
+
+    result->nsample = nhap;
+    return result;
+}
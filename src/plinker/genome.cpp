@@ -1,5 +1,6 @@
 
 #include "genome_c.h"
+#include "hapmat.h"
 
 #include <memory>
 #include <new>
@@ -10,6 +11,7 @@
 #include <vector>
 #include <algorithm>
 #include <exception>
+#include <unordered_set>
 
 #if DEBUG
 #include <cstdio>
@@ -50,94 +52,119 @@ static inline int rselect(allele a) {
     }
 }
 
-static inline int search(
-    std::shared_ptr<std::string> arr, int n, std::string arg
-) {
-    std::string* arr_ = arr.get();
-    for (int i = 0 ; i < n ; i += 1) {
-        if (arr_[i] == arg) { return i; }
-    }
-    return -1;
-}
-
 int g_nsample(genome_t g) { return g->nsample; }
 int g_nsnp(genome_t g) { return (g->map).nsnp; }
 
-void g_filterby(genome_t g, genome_t f) {
+/* Keeps only the SNPs of g whose (bp-order) indices are set in keep, along
+ * with their rows of the haplotype matrix. Everything is already in bp order,
+ * so this is a single pass over the SNPs.
+ */
+static void keepsnps(genome_t g, const std::vector<bool>& keep) {
     auto gm = g->map;
-    auto fm = f->map;
+    int nsnp = 0;
+    for (int i = 0 ; i < gm.nsnp ; i += 1) { nsnp += keep[i]; }
+    if (nsnp == gm.nsnp) { return; }
 
-    auto keeps = std::vector<struct snpmeta>(16);
+    // Renumber the survivors in their old mapfile order
+    std::vector<int> ind(gm.nsnp);
+    int n = 0;
     for (int i = 0 ; i < gm.nsnp ; i += 1) {
-        // XXX - this would just be gm.id[i] if we had a more recent version of
-        // g++ on andrew...
-        auto idx = gm.id_arr()[i];
-        auto k = (*gm.data)[idx];
-        if (search(fm.sids, fm.nsnp, k.id) != -1) {
-            keeps.push_back((*gm.data)[idx]);
-        }
+        int idx = gm.id_arr()[i];
+        if (keep[idx]) { ind[idx] = n++; }
+    }
+
+    auto data = std::make_shared<std::vector<struct snpmeta>>();
+    data->reserve(nsnp);
+    auto haps = std::make_shared<struct hapmat>(nsnp, g->haps->nhap);
+    size_t w = 2 * (size_t)haps->nword;
+    for (int i = 0 ; i < gm.nsnp ; i += 1) {
+        if (!keep[i]) { continue; }
+        const uint64_t* src = g->haps->bits.data() + w * i;
+        std::copy(src, src + w, haps->bits.data() + w * data->size());
+        data->push_back((*gm.data)[i]);
+        data->back().ind = ind[i];
     }
 
-    size_t nsnp = keeps.size();
+    g_setsnps(g, data);
+    g->haps = haps;
+}
 
-    for (size_t i = 0 ; i < nsnp ; i += 1) { keeps[i].ind = i; }
+void g_filterby(genome_t g, genome_t f) {
+    auto gm = g->map;
 
-    (g->map).nsnp = nsnp;
-    std::sort(keeps.begin(), keeps.end());
-
-    (g->map).sids = std::shared_ptr<std::string>(
-          new std::string[nsnp],
-          std::default_delete<std::string[]>()
-        );
-    (g->map).ids = std::shared_ptr<int>
-        (new int[nsnp], std::default_delete<int[]>());
-
-    for (size_t i = 0 ; i < nsnp ; i += 1) {
-        (g->map).sids.get()[i] = keeps[i].id;
-        (g->map).id_arr()[keeps[i].ind] = i;
+    std::vector<bool> keep(gm.nsnp);
+    for (int i = 0 ; i < gm.nsnp ; i += 1) {
+        keep[i] = g_snpindex(f, (*gm.data)[i].id) != -1;
     }
+    keepsnps(g, keep);
+}
 
-    (g->map).data = std::make_shared<std::vector<struct snpmeta>>(keeps);
+void g_intersect(genome_t a, genome_t b) {
+    auto& da = *(a->map).data;
+    auto& db = *(b->map).data;
+    int na = (a->map).nsnp;
+    int nb = (b->map).nsnp;
+
+    // Both are sorted by position, so merge them a run of equal positions at
+    // a time. Runs are almost always a single SNP.
+    std::vector<bool> ka(na);
+    std::vector<bool> kb(nb);
+    int i = 0;
+    int j = 0;
+    while (i < na && j < nb) {
+        if (da[i].pos < db[j].pos) { i += 1; }
+        else if (db[j].pos < da[i].pos) { j += 1; }
+        else {
+            int ie = i;
+            int je = j;
+            while (ie < na && da[ie].pos == da[i].pos) { ie += 1; }
+            while (je < nb && db[je].pos == db[j].pos) { je += 1; }
+            for (int x = i ; x < ie ; x += 1) {
+                for (int y = j ; y < je ; y += 1) {
+                    if (da[x].id == db[y].id && da[x].chnum == db[y].chnum) {
+                        ka[x] = true;
+                        kb[y] = true;
+                    }
+                }
+            }
+            i = ie;
+            j = je;
+        }
+    }
+    keepsnps(a, ka);
+    keepsnps(b, kb);
 }
 
 void g_filterindiv(genome_t g, std::string* ids, int n) {
-    auto removes = std::vector<std::string>();
-    for (auto kv : g->samples) {
-        if (find(ids, ids+n, kv.first) == ids+n) {
-            removes.push_back(kv.first);
-        }
+    std::unordered_set<std::string> keep(ids, ids+n);
+
+    std::vector<std::string> names;
+    for (auto& name : g->names) {
+        if (keep.count(name) > 0) { names.push_back(name); }
     }
+    if (names.size() == g->names.size()) { return; }
 
-    for (auto n : removes) {
-        g->nsample -= 1;
-        (g->samples).erase(n);
+    auto haps = std::make_shared<struct hapmat>(g->haps->nsnp, names.size());
+    std::unordered_map<std::string, int> samples;
+    for (int i = 0 ; i < (int)names.size() ; i += 1) {
+        haps->copycol(i, *(g->haps), g_hapindex(g, names[i]));
+        samples.insert(std::make_pair(names[i], i));
     }
+
+    g->haps = haps;
+    g->names = names;
+    g->samples = samples;
+    g->nsample = names.size();
 }
 
 void g_filterchrom(genome_t g, int chromosome) {
-    auto keeps = std::vector<struct snpmeta>();
     auto gm = g->map;
 
+    std::vector<bool> keep(gm.nsnp);
     for (int i = 0 ; i < gm.nsnp ; i += 1) {
-        auto idx = gm.id_arr()[i];
-        auto k = (*gm.data)[idx];
-        if (k.chnum == chromosome) { keeps.push_back(k); }
-    }
-
-    auto nsnp = keeps.size();
-
-    for (size_t i = 0 ; i < nsnp ; i += 1) { keeps[i].ind = i; }
-
-    (g->map).nsnp = nsnp;
-    std::sort(keeps.begin(), keeps.end());
-
-    (g->map).ids = std::shared_ptr<int>
-        (new int[nsnp], std::default_delete<int[]>());
-
-    for (size_t i = 0 ; i < nsnp ; i += 1) {
-        (g->map).sids.get()[i] = keeps[i].id;
-        (g->map).id_arr()[keeps[i].ind] = i;
+        keep[i] = (*gm.data)[i].chnum == chromosome;
     }
+    keepsnps(g, keep);
 }
 
 double g_rec_dist(genome_t g, int index) {
@@ -145,38 +172,45 @@ double g_rec_dist(genome_t g, int index) {
     return ((*m)[index+1].gdist - (*m)[index].gdist);
 }
 
-snp_t* g_plookup(genome_t g, std::string pid) {
+int g_hapindex(genome_t g, std::string pid) {
     auto lst = (g->samples).find(pid);
+    return lst == (g->samples).end() ? -1 : lst->second;
+}
+
+snp_t* g_plookup(genome_t g, std::string pid) {
+    int col = g_hapindex(g, pid);
 
     // not found
-    if (lst == (g->samples).end()) { return NULL; }
+    if (col == -1) { return NULL; }
 
     auto result = new snp_t[(g->map).nsnp];
-
-    for (int i = 0 ; i < (g->map).nsnp ; i += 1) {
-        result[i] = (lst->second).get()[i];
-    }
+    (g->haps)->column(col, result);
 
     return result;
 }
 
-snp_t g_sidlookup(genome_t g, std::string pid, std::string sid) {
-    auto snps = g_plookup(g, pid);
+int g_snpindex(genome_t g, std::string sid) {
+    if ((g->map).index == NULL) { return -1; }
+    auto lst = (g->map).index->find(sid);
+    return lst == (g->map).index->end() ? -1 : lst->second;
+}
 
-    if (snps == NULL) { throw genomeErr("pid not found"); }
+snp_t g_sidlookup(genome_t g, std::string pid, std::string sid) {
+    int col = g_hapindex(g, pid);
+    if (col == -1) { throw genomeErr("pid not found"); }
 
-    auto index = search((g->map).sids, (g->map).nsnp, sid);
+    int index = g_snpindex(g, sid);
     if (index == -1) { throw genomeErr("sid not found"); }
 
-    return snps[index];
+    return (g->haps)->get(index, col);
 }
 
 snp_t g_indlookup(genome_t g, std::string pid, int ind) {
-    auto snps = g_plookup(g, pid);
+    auto lst = (g->samples).find(pid);
 
-    if (snps == NULL) { throw genomeErr("pid not found"); }
+    if (lst == (g->samples).end()) { throw genomeErr("pid not found"); }
 
-    return snps[ind];
+    return (g->haps)->get(ind, lst->second);
 }
 
 bool s_query(snp_t s, allele which) {
@@ -187,11 +221,44 @@ genome_t g_empty() {
     auto result = std::shared_ptr<struct genome>(new struct genome);
     (result->map).nsnp = 0;
     result->nsample = 0;
+    result->haps = std::make_shared<struct hapmat>(0, 0);
     return result;
 }
 
+void g_setsnps(genome_t g, std::shared_ptr<std::vector<struct snpmeta>> data) {
+    int nsnp = data->size();
+
+    // stable, so SNPs at the same position keep their mapfile order. Most
+    // inputs (and every filtered genome) are in order already.
+    if (!std::is_sorted((*data).begin(), (*data).end())) {
+        std::stable_sort((*data).begin(), (*data).end());
+    }
+    auto ids =
+        std::shared_ptr<int>(
+                new int[nsnp],
+                std::default_delete<int[]>());
+    (g->map).sids =
+        std::shared_ptr<std::string>(
+            new std::string[nsnp], std::default_delete<std::string[]>());
+
+    auto index = std::make_shared<std::unordered_map<std::string, int>>();
+    index->reserve(nsnp);
+
+    for (int i = 0 ; i < nsnp ; i += 1) {
+        auto& s = (*data)[i];
+        ids.get()[s.ind] = i;
+        (g->map).sids.get()[i] = s.id;
+        index->insert(std::make_pair(s.id, i));
+    }
+
+    (g->map).nsnp = nsnp;
+    (g->map).ids = ids;
+    (g->map).data = data;
+    (g->map).index = index;
+}
+
 // TODO: better error checking
-genome_t g_fromfile(std::string pedname, std::string mapname) {
+genome_t g_fromfile_stream(std::string pedname, std::string mapname) {
     auto result = std::shared_ptr<struct genome>(new struct genome);
     (result->map).nsnp = -1;
     result->nsample = 0;
@@ -246,27 +313,20 @@ genome_t g_fromfile(std::string pedname, std::string mapname) {
     }
 
     int nsnp = ln;
+    g_setsnps(result, data);
+    auto ids = (result->map).id_arr();
 
-    std::sort((*data).begin(), (*data).end());
-    auto ids =
-        std::shared_ptr<int>(
-                new int[ln],
-                std::default_delete<int[]>());
-    (result->map).sids =
-        std::shared_ptr<std::string>(
-            new std::string[ln], std::default_delete<std::string[]>());
-
-    for (int i = 0 ; i < ln ; i += 1) {
-        auto s = (*data)[i];
-        ids.get()[s.ind] = i;
-        (result->map).sids.get()[i] = s.id;
-    }
+    ped.open(pedname);
 
-    (result->map).nsnp = nsnp;
-    (result->map).ids = ids;
-    (result->map).data = data;
+    // Size the packed matrix up front; two haplotypes per line
+    int nline = 0;
+    while (std::getline(ped, line)) { nline += 1; }
+    ped.clear();
+    ped.seekg(0);
+    auto haps = std::make_shared<struct hapmat>(nsnp, 2 * nline);
+    result->haps = haps;
+    result->names.resize(2 * nline);
 
-    ped.open(pedname);
     // XXX -- this loads the entire line into memory. Possibly look into
     // streaming word by word
     ln = 0;
@@ -297,10 +357,8 @@ genome_t g_fromfile(std::string pedname, std::string mapname) {
         std::stringstream name;
         name << fid << "_" << iid;
 
-        auto smp1 = std::shared_ptr<snp_t>(new snp_t[nsnp]);
-        auto smpp1 = smp1.get();
-        auto smp2 = std::shared_ptr<snp_t>(new snp_t[nsnp]);
-        auto smpp2 = smp2.get();
+        int col1 = 2 * (ln - 1);
+        int col2 = col1 + 1;
         for (int i = 0 ; i < nsnp ; i += 1) {
             std::string a1, a2;
 
@@ -309,17 +367,19 @@ genome_t g_fromfile(std::string pedname, std::string mapname) {
             allele j;
 
             if ((j = select(a1, pedname, ln)) == -1) { return NULL; }
-            smpp1[i] = j;
+            haps->set(ids[i], col1, j);
             if ((j = select(a2, pedname, ln)) == -1) { return NULL; }
-            smpp2[i] = j;
+            haps->set(ids[i], col2, j);
         }
 
         std::stringstream n1, n2;
         n1 << name.str() << "_1";
         n2 << name.str() << "_2";
-        (result->samples).insert(std::make_pair(n1.str(), smp1));
+        result->names[col1] = n1.str();
+        result->names[col2] = n2.str();
+        (result->samples).insert(std::make_pair(n1.str(), col1));
         D_PRINTF("inserting sample name %s\n", n1.str().c_str());
-        (result->samples).insert(std::make_pair(n2.str(), smp2));
+        (result->samples).insert(std::make_pair(n2.str(), col2));
         D_PRINTF("inserting sample name %s\n", n2.str().c_str());
     }
 
@@ -3,7 +3,7 @@
 #define GENOME_C_H
 
 #include <vector>
-#include <map>
+#include <unordered_map>
 #include <memory>
 #include <string>
 #include <bitset>
@@ -29,8 +29,10 @@ struct snpmap {
     int nsnp;
     // maps index in mapfile to index in bp ordering
     std::shared_ptr<int> ids;
-    // maps snp id string to index in bp ordering
+    // maps index in bp ordering to snp id string
     std::shared_ptr<std::string> sids;
+    // maps snp id string to index in bp ordering
+    std::shared_ptr<std::unordered_map<std::string, int>> index;
     // ordered in bp order
     std::shared_ptr<std::vector<struct snpmeta>> data;
 
@@ -39,15 +41,22 @@ struct snpmap {
     }
 };
 
+struct hapmat;
+
 struct genome {
     int nsample;
     struct snpmap map;
-    // maps familyid_indid to sample
-    std::map<std::string, std::shared_ptr<snp_t>> samples;
-
-    typedef std::map<std::string, std::shared_ptr<snp_t>>::iterator iter;
-    iter begin() { return samples.begin(); }
-    iter end() { return samples.end(); }
+    // every haplotype, bit-packed (see hapmat.h), one column per haplotype
+    std::shared_ptr<struct hapmat> haps;
+    // names[i] is the id (familyid_indid_{1,2}) of the haplotype in column i
+    std::vector<std::string> names;
+    // maps a haplotype id to its column in haps
+    std::unordered_map<std::string, int> samples;
+
+    // Iterating over a genome gives haplotype ids in column (file) order
+    typedef std::vector<std::string>::iterator iter;
+    iter begin() { return names.begin(); }
+    iter end() { return names.end(); }
 };
 
 typedef std::shared_ptr<struct genome> genome_t;
@@ -59,7 +68,43 @@ struct genomeErr : public std::exception {
 };
 
 genome_t g_empty();
+
+// Reads a PLINK text fileset. Both files are memory-mapped and tokenized in
+// place, and alleles are packed straight into the genome's hapmat. The PED
+// file is parsed on nthread threads (default: one per hardware thread).
+// Returns NULL (after printing where) on a parse error.
 genome_t g_fromfile(std::string pedname, std::string mapname);
+genome_t g_fromfile(std::string pedname, std::string mapname, int nthread);
+
+// Reads a PLINK binary fileset (SNP-major .bed only). The .bed file is
+// memory-mapped and decoded into the genome's hapmat a word at a time.
+// Genotypes are unphased: heterozygotes get A1 (the .bim file's fifth column)
+// on haplotype _1 and A2 on _2, and missing genotypes are read as homozygous
+// A2. Returns NULL (after printing where) on an error.
+genome_t g_frombed(std::string bedname, std::string bimname,
+    std::string famname);
+
+// Reads a phased VCF file, plain or gzip/bgzip-compressed, through a buffer
+// of chunk bytes (default 1MB), packing the GT field of every record into the
+// genome's hapmat as it goes. Only biallelic SNPs on chromosomes 1-22, X and
+// Y are kept, and missing alleles are read as REF. Genetic distances come from
+// the PLINK map file mapname, interpolated linearly by bp between its SNPs.
+// Haplotypes are named <sample>_1 and <sample>_2. Returns NULL (after
+// printing where) on an error.
+genome_t g_fromvcf(std::string vcfname, std::string mapname);
+genome_t g_fromvcf(std::string vcfname, std::string mapname, size_t chunk);
+
+// Same as g_fromfile, through iostreams. Much slower; kept as the reference
+// the fast parser is checked and benchmarked against.
+genome_t g_fromfile_stream(std::string pedname, std::string mapname);
+
+// Reads a PLINK .map file into SNP metadata, in file order. Returns NULL
+// (after printing where) on a parse error.
+std::shared_ptr<std::vector<struct snpmeta>> g_readmap(std::string mapname);
+
+// Installs data (one entry per SNP, ind set to its mapfile index) as the SNP
+// map of g, sorting it into bp order and building the id lookups
+void g_setsnps(genome_t g, std::shared_ptr<std::vector<struct snpmeta>> data);
 
 // number of individuals
 int g_nsample(genome_t g);
@@ -67,10 +112,18 @@ int g_nsample(genome_t g);
 // number of SNPs
 int g_nsnp(genome_t g);
 
+// Index of SNP sid in bp order, or -1 if g has no such SNP
+int g_snpindex(genome_t g, std::string sid);
+
 // Removes all SNPs from genome g not present in filt
 void g_filterby(genome_t g, genome_t filt);
 
-// Filters out genomes not present among n given people in array ids
+// Removes the SNPs a and b don't have in common (by position and id) from
+// both, leaving them with the same SNPs in the same order
+void g_intersect(genome_t a, genome_t b);
+
+// Filters out genomes not present among n given people in array ids. The
+// remaining haplotypes are packed into new columns, keeping their order.
 void g_filterindiv(genome_t g, std::string* ids, int n);
 
 // Humans have 22 autosomes (present in everyone, two copies each) plus sex
@@ -78,7 +131,11 @@ void g_filterindiv(genome_t g, std::string* ids, int n);
 // everything not an autosome (chromosomes 1-22).
 void g_filterchrom(genome_t g, int chromosome);
 
-// Lookup SNP list by person
+// Column of haplotype pid in g->haps, or -1 if there's no such haplotype
+int g_hapindex(genome_t g, std::string pid);
+
+// Lookup SNP list by person. Unpacks a new[]'d copy of the haplotype; prefer
+// g_hapindex and reading g->haps directly.
 snp_t* g_plookup(genome_t g, std::string pid);
 
 // Lookup SNP by person and SNP identifier
@@ -0,0 +1,23 @@
+
+
+#include "hapmat.h"
+
+hapmat::hapmat(int nsnp_, int nhap_) {
+    nsnp = nsnp_;
+    nhap = nhap_;
+    nword = (nhap + 63) / 64;
+    bits.assign((size_t)2 * nsnp * nword, 0);
+}
+
+void hapmat::resize(int nsnp_) {
+    nsnp = nsnp_;
+    bits.resize((size_t)2 * nsnp * nword, 0);
+}
+
+void hapmat::column(int hap, snp_t* out) const {
+    for (int i = 0 ; i < nsnp ; i += 1) { out[i] = get(i, hap); }
+}
+
+void hapmat::copycol(int dst, const hapmat& m, int src) {
+    for (int i = 0 ; i < nsnp ; i += 1) { set(i, dst, m.get(i, src)); }
+}
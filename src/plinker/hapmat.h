@@ -0,0 +1,73 @@
+#ifndef HAPMAT_H
+#define HAPMAT_H
+
+#include <cstdint>
+#include <vector>
+
+#include "genome_c.h"
+
+/* Bit-packed haplotype matrix.
+ *
+ * Alleles are stored SNP-major as two bit planes per SNP, one for the low bit
+ * and one for the high bit of the allele (A=00, C=01, G=10, T=11). Bit j of a
+ * plane belongs to haplotype j, and every plane is padded out to nword 64-bit
+ * words. That's 2 bits per allele, against 32 for snp_t, so a 60,000 SNP by
+ * 250,000 haplotype panel takes under 4GB.
+ *
+ * The payoff for the HMM is mismatch(): comparing a target allele against 64
+ * reference haplotypes at once is two XORs and an OR.
+ */
+struct hapmat {
+    int nsnp;
+    int nhap;
+    int nword;
+    // planes for SNP i are at bits[2*i*nword] (low) and
+    // bits[(2*i+1)*nword] (high)
+    std::vector<uint64_t> bits;
+
+    hapmat(int nsnp_, int nhap_);
+
+    const uint64_t* lo(int snp) const {
+        return &bits[(size_t)2 * snp * nword];
+    }
+    const uint64_t* hi(int snp) const {
+        return &bits[(size_t)(2 * snp + 1) * nword];
+    }
+
+    allele get(int snp, int hap) const {
+        int w = hap >> 6;
+        int b = hap & 63;
+        return (allele)(((lo(snp)[w] >> b) & 1) |
+                        (((hi(snp)[w] >> b) & 1) << 1));
+    }
+
+    void set(int snp, int hap, allele a) {
+        int w = hap >> 6;
+        uint64_t m = 1ULL << (hap & 63);
+        uint64_t* l = &bits[(size_t)2 * snp * nword + w];
+        uint64_t* h = l + nword;
+        *l = (a & 1) ? (*l | m) : (*l & ~m);
+        *h = (a & 2) ? (*h | m) : (*h & ~m);
+    }
+
+    // Bit j is set iff haplotype 64*w + j differs from a at snp. Padding bits
+    // past nhap come back set, so they never count as matches.
+    uint64_t mismatch(int snp, int w, int a) const {
+        uint64_t m = (lo(snp)[w] ^ (0 - (uint64_t)(a & 1))) |
+                     (hi(snp)[w] ^ (0 - (uint64_t)((a >> 1) & 1)));
+        if (w == nword - 1 && (nhap & 63)) { m |= ~0ULL << (nhap & 63); }
+        return m;
+    }
+
+    // Changes the number of SNPs to nsnp_. The first nsnp_ SNPs keep their
+    // alleles; any new ones are all A.
+    void resize(int nsnp_);
+
+    // Unpacks haplotype hap into out, which must hold nsnp alleles
+    void column(int hap, snp_t* out) const;
+
+    // Copies haplotype src of m into haplotype dst of this matrix
+    void copycol(int dst, const hapmat& m, int src);
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef MFILE_H
+#define MFILE_H
+
+/* Helpers shared by the memory-mapped readers: a read-only file mapping and
+ * an in-place tokenizer for whitespace-separated text. Tokens are never
+ * copied or NUL-terminated; they're (pointer, length) pairs into the map.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "genome_c.h"
+
+// Read-only mapping of an entire file, unmapped again on destruction
+struct mfile {
+    const char* p;
+    size_t n;
+    bool ok;
+
+    mfile(const std::string& fname) {
+        p = NULL;
+        n = 0;
+        ok = false;
+
+        int fd = open(fname.c_str(), O_RDONLY);
+        if (fd < 0) { return; }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            n = st.st_size;
+            if (n == 0) {
+                ok = true;
+            }
+            else {
+                void* m = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (m != MAP_FAILED) {
+                    madvise(m, n, MADV_SEQUENTIAL);
+                    p = (const char*)m;
+                    ok = true;
+                }
+            }
+        }
+        close(fd);
+    }
+
+    ~mfile() {
+        if (p != NULL) { munmap((void*)p, n); }
+    }
+};
+
+static inline bool blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Finds the next token on the current line, starting at *p. On success the
+ * token is [*tok, *tok + *len) and *p points just past it; returns false if
+ * the line (or file) ends first.
+ */
+static inline bool token(const char** p, const char* end,
+    const char** tok, size_t* len) {
+    const char* q = *p;
+    while (q < end && blank(*q)) { q += 1; }
+    if (q == end || *q == '\n') {
+        *p = q;
+        return false;
+    }
+    const char* t = q;
+    while (q < end && !blank(*q) && *q != '\n') { q += 1; }
+    *tok = t;
+    *len = q - t;
+    *p = q;
+    return true;
+}
+
+// Moves *p to the start of the next line
+static inline void nextline(const char** p, const char* end) {
+    const char* nl = (const char*)memchr(*p, '\n', end - *p);
+    *p = nl == NULL ? end : nl + 1;
+}
+
+// True if the line starting at p has nothing but whitespace on it
+static inline bool emptyline(const char* p, const char* end) {
+    while (p < end && blank(*p)) { p += 1; }
+    return p == end || *p == '\n';
+}
+
+static inline bool parseint(const char* t, size_t len, long* out) {
+    size_t i = 0;
+    bool neg = false;
+    if (len > 0 && (t[0] == '-' || t[0] == '+')) {
+        neg = t[0] == '-';
+        i = 1;
+    }
+    if (i == len) { return false; }
+    long x = 0;
+    for ( ; i < len ; i += 1) {
+        if (t[i] < '0' || t[i] > '9') { return false; }
+        x = 10 * x + (t[i] - '0');
+    }
+    *out = neg ? -x : x;
+    return true;
+}
+
+static inline bool parsedouble(const char* t, size_t len, double* out) {
+    char buf[64];
+    if (len >= sizeof(buf)) { return false; }
+    memcpy(buf, t, len);
+    buf[len] = '\0';
+    char* e;
+    *out = strtod(buf, &e);
+    return e == buf + len;
+}
+
+// allele code for the first character of an allele token, or -1
+static inline int acode(char c) {
+    switch (c) {
+      case 'A': return A;
+      case 'C': return C;
+      case 'G': return G;
+      case 'T': return T;
+      default: return -1;
+    }
+}
+
+
+// Chromosome number for a chromosome token (1-22, X=23, Y=24)
+static inline bool parsechrom(const char* t, size_t len, int* out) {
+    long x;
+    if (len == 1 && t[0] == 'X') { x = 23; }
+    else if (len == 1 && t[0] == 'Y') { x = 24; }
+    else if (!parseint(t, len, &x) || x < 0 || x > 24) { return false; }
+    *out = x;
+    return true;
+}
+
+#endif
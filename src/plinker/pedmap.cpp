@@ -0,0 +1,307 @@
+/* Memory-mapped PLINK text (.ped/.map) reader.
+ *
+ * Both files are mapped read-only and tokenized in place. The only per-line
+ * allocations are the names of the haplotypes; alleles are decoded into a
+ * reusable block of up to 64 haplotypes at a time and then written to the
+ * packed matrix one whole word per SNP and bit plane.
+ *
+ * Every PED line is an independent individual, so the PED file is split into
+ * shards of whole lines that are counted and then parsed on their own
+ * threads. Counting first tells every shard which columns its individuals
+ * get, which keeps the columns (and so the ordering of samples) in file
+ * order no matter how the shards are scheduled.
+ */
+
+#include "genome_c.h"
+#include "hapmat.h"
+#include "mfile.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if DEBUG
+#include <cstdio>
+#define D_PRINTF(args...) fprintf(stderr, args)
+#else
+#define D_PRINTF(args...)
+#endif
+
+#define IFCHK(cond,onfail) if (!(cond)) { onfail; }
+#define ERROR(fname,ln,msg) std::cerr << (fname) << "." << (ln) << ":" << msg
+
+std::shared_ptr<std::vector<struct snpmeta>> g_readmap(std::string mapname) {
+    mfile f(mapname);
+    if (!f.ok) {
+        ERROR(mapname, 0, "could not open file\n");
+        return NULL;
+    }
+
+    auto data =
+        std::shared_ptr<std::vector<struct snpmeta>>
+        (new std::vector<struct snpmeta>);
+
+    const char* p = f.p;
+    const char* end = f.p + f.n;
+    int ln = 0;
+    int ind = 0;
+    while (p < end) {
+        ln += 1;
+        if (emptyline(p, end)) {
+            nextline(&p, end);
+            continue;
+        }
+
+        struct snpmeta s;
+        const char* t;
+        size_t len;
+        long x;
+
+        IFCHK(token(&p, end, &t, &len),
+                ERROR(mapname, ln, "parse error\n");
+                return NULL);
+        IFCHK(parsechrom(t, len, &s.chnum),
+                ERROR(mapname, ln, "chromosome number must be 1-22,X,Y\n");
+                return NULL);
+
+        IFCHK(token(&p, end, &t, &len),
+                ERROR(mapname, ln, "parse error\n");
+                return NULL);
+        s.id.assign(t, len);
+
+        IFCHK(token(&p, end, &t, &len) && parsedouble(t, len, &s.gdist),
+                ERROR(mapname, ln, "parse error\n");
+                return NULL);
+
+        IFCHK(token(&p, end, &t, &len) && parseint(t, len, &x),
+                ERROR(mapname, ln, "parse error\n");
+                return NULL);
+        s.pos = x;
+        s.ind = ind;
+
+        (*data).push_back(s);
+        ind += 1;
+        nextline(&p, end);
+    }
+
+    return data;
+}
+
+/* Writes the first n haplotypes of blk (laid out haplotype-major, nsnp
+ * alleles each, already in bp order) to columns [col, col + n) of haps. The
+ * block never crosses a word boundary, so every SNP gets one word per plane;
+ * the bits are OR'd in atomically because the shard on the other side of a
+ * word may be writing its end of the same word.
+ */
+static void flushblock(hapmat* haps, const uint8_t* blk, int n, int col) {
+    int w = col >> 6;
+    int sh = col & 63;
+    for (int i = 0 ; i < haps->nsnp ; i += 1) {
+        uint64_t lo = 0;
+        uint64_t hi = 0;
+        for (int c = 0 ; c < n ; c += 1) {
+            uint64_t a = blk[(size_t)c * haps->nsnp + i];
+            lo |= (a & 1) << (sh + c);
+            hi |= ((a >> 1) & 1) << (sh + c);
+        }
+        __atomic_fetch_or(&haps->bits[(size_t)2 * i * haps->nword + w], lo,
+                __ATOMIC_RELAXED);
+        __atomic_fetch_or(&haps->bits[(size_t)(2 * i + 1) * haps->nword + w],
+                hi, __ATOMIC_RELAXED);
+    }
+}
+
+// A run of whole lines of a PED file, parsed by one thread
+struct pedshard {
+    const char* p;
+    const char* end;
+    int line0; // number of lines in the file before this shard
+    int nline; // lines in this shard
+    int ind0;  // number of individuals in the file before this shard
+    int nind;  // individuals (nonempty lines) in this shard
+
+    // first error in this shard, if any; errln is 0 if there wasn't one
+    int errln;
+    std::string err;
+    bool badallele;
+};
+
+// Counts the lines and individuals of a shard
+static void countshard(pedshard* sh) {
+    sh->nline = 0;
+    sh->nind = 0;
+    for (const char* q = sh->p ; q < sh->end ; nextline(&q, sh->end)) {
+        sh->nline += 1;
+        if (!emptyline(q, sh->end)) { sh->nind += 1; }
+    }
+}
+
+/* Parses the individuals of a shard into their columns of haps (two per
+ * individual, starting at 2 * ind0) and their haplotype ids into the same
+ * slots of names. ids maps mapfile order to bp order.
+ */
+static void parseshard(pedshard* sh, hapmat* haps,
+    std::vector<std::string>* names, int* ids) {
+    int nsnp = haps->nsnp;
+    const char* p = sh->p;
+    const char* end = sh->end;
+
+    // Up to 32 lines' worth of haplotypes, decoded in bp order. A block ends
+    // at the next word boundary of the packed matrix.
+    std::vector<uint8_t> blk((size_t)64 * nsnp);
+    int col = 2 * sh->ind0;
+    int nblk = 0;
+    int cap = 64 - (col & 63);
+
+    int ln = sh->line0;
+    while (p < end) {
+        ln += 1;
+        if (emptyline(p, end)) {
+            nextline(&p, end);
+            continue;
+        }
+
+        const char* t;
+        size_t len;
+        long x;
+
+        IFCHK(token(&p, end, &t, &len),
+                sh->errln = ln; sh->err = "parse error\n";
+                return);
+        std::string name(t, len);
+        IFCHK(token(&p, end, &t, &len),
+                sh->errln = ln; sh->err = "parse error\n";
+                return);
+        name.append("_");
+        name.append(t, len);
+
+        // paternal id, maternal id, sex, phenotype
+        for (int k = 0 ; k < 4 ; k += 1) {
+            IFCHK(token(&p, end, &t, &len) && parseint(t, len, &x),
+                    sh->errln = ln; sh->err = "parse error\n";
+                    return);
+        }
+
+        uint8_t* h1 = &blk[(size_t)nblk * nsnp];
+        uint8_t* h2 = h1 + nsnp;
+        for (int i = 0 ; i < 2 * nsnp ; i += 1) {
+            IFCHK(token(&p, end, &t, &len),
+                    sh->errln = ln; sh->err = "parse error\n";
+                    return);
+            int a = acode(t[0]);
+            if (a < 0) {
+                sh->errln = ln;
+                sh->err = "invalid chromosome: " + std::string(t, len) + "\n";
+                sh->badallele = true;
+                return;
+            }
+            ((i & 1) ? h2 : h1)[ids[i >> 1]] = a;
+        }
+
+        (*names)[col + nblk] = name + "_1";
+        (*names)[col + nblk + 1] = name + "_2";
+
+        nblk += 2;
+        if (nblk == cap) {
+            flushblock(haps, blk.data(), nblk, col);
+            col += nblk;
+            nblk = 0;
+            cap = 64;
+        }
+        nextline(&p, end);
+    }
+    if (nblk > 0) { flushblock(haps, blk.data(), nblk, col); }
+}
+
+// Runs fn(k) for k in [0, n), each on its own thread
+static void forshards(int n, std::function<void(int)> fn) {
+    std::vector<std::thread> ts;
+    for (int k = 1 ; k < n ; k += 1) { ts.push_back(std::thread(fn, k)); }
+    fn(0);
+    for (auto& t : ts) { t.join(); }
+}
+
+genome_t g_fromfile(std::string pedname, std::string mapname) {
+    int n = std::thread::hardware_concurrency();
+    return g_fromfile(pedname, mapname, n > 0 ? n : 1);
+}
+
+genome_t g_fromfile(std::string pedname, std::string mapname, int nthread) {
+    auto result = std::shared_ptr<struct genome>(new struct genome);
+    result->nsample = 0;
+
+    auto data = g_readmap(mapname);
+    if (data == NULL) { return NULL; }
+    g_setsnps(result, data);
+
+    int nsnp = (result->map).nsnp;
+    int* ids = (result->map).id_arr();
+
+    mfile f(pedname);
+    if (!f.ok) {
+        ERROR(pedname, 0, "could not open file\n");
+        return NULL;
+    }
+    const char* begin = f.p;
+    const char* end = f.p + f.n;
+
+    // Shard at the first line break after every 1/nthread of the file. Tiny
+    // files get fewer shards; a thread per handful of bytes isn't worth it.
+    size_t minshard = 1 << 16;
+    int nshard = nthread < 1 ? 1 : nthread;
+    if (f.n / minshard + 1 < (size_t)nshard) { nshard = f.n / minshard + 1; }
+
+    std::vector<pedshard> shards(nshard);
+    for (int k = 0 ; k < nshard ; k += 1) {
+        const char* q = begin + (f.n * k) / nshard;
+        if (k > 0 && q[-1] != '\n') { nextline(&q, end); }
+        shards[k].p = q;
+        shards[k].errln = 0;
+        shards[k].badallele = false;
+    }
+    for (int k = 0 ; k < nshard ; k += 1) {
+        shards[k].end = k + 1 < nshard ? shards[k + 1].p : end;
+        if (shards[k].end < shards[k].p) { shards[k].end = shards[k].p; }
+    }
+
+    // Count first, so every shard knows where its individuals go
+    forshards(nshard, [&](int k) { countshard(&shards[k]); });
+
+    int nline = 0;
+    int nind = 0;
+    for (auto& sh : shards) {
+        sh.line0 = nline;
+        sh.ind0 = nind;
+        nline += sh.nline;
+        nind += sh.nind;
+    }
+
+    auto haps = std::make_shared<struct hapmat>(nsnp, 2 * nind);
+    result->haps = haps;
+    result->names.resize(2 * nind);
+
+    forshards(nshard, [&](int k) {
+        parseshard(&shards[k], haps.get(), &(result->names), ids);
+    });
+
+    for (auto& sh : shards) {
+        if (sh.errln != 0) {
+            ERROR(pedname, sh.errln, sh.err);
+            if (sh.badallele) { throw genomeErr("Unknown allele string."); }
+            return NULL;
+        }
+    }
+
+    for (int i = 0 ; i < 2 * nind ; i += 1) {
+        (result->samples).insert(std::make_pair(result->names[i], i));
+        D_PRINTF("inserting sample name %s\n", result->names[i].c_str());
+    }
+
+    result->nsample = 2 * nind;
+    return result;
+}
@@ -0,0 +1,357 @@
+/* Streaming VCF reader.
+ *
+ * The file is read through zlib, which passes plain text through untouched
+ * and reads gzip and bgzip (a series of gzip members) alike, into a fixed-size
+ * buffer of lines. Every record's genotypes are packed into a new SNP of the
+ * hapmat as soon as it's read, so apart from the matrix itself memory is
+ * bounded by the buffer (or the longest line, if that's longer).
+ */
+
+#include "genome_c.h"
+#include "hapmat.h"
+#include "mfile.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if DEBUG
+#include <cstdio>
+#define D_PRINTF(args...) fprintf(stderr, args)
+#else
+#define D_PRINTF(args...)
+#endif
+
+#define IFCHK(cond,onfail) if (!(cond)) { onfail; }
+#define ERROR(fname,ln,msg) std::cerr << (fname) << "." << (ln) << ":" << msg
+
+// Lines of a (possibly compressed) text file, read a chunk at a time
+struct linereader {
+    gzFile f;
+    std::vector<char> buf;
+    size_t lo; // unread bytes are buf[lo, hi)
+    size_t hi;
+    bool eof;
+    bool ok;
+
+    linereader(const std::string& fname, size_t chunk) {
+        f = gzopen(fname.c_str(), "rb");
+        buf.resize(chunk < 64 ? 64 : chunk);
+        lo = 0;
+        hi = 0;
+        eof = false;
+        ok = f != NULL;
+        if (ok) { gzbuffer(f, 1 << 17); }
+    }
+
+    ~linereader() {
+        if (f != NULL) { gzclose(f); }
+    }
+
+    /* Sets [*p, *end) to the next line, without its newline. The line stays
+     * valid until the next call. Returns false at the end of the file or on
+     * a read error (which clears ok).
+     */
+    bool next(const char** p, const char** end) {
+        size_t scan = lo;
+        while (true) {
+            char* nl = (char*)memchr(buf.data() + scan, '\n', hi - scan);
+            if (nl != NULL) {
+                *p = buf.data() + lo;
+                *end = nl;
+                lo = nl - buf.data() + 1;
+                return true;
+            }
+            if (eof) {
+                if (lo == hi) { return false; }
+                *p = buf.data() + lo;
+                *end = buf.data() + hi;
+                lo = hi;
+                return true;
+            }
+
+            // Move the partial line to the front, making room if a single
+            // line is longer than the buffer
+            memmove(buf.data(), buf.data() + lo, hi - lo);
+            hi -= lo;
+            lo = 0;
+            scan = hi;
+            if (hi == buf.size()) { buf.resize(2 * buf.size()); }
+
+            int n = gzread(f, buf.data() + hi, buf.size() - hi);
+            if (n < 0) {
+                ok = false;
+                return false;
+            }
+            if (n == 0) { eof = true; }
+            hi += n;
+        }
+    }
+};
+
+// Start of the k'th ':'-separated field of [t, end), or NULL
+static const char* nthfield(const char* t, const char* end, int k) {
+    for ( ; k > 0 && t != NULL ; k -= 1) {
+        t = (const char*)memchr(t, ':', end - t);
+        if (t != NULL) { t += 1; }
+    }
+    return t;
+}
+
+// Index of the ':'-separated field of [t, end) equal to name, or -1
+static int subfield(const char* t, const char* end, const char* name) {
+    size_t n = strlen(name);
+    for (int k = 0 ; t != NULL ; k += 1) {
+        const char* e = (const char*)memchr(t, ':', end - t);
+        if (e == NULL) { e = end; }
+        if ((size_t)(e - t) == n && memcmp(t, name, n) == 0) { return k; }
+        t = e == end ? NULL : e + 1;
+    }
+    return -1;
+}
+
+// Per-chromosome (bp, genetic distance) pairs of a genetic map, sorted by bp
+typedef std::map<int, std::vector<std::pair<int, double>>> genmap;
+
+static genmap makegenmap(const std::vector<struct snpmeta>& data) {
+    genmap m;
+    for (auto& s : data) {
+        m[s.chnum].push_back(std::make_pair(s.pos, s.gdist));
+    }
+    for (auto& kv : m) { std::sort(kv.second.begin(), kv.second.end()); }
+    return m;
+}
+
+// Genetic distance at bp pos, interpolated between the nearest SNPs of the
+// map on either side and flat past the ends
+static double interpolate(const std::vector<std::pair<int, double>>& v,
+    int pos) {
+    auto r = std::lower_bound(v.begin(), v.end(), std::make_pair(pos, -1e300));
+    if (r == v.end()) { return v.back().second; }
+    if (r->first == pos || r == v.begin()) { return r->second; }
+    auto l = r - 1;
+    double f = (double)(pos - l->first) / (r->first - l->first);
+    return l->second + f * (r->second - l->second);
+}
+
+genome_t g_fromvcf(std::string vcfname, std::string mapname) {
+    return g_fromvcf(vcfname, mapname, (size_t)1 << 20);
+}
+
+genome_t g_fromvcf(std::string vcfname, std::string mapname, size_t chunk) {
+    auto result = std::shared_ptr<struct genome>(new struct genome);
+    result->nsample = 0;
+
+    auto mapdata = g_readmap(mapname);
+    if (mapdata == NULL) { return NULL; }
+    genmap gm = makegenmap(*mapdata);
+
+    linereader in(vcfname, chunk);
+    if (!in.ok) {
+        ERROR(vcfname, 0, "could not open file\n");
+        return NULL;
+    }
+
+    auto data =
+        std::shared_ptr<std::vector<struct snpmeta>>
+        (new std::vector<struct snpmeta>);
+    std::shared_ptr<struct hapmat> haps;
+    std::vector<uint64_t> isalt;
+    int nind = -1;
+    long nskipped = 0;
+    long nmissing = 0;
+
+    const char* p;
+    const char* end;
+    int ln = 0;
+    while (in.next(&p, &end)) {
+        ln += 1;
+        if (end > p && end[-1] == '\r') { end -= 1; }
+        if (emptyline(p, end)) { continue; }
+        if (end - p >= 2 && p[0] == '#' && p[1] == '#') { continue; }
+
+        const char* t;
+        size_t len;
+        long x;
+
+        // Header line: sample names are everything after FORMAT
+        if (p[0] == '#') {
+            for (int k = 0 ; k < 9 ; k += 1) {
+                IFCHK(token(&p, end, &t, &len),
+                        ERROR(vcfname, ln, "no samples in header\n");
+                        return NULL);
+            }
+            while (token(&p, end, &t, &len)) {
+                std::string name(t, len);
+                result->names.push_back(name + "_1");
+                result->names.push_back(name + "_2");
+            }
+            nind = result->names.size() / 2;
+            haps = std::make_shared<struct hapmat>(0, 2 * nind);
+            isalt.resize(haps->nword);
+            continue;
+        }
+        IFCHK(nind >= 0,
+                ERROR(vcfname, ln, "record before #CHROM header\n");
+                return NULL);
+
+        struct snpmeta s;
+        const char* ch;
+        size_t chlen;
+        IFCHK(token(&p, end, &ch, &chlen),
+                ERROR(vcfname, ln, "parse error\n");
+                return NULL);
+        if (chlen > 3 && memcmp(ch, "chr", 3) == 0) {
+            ch += 3;
+            chlen -= 3;
+        }
+
+        IFCHK(token(&p, end, &t, &len) && parseint(t, len, &x),
+                ERROR(vcfname, ln, "parse error\n");
+                return NULL);
+        s.pos = x;
+
+        IFCHK(token(&p, end, &t, &len),
+                ERROR(vcfname, ln, "parse error\n");
+                return NULL);
+        s.id.assign(t, len);
+
+        const char* ref;
+        const char* alt;
+        size_t reflen;
+        size_t altlen;
+        IFCHK(token(&p, end, &ref, &reflen) && token(&p, end, &alt, &altlen),
+                ERROR(vcfname, ln, "parse error\n");
+                return NULL);
+
+        // Only biallelic SNPs fit in the model
+        int r = reflen == 1 ? acode(ref[0]) : -1;
+        int a = altlen == 1 ? acode(alt[0]) : -1;
+        if (r < 0 || a < 0 || !parsechrom(ch, chlen, &s.chnum)) {
+            nskipped += 1;
+            continue;
+        }
+        if (s.id == ".") {
+            s.id = std::string(ch, chlen) + ":" + std::to_string(s.pos);
+        }
+
+        // QUAL, FILTER, INFO, then find GT in FORMAT
+        for (int k = 0 ; k < 3 ; k += 1) {
+            IFCHK(token(&p, end, &t, &len),
+                    ERROR(vcfname, ln, "parse error\n");
+                    return NULL);
+        }
+        IFCHK(token(&p, end, &t, &len),
+                ERROR(vcfname, ln, "parse error\n");
+                return NULL);
+        int gt = subfield(t, t + len, "GT");
+        IFCHK(gt >= 0,
+                ERROR(vcfname, ln, "no GT field\n");
+                return NULL);
+
+        std::fill(isalt.begin(), isalt.end(), 0);
+        for (int j = 0 ; j < nind ; j += 1) {
+            IFCHK(token(&p, end, &t, &len),
+                    ERROR(vcfname, ln, "too few samples\n");
+                    return NULL);
+            const char* te = t + len;
+            t = nthfield(t, te, gt);
+            IFCHK(t != NULL && t < te,
+                    ERROR(vcfname, ln, "parse error\n");
+                    return NULL);
+
+            // One allele (haploid calls count for both haplotypes) or two
+            char c1 = t[0];
+            char c2 = c1;
+            if (te - t >= 3 && (t[1] == '|' || t[1] == '/')) { c2 = t[2]; }
+            char cs[2] = { c1, c2 };
+            for (int h = 0 ; h < 2 ; h += 1) {
+                int col = 2 * j + h;
+                if (cs[h] == '1') {
+                    isalt[col >> 6] |= 1ULL << (col & 63);
+                }
+                else if (cs[h] == '.') { nmissing += 1; }
+                else if (cs[h] != '0') {
+                    ERROR(vcfname, ln, "invalid allele in GT\n");
+                    throw genomeErr("Unknown allele string.");
+                }
+            }
+        }
+
+        auto g = gm.find(s.chnum);
+        IFCHK(g != gm.end(),
+                ERROR(vcfname, ln, "no genetic map for chromosome "
+                    << s.chnum << "\n");
+                return NULL);
+        s.gdist = interpolate(g->second, s.pos);
+        s.ind = data->size();
+        data->push_back(s);
+
+        // Same select as the .bed reader: every column is REF but the alts
+        int i = haps->nsnp;
+        haps->resize(i + 1);
+        uint64_t rlo = 0 - (uint64_t)(r & 1);
+        uint64_t rhi = 0 - (uint64_t)((r >> 1) & 1);
+        uint64_t dlo = 0 - (uint64_t)((r ^ a) & 1);
+        uint64_t dhi = 0 - (uint64_t)(((r ^ a) >> 1) & 1);
+        uint64_t* lo = haps->bits.data() + (size_t)2 * i * haps->nword;
+        uint64_t* hi = lo + haps->nword;
+        for (int w = 0 ; w < haps->nword ; w += 1) {
+            uint64_t valid = ~0ULL;
+            if (w == haps->nword - 1 && (haps->nhap & 63)) {
+                valid = (1ULL << (haps->nhap & 63)) - 1;
+            }
+            lo[w] = (rlo & valid) ^ (isalt[w] & dlo);
+            hi[w] = (rhi & valid) ^ (isalt[w] & dhi);
+        }
+    }
+    if (!in.ok) {
+        ERROR(vcfname, ln, "read error\n");
+        return NULL;
+    }
+    IFCHK(nind >= 0,
+            ERROR(vcfname, ln, "no #CHROM header\n");
+            return NULL);
+    if (nskipped > 0) {
+        ERROR(vcfname, 0, "skipped " << nskipped << " records that aren't "
+                << "biallelic SNPs on 1-22,X,Y\n");
+    }
+    if (nmissing > 0) {
+        ERROR(vcfname, 0, nmissing << " missing alleles read as REF\n");
+    }
+
+    g_setsnps(result, data);
+
+    // Rows went in in file order; put them in bp order if that's different
+    int nsnp = (result->map).nsnp;
+    int* ids = (result->map).id_arr();
+    bool sorted = true;
+    for (int i = 0 ; i < nsnp ; i += 1) { sorted = sorted && ids[i] == i; }
+    if (!sorted) {
+        auto bp = std::make_shared<struct hapmat>(nsnp, haps->nhap);
+        size_t n = 2 * (size_t)haps->nword;
+        const uint64_t* src = haps->bits.data();
+        for (int i = 0 ; i < nsnp ; i += 1) {
+            uint64_t* dst = bp->bits.data() + n * ids[i];
+            std::copy(src + n * i, src + n * (i + 1), dst);
+        }
+        haps = bp;
+    }
+    result->haps = haps;
+
+    for (int i = 0 ; i < (int)result->names.size() ; i += 1) {
+        (result->samples).insert(std::make_pair(result->names[i], i));
+        D_PRINTF("inserting sample name %s\n", result->names[i].c_str());
+    }
+
+    result->nsample = result->names.size();
+    return result;
+}
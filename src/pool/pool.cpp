@@ -0,0 +1,126 @@
+
+
+#include "pool.h"
+
+barrier::barrier(int n_) {
+    n = n_;
+    count = 0;
+    gen = 0;
+}
+
+void barrier::wait() {
+    std::unique_lock<std::mutex> lk(m);
+    int mygen = gen;
+    count += 1;
+    if (count == n) {
+        count = 0;
+        gen += 1;
+        cv.notify_all();
+        return;
+    }
+    cv.wait(lk, [&]{ return gen != mygen; });
+}
+
+workpool::workpool(int nthread_) {
+    nthread = nthread_ < 1 ? 1 : nthread_;
+    gen = 0;
+    running = 0;
+    stop = false;
+
+    queues.resize(nthread);
+    for (int i = 0 ; i < nthread ; i += 1) {
+        qlocks.push_back(std::unique_ptr<std::mutex>(new std::mutex));
+    }
+
+    for (int i = 1 ; i < nthread ; i += 1) {
+        workers.push_back(std::thread(&workpool::work, this, i));
+    }
+}
+
+workpool::~workpool() {
+    {
+        std::lock_guard<std::mutex> lk(m);
+        stop = true;
+    }
+    start.notify_all();
+    for (auto& w : workers) { w.join(); }
+}
+
+void workpool::work(int tid) {
+    int seen = 0;
+    while (true) {
+        std::function<void(int)> fn;
+        {
+            std::unique_lock<std::mutex> lk(m);
+            start.wait(lk, [&]{ return stop || gen != seen; });
+            if (stop) { return; }
+            seen = gen;
+            fn = job;
+        }
+
+        fn(tid);
+
+        std::lock_guard<std::mutex> lk(m);
+        running -= 1;
+        if (running == 0) { done.notify_all(); }
+    }
+}
+
+void workpool::team(std::function<void(int)> fn) {
+    {
+        std::lock_guard<std::mutex> lk(m);
+        job = fn;
+        running = nthread;
+        gen += 1;
+    }
+    start.notify_all();
+
+    fn(0);
+
+    std::unique_lock<std::mutex> lk(m);
+    running -= 1;
+    done.wait(lk, [&]{ return running == 0; });
+}
+
+// Pops the next index for worker tid, stealing from the back of the other
+// queues once its own is empty. Returns false when there's nothing left.
+bool workpool::take(int tid, int* i) {
+    {
+        std::lock_guard<std::mutex> lk(*qlocks[tid]);
+        if (!queues[tid].empty()) {
+            *i = queues[tid].front();
+            queues[tid].pop_front();
+            return true;
+        }
+    }
+
+    for (int k = 1 ; k < nthread ; k += 1) {
+        int v = (tid + k) % nthread;
+        std::lock_guard<std::mutex> lk(*qlocks[v]);
+        if (!queues[v].empty()) {
+            *i = queues[v].back();
+            queues[v].pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void workpool::run(int n, std::function<void(int, int)> fn) {
+    for (int t = 0 ; t < nthread ; t += 1) {
+        int lo = (int)(((long long)n * t) / nthread);
+        int hi = (int)(((long long)n * (t + 1)) / nthread);
+        std::lock_guard<std::mutex> lk(*qlocks[t]);
+        for (int i = lo ; i < hi ; i += 1) { queues[t].push_back(i); }
+    }
+
+    team([&](int tid) {
+        int i;
+        while (take(tid, &i)) { fn(tid, i); }
+    });
+}
+
+int pool_default_threads() {
+    int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
@@ -0,0 +1,73 @@
+/* Persistent pool of worker threads for the CPU engines.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Reusable barrier for a fixed team of n threads. Every call to wait() blocks
+ * until all n threads of the team have reached it.
+ */
+class barrier {
+public:
+    barrier(int n_);
+    void wait();
+
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    int n;
+    int count;
+    int gen;
+};
+
+class workpool {
+    // XXX: like lsimputer, this is a glorified struct for the most part; the
+    // synchronization state is the only thing worth hiding.
+public:
+    int nthread;
+
+    // Spawns nthread - 1 workers; the calling thread acts as worker 0.
+    workpool(int nthread_);
+
+    ~workpool();
+
+    // Runs fn(tid) once for every tid in [0, nthread) and returns once all of
+    // them have finished. All invocations run concurrently, so fn may
+    // synchronize the team with a barrier of size nthread.
+    void team(std::function<void(int)> fn);
+
+    // Runs fn(tid, i) for every i in [0, n), in no particular order. Indices
+    // are dealt out to the workers in contiguous blocks; a worker that runs
+    // out of its own takes from the far end of another worker's queue.
+    void run(int n, std::function<void(int, int)> fn);
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::condition_variable start;
+    std::condition_variable done;
+    std::function<void(int)> job;
+    int gen;
+    int running;
+    bool stop;
+
+    // One queue of pending indices per worker, for run()
+    std::vector<std::deque<int>> queues;
+    std::vector<std::unique_ptr<std::mutex>> qlocks;
+
+    void work(int tid);
+    bool take(int tid, int* i);
+};
+
+// Number of hardware threads, or 1 if that can't be determined
+int pool_default_threads();
+
+#endif
@@ -1,9 +1,25 @@
 
 #include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "../src/plinker/genome_c.h"
+#include "../src/plinker/hapmat.h"
 #include "../src/hmm/ls.h"
+#include "../src/pool/pool.h"
+#include "../src/batch/batch.h"
+#include "../src/hmm/panel.h"
+#include "../src/hmm/sparse.h"
+#include "../src/hmm/knn.h"
+#include "../src/hmm/dedup.h"
+#include "../src/impute/impute.h"
+#include "../src/pbwt/pbwt.h"
 #include "../src/lsimpute.h"
 #include "infrastructure.h"
 #include "lassert.h"
@@ -24,6 +40,97 @@ float rowSum(float* A, int n) {
   return x;
 }
 
+/* Builds a genome of nhap haplotypes over nsnp SNPs. Every haplotype is a
+ * mosaic of the same 8 random founders (switching founders with probability
+ * 1/50 per SNP, with 1% of alleles mutated), so a haplotype from one such
+ * genome has a sharp posterior against another. seed picks the mosaics.
+ */
+genome_t randomGenome(int nhap, int nsnp, unsigned seed) {
+  const int nfounder = 8;
+  std::vector<uint8_t> founders(nfounder * nsnp);
+  srand(418);
+  for (size_t k = 0; k < founders.size(); k++) founders[k] = rand() % 4;
+
+  genome_t G = g_empty();
+  auto data = std::make_shared<std::vector<struct snpmeta>>();
+  srand(seed);
+  double d = 0.0;
+  for (int i = 0; i < nsnp; i++) {
+    struct snpmeta m;
+    m.ind = i;
+    m.id = "rs" + std::to_string(i);
+    m.chnum = 1;
+    m.gdist = d;
+    m.pos = 100 * (i + 1);
+    data->push_back(m);
+    d += 0.02 * rand() / RAND_MAX;
+  }
+  g_setsnps(G, data);
+
+  G->haps = std::make_shared<hapmat>(nsnp, nhap);
+  for (int j = 0; j < nhap; j++) {
+    int f = rand() % nfounder;
+    for (int i = 0; i < nsnp; i++) {
+      if (rand() % 50 == 0) f = rand() % nfounder;
+      int a = founders[f * nsnp + i];
+      if (rand() % 100 == 0) a = (a + 1) % 4;
+      G->haps->set(i, j, (allele)a);
+    }
+    G->names.push_back("h" + std::to_string(j));
+    G->samples[G->names.back()] = j;
+  }
+  G->nsample = nhap;
+  return G;
+}
+
+/* The random panel most HMM tests run on: 203 references (not a whole
+ * number of vectors or words) over 300 SNPs, nsam targets drawn from the same
+ * founders, and the panel prepared from them.
+ */
+struct bigpanel {
+  genome_t big;
+  genome_t sam;
+  lspanel P;
+
+  bigpanel(int nsam = 2)
+      : big(randomGenome(203, 300, 1)), sam(randomGenome(nsam, 300, 2)),
+        P(big, 0.01f, 5.0f) {}
+
+  // Alleles of target haplotype h, for P; delete[] them when done
+  uint8_t* target(int h) { return P.sample(sam, "h" + std::to_string(h)); }
+};
+
+/* The tiny test fileset (nothing but a vector's tail) and bigpanel, side by
+ * side, with sample id as the small panel's target and haplotype h as the
+ * large one's, for tests that run both.
+ */
+struct testpanels {
+  genome_t ref;
+  genome_t sam;
+  lspanel small;
+  bigpanel large;
+  lspanel* panels[2];
+  genome_t refs[2];
+  uint8_t* targets[2];
+
+  testpanels(const char* id, int h)
+      : ref(g_fromfile(std::string(PED_TEST_02), std::string(MAP_TEST_02))),
+        sam(g_fromfile(std::string(PED_TEST_03), std::string(MAP_TEST_03))),
+        small(ref, 0.1f, 1.0f) {
+    panels[0] = &small;
+    panels[1] = &large.P;
+    refs[0] = ref;
+    refs[1] = large.big;
+    targets[0] = small.sample(sam, std::string(id));
+    targets[1] = large.target(h);
+  }
+
+  ~testpanels() {
+    delete[] targets[0];
+    delete[] targets[1];
+  }
+};
+
 void printLogMat(float* A, int nrow, int ncol) {
   for (int i = 0; i < nrow; i++) {
     for (int j = 0; j < ncol; j++) {
@@ -165,6 +272,913 @@ void runGPUHMMBasicTest() {
       "GPU HMM result at (3,3) incorrect!");
 }
 
+void runParHMMBasicTest() {
+  genome_t ref = g_fromfile(std::string(PED_TEST_02), std::string(MAP_TEST_02));
+  genome_t sam = g_fromfile(std::string(PED_TEST_03), std::string(MAP_TEST_03));
+
+  int nsample = g_nsample(ref);
+  int nsnp = g_nsnp(ref);
+
+  float* Q = ls(sam, std::string("03_03_1"), ref, 0.1f, 1.0f);
+
+  // More threads than references exercises the idle-thread path as well
+  for (int nthread = 1; nthread <= 6; nthread++) {
+    workpool pool(nthread);
+    float* P = ls_par(sam, std::string("03_03_1"), ref, 0.1f, 1.0f, &pool);
+
+    for (int i = 0; i < nsnp; i++) {
+      float x = rowSum(&(P[i * nsample]),nsample);
+      if (!FEQ(x,1.0f)) {
+        fprintf(stderr, "Row %d of results sums to %f\n",i, x);
+        ASSERT(false, "Row does not sum to 1!");
+      }
+    }
+
+    for (int i = 0; i < nsnp * nsample; i++) {
+      ASSERT(FEQ(exp(P[i]),exp(Q[i])),
+          "Parallel HMM result differs from sequential!");
+    }
+    free(P);
+  }
+
+  free(Q);
+}
+
+void runBatchHMMTest() {
+  genome_t ref = g_fromfile(std::string(PED_TEST_02), std::string(MAP_TEST_02));
+  genome_t sam = g_fromfile(std::string(PED_TEST_03), std::string(MAP_TEST_03));
+
+  int nsample = g_nsample(ref);
+  int nsnp = g_nsnp(ref);
+
+  float* Q1 = ls(sam, std::string("03_03_1"), ref, 0.1f, 1.0f);
+  float* Q2 = ls(sam, std::string("03_03_2"), ref, 0.1f, 1.0f);
+
+  // Enough haplotypes for a block on every worker, the last one short
+  std::vector<std::string> ids;
+  for (int i = 0; i < 25; i++) {
+    ids.push_back(std::string(i % 3 ? "03_03_1" : "03_03_2"));
+  }
+
+  workpool pool(4);
+  lspanel panel(ref, 0.1f, 1.0f);
+  // The sink runs on pool threads, where a failed ASSERT can't unwind to
+  // the test, so it only counts what's wrong
+  int seen = 0;
+  for (int linear = 0; linear < 2; linear++) {
+    seen = 0;
+    int unordered = 0;
+    int misnamed = 0;
+    int wrong = 0;
+    ls_batch(sam, ids, &panel, &pool, linear,
+        [&](int i, const std::string& id, float* P) {
+          unordered += i != seen;
+          misnamed += id != ids[i];
+          float* Q = (i % 3) ? Q1 : Q2;
+          for (int k = 0; k < nsnp * nsample; k++) {
+            float x = linear ? P[k] : exp(P[k]);
+            wrong += !FEQ(x, exp(Q[k]));
+          }
+          free(P);
+          seen++;
+        });
+    ASSERT(unordered == 0, "Batch results delivered out of order!");
+    ASSERT(misnamed == 0, "Batch result delivered with the wrong id!");
+    ASSERT(wrong == 0, "Batch HMM result differs from sequential!");
+    ASSERT(seen == (int)ids.size(), "Batch dropped results!");
+  }
+
+  // A slow sink leaves the workers far ahead of it, but they only get so far
+  ids.assign(300, std::string("03_03_1"));
+  seen = 0;
+  int held = ls_batch(sam, ids, &panel, &pool, true,
+      [&](int i, const std::string& id, float* P) {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        free(P);
+        seen++;
+      });
+  ASSERT(seen == (int)ids.size(), "Batch dropped results!");
+  ASSERT(held > 0, "Batch held no results!");
+  ASSERT(held <= LS_BATCH_AHEAD * pool.nthread * LS_BATCH_WIDTH,
+      "Batch buffered too many results!");
+
+  free(Q1);
+  free(Q2);
+}
+
+void runPanelHMMTest() {
+  genome_t ref = g_fromfile(std::string(PED_TEST_02), std::string(MAP_TEST_02));
+  genome_t sam = g_fromfile(std::string(PED_TEST_03), std::string(MAP_TEST_03));
+
+  int nsample = g_nsample(ref);
+  int nsnp = g_nsnp(ref);
+
+  lspanel panel(ref, 0.1f, 1.0f);
+  ASSERT(panel.nsnp == nsnp, "Panel should report the correct nsnp");
+  ASSERT(panel.nsample == nsample, "Panel should report the correct nsample");
+  ASSERT(FEQ(panel.nJ[0], -1.0f * 0.1f), "Panel jump constant incorrect!");
+  ASSERT(FEQ(panel.J[0], log(1.0f - exp(-0.1f))),
+      "Panel jump constant incorrect!");
+  ASSERT(FEQ(panel.stay[0], exp(-0.1f)), "Panel jump constant incorrect!");
+  ASSERT(FEQ(panel.jump[0], (1.0f - exp(-0.1f)) / nsample),
+      "Panel jump constant incorrect!");
+  ASSERT(FEQ(panel.emiss[0], log(0.9f)) && FEQ(panel.emiss[1], log(0.1f)),
+      "Panel emission table incorrect!");
+  ASSERT(FEQ(panel.pemiss[0], 0.9f) && FEQ(panel.pemiss[1], 0.1f),
+      "Panel emission table incorrect!");
+
+  // The same panel must serve repeated calls with identical results
+  const char* ids[] = { "03_03_1", "03_03_2", "03_03_1" };
+  for (int k = 0; k < 3; k++) {
+    float* Q = ls(sam, std::string(ids[k]), ref, 0.1f, 1.0f);
+    uint8_t* s = panel.sample(sam, std::string(ids[k]));
+    float* P = panel.compute(s);
+    for (int i = 0; i < nsnp * nsample; i++) {
+      ASSERT(FEQ(exp(P[i]),exp(Q[i])), "Panel HMM result incorrect!");
+    }
+    free(P);
+    free(Q);
+    delete[] s;
+  }
+
+  ASSERT(panel.sample(sam, std::string("nobody")) == NULL,
+      "Panel should not find a missing sample");
+}
+
+void runVecHMMTest() {
+  // A panel that isn't a whole number of vectors or words, plus the tiny
+  // test panel that's nothing but tail
+  testpanels T("03_03_1", 0);
+
+  for (int k = 0; k < 2; k++) {
+    lspanel* P = T.panels[k];
+    int n = P->nsnp * P->nsample;
+    float* Q = ls(P, T.targets[k]);
+    for (int isa = LS_SCALAR; isa <= ls_vec_isa(); isa++) {
+      float* V = ls_vec(P, T.targets[k], (lsisa)isa);
+      for (int i = 0; i < P->nsnp; i++) {
+        float x = rowSum(&(V[i * P->nsample]), P->nsample);
+        ASSERT(fabs(x - 1.0f) < 1e-4, "Row does not sum to 1!");
+      }
+      for (int i = 0; i < n; i++) {
+        ASSERT(fabs(exp(V[i]) - exp(Q[i])) < 1e-4,
+            "Vectorized HMM result differs from sequential!");
+      }
+      free(V);
+    }
+
+    // Asking for more than the machine has runs the best it does have
+    float* A = ls_vec(P, T.targets[k], LS_AVX512);
+    float* B = ls_vec(P, T.targets[k], ls_vec_isa());
+    for (int i = 0; i < n; i++) {
+      ASSERT(A[i] == B[i], "Vectorized HMM fell back to the wrong kernels!");
+    }
+    free(A);
+    free(B);
+    free(Q);
+  }
+}
+
+// Log-likelihood of snps against P, by a plain forward pass in doubles
+double bruteLoglik(lspanel* P, uint8_t* snps) {
+  int n = P->nsample;
+  std::vector<double> f(n), h(n);
+  for (int i = 0; i < P->nsnp; i++) {
+    double sum = 0.0;
+    for (int j = 0; j < n; j++) sum += f[j];
+    for (int j = 0; j < n; j++) {
+      double a = exp((double)P->nJ[i-1 < 0 ? 0 : i-1]);
+      double x = i == 0 ? 1.0 / n : a * f[j] + (1.0 - a) / n * sum;
+      double e = P->ref->get(i, j) == snps[i] ? 1.0 - P->g : P->g;
+      h[j] = e * x;
+    }
+    f.swap(h);
+  }
+  double sum = 0.0;
+  for (int j = 0; j < n; j++) sum += f[j];
+  return log(sum);
+}
+
+void runLinHMMTest() {
+  testpanels T("03_03_1", 0);
+
+  for (int k = 0; k < 2; k++) {
+    lspanel* P = T.panels[k];
+    int n = P->nsnp * P->nsample;
+    float* Q = ls(P, T.targets[k]);
+    double ll;
+    float* L = ls_lin(P, T.targets[k], false, &ll);
+    float* R = ls_lin(P, T.targets[k], true, NULL);
+
+    for (int i = 0; i < P->nsnp; i++) {
+      float x = rowSum(&(L[i * P->nsample]), P->nsample);
+      ASSERT(fabs(x - 1.0f) < 1e-4, "Row does not sum to 1!");
+    }
+    for (int i = 0; i < n; i++) {
+      ASSERT(fabs(exp(L[i]) - exp(Q[i])) < 1e-4,
+          "Linear-space HMM result differs from sequential!");
+      ASSERT(fabs(R[i] - exp(Q[i])) < 1e-4,
+          "Linear-space HMM linear output incorrect!");
+    }
+
+    // Only the sum of 300 log scales; float rounding adds up
+    double bl = bruteLoglik(P, T.targets[k]);
+    ASSERT(fabs(ll - bl) < 1e-4 * fabs(bl) + 1e-5,
+        "Linear-space HMM log-likelihood incorrect!");
+
+    free(Q);
+    free(L);
+    free(R);
+  }
+}
+
+void runFusedHMMTest() {
+  testpanels T("03_03_2", 0);
+
+  for (int k = 0; k < 2; k++) {
+    lspanel* P = T.panels[k];
+    int n = P->nsample;
+    float* Q = ls(P, T.targets[k]);
+    int next = P->nsnp - 1;
+    ls(P, T.targets[k], [&](int i, const float* r) {
+      ASSERT(i == next, "Fused HMM rows out of order!");
+      next -= 1;
+      for (int j = 0; j < n; j++) {
+        ASSERT(r[j] == Q[i * n + j], "Fused HMM row differs from ls()!");
+      }
+    });
+    ASSERT(next == -1, "Fused HMM missed rows!");
+
+    free(Q);
+  }
+}
+
+void runMultiHMMTest() {
+  bigpanel F(20);
+  int n = F.P.nsnp * F.P.nsample;
+
+  // One target, an odd width, and a full block
+  int widths[] = { 1, 7, 20 };
+  for (int k = 0; k < 3; k++) {
+    int nt = widths[k];
+    uint8_t* s[LS_MULTI_MAX];
+    float* R[LS_MULTI_MAX];
+    for (int b = 0; b < nt; b++) {
+      s[b] = F.target(b);
+    }
+    float* L[LS_MULTI_MAX];
+    ls_multi(&F.P, s, nt, false, R);
+    ls_multi(&F.P, s, nt, true, L);
+    for (int b = 0; b < nt; b++) {
+      float* Q = ls_lin(&F.P, s[b]);
+      for (int i = 0; i < n; i++) {
+        ASSERT(fabs(exp(R[b][i]) - exp(Q[i])) < 1e-5,
+            "Batched HMM result differs from linear-space!");
+        ASSERT(fabs(L[b][i] - exp(Q[i])) < 1e-5,
+            "Batched HMM linear output incorrect!");
+      }
+      free(Q);
+      free(R[b]);
+      free(L[b]);
+      delete[] s[b];
+    }
+  }
+}
+
+void runCkptHMMTest() {
+  bigpanel F;
+  uint8_t* s = F.target(1);
+  int n = F.P.nsample;
+  int m = F.P.nsnp;
+  size_t row = sizeof(float) * n;
+  float* L = ls_lin(&F.P, s, true, NULL);
+  float* Q = ls_lin(&F.P, s);
+
+  // Least memory, something in between, and enough to never recompute
+  size_t budgets[] = { 0, 60 * row, 302 * row };
+  for (int b = 0; b < 3; b++) {
+    for (int linear = 0; linear < 2; linear++) {
+      std::vector<float> R((size_t)m * n);
+      int next = m - 1;
+      bool ok = ls_ckpt(&F.P, s, budgets[b], linear,
+          [&](int i, const float* r) {
+        ASSERT(i == next, "Checkpointed HMM rows out of order!");
+        next -= 1;
+        for (int j = 0; j < n; j++) R[(size_t)i * n + j] = r[j];
+      });
+      ASSERT(ok, "Checkpointed HMM refused a large enough budget!");
+      ASSERT(next == -1, "Checkpointed HMM missed rows!");
+
+      const float* E = linear ? L : Q;
+      for (int i = 0; i < m * n; i++) {
+        float x = linear ? R[i] : exp(R[i]);
+        float y = linear ? E[i] : exp(E[i]);
+        ASSERT(fabs(x - y) < 1e-5,
+            "Checkpointed HMM result differs from linear-space!");
+      }
+    }
+  }
+
+  // 300 SNPs need at least 18 + 17 + 1 rows
+  ASSERT(ls_ckpt_min(300, n) == 36 * row, "Wrong checkpoint minimum!");
+  bool called = false;
+  bool ok = ls_ckpt(&F.P, s, 35 * row, true, [&](int i, const float* r) {
+    called = true;
+  });
+  ASSERT(!ok && !called, "Checkpointed HMM ran over budget!");
+
+  free(L);
+  free(Q);
+  delete[] s;
+}
+
+void runImputeTest() {
+  testpanels T("03_03_1", 1);
+
+  for (int k = 0; k < 2; k++) {
+    lspanel* P = T.panels[k];
+    const hapmat* S = T.refs[k]->haps.get();
+    int n = P->nsample;
+    float* Q = ls(P, T.targets[k]);
+    impsnp* calls = impute(Q, false, T.refs[k]);
+
+    // Against a plain per-allele sum of the posteriors
+    int agree = 0;
+    for (int i = 0; i < P->nsnp; i++) {
+      double p[4] = { 0.0, 0.0, 0.0, 0.0 };
+      for (int j = 0; j < n; j++) p[S->get(i, j)] += exp(Q[i * n + j]);
+      int best = 0;
+      for (int a = 0; a < 4; a++) {
+        ASSERT(fabs(calls[i].p[a] - p[a]) < 1e-5,
+            "Imputed allele probability incorrect!");
+        if (p[a] > p[best]) best = a;
+      }
+      ASSERT(calls[i].call == best, "Imputed allele is not the MLE!");
+      if (calls[i].call == T.targets[k][i]) agree++;
+    }
+    ASSERT(agree >= 0.95 * P->nsnp, "Imputation disagrees with the target!");
+
+    // Fed a row at a time, from linear rows
+    std::vector<impsnp> streamed(P->nsnp);
+    ls_ckpt(P, T.targets[k], 0, true, [&](int i, const float* r) {
+      impute_row(r, true, S, i, &(streamed[i]));
+    });
+    for (int i = 0; i < P->nsnp; i++) {
+      ASSERT(streamed[i].call == calls[i].call,
+          "Streamed imputation differs from whole-matrix!");
+      for (int a = 0; a < 4; a++) {
+        ASSERT(fabs(streamed[i].p[a] - calls[i].p[a]) < 1e-4,
+            "Streamed imputation differs from whole-matrix!");
+      }
+    }
+
+    free(calls);
+    free(Q);
+  }
+}
+
+// Keeps only every step-th SNP of g, starting from the first
+void thinGenome(genome_t g, int step) {
+  genome_t filt = g_empty();
+  auto data = std::make_shared<std::vector<struct snpmeta>>();
+  for (int i = 0; i < g_nsnp(g); i += step) {
+    data->push_back((*(g->map).data)[i]);
+    data->back().ind = data->size() - 1;
+  }
+  g_setsnps(filt, data);
+  g_filterby(g, filt);
+}
+
+void runSparseTest() {
+  bigpanel F;
+  int n = g_nsample(F.big);
+
+  // Typed everywhere, it's just the linear-space engine
+  lssparse dense(F.big, F.sam, 0.01f, 5.0f);
+  ASSERT((int)dense.site.size() == 300, "Sparse panel lost typed sites!");
+  uint8_t* s = dense.sample(F.sam, std::string("h0"));
+  float* L = ls_lin(dense.typed, s, true, NULL);
+  int next = 0;
+  dense.run(s, true, [&](int i, const float* r) {
+    ASSERT(i == next, "Sparse rows out of order!");
+    next++;
+    for (int j = 0; j < n; j++) {
+      ASSERT(FEQ(r[j], L[i * n + j]), "Densely typed result incorrect!");
+    }
+  });
+  ASSERT(next == 300, "Sparse run missed rows!");
+  free(L);
+  delete[] s;
+
+  // Typed at every 5th site
+  genome_t thin = randomGenome(2, 300, 2);
+  thinGenome(thin, 5);
+  ASSERT(g_nsnp(thin) == 60, "Thinned genome has the wrong SNPs!");
+
+  lssparse sp(F.big, thin, 0.01f, 5.0f);
+  ASSERT((int)sp.site.size() == 60 && sp.site[1] == 5,
+      "Sparse panel typed the wrong sites!");
+  ASSERT(sp.typed->nsnp == 60, "Sparse panel has the wrong SNPs!");
+  ASSERT(FEQ(sp.typed->dists[0], g_rec_dist(F.big, 0) + g_rec_dist(F.big, 1) +
+      g_rec_dist(F.big, 2) + g_rec_dist(F.big, 3) + g_rec_dist(F.big, 4)),
+      "Sparse panel didn't merge distances!");
+
+  s = sp.sample(thin, std::string("h0"));
+  float* T = ls_lin(sp.typed, s, true, NULL);
+  auto& bd = *(F.big->map).data;
+  const hapmat* full_h = F.sam->haps.get();
+  int agree = 0;
+  sp.run(s, true, [&](int i, const float* r) {
+    int k = i / 5;
+    float w = (bd[i].gdist - bd[5 * k].gdist) /
+        (bd[5 * k + 5].gdist - bd[5 * k].gdist);
+    if (k == 59) w = 0.0f;
+    double sum = 0.0;
+    for (int j = 0; j < n; j++) {
+      float x = k == 59 ? T[k * n + j] :
+          (1 - w) * T[k * n + j] + w * T[(k + 1) * n + j];
+      ASSERT(fabs(r[j] - x) < 1e-6, "Sparse interpolation incorrect!");
+      sum += r[j];
+    }
+    ASSERT(fabs(sum - 1.0) < 1e-4, "Sparse row does not sum to 1!");
+
+    impsnp c;
+    impute_row(r, true, F.big->haps.get(), i, &c);
+    if (c.call == full_h->get(i, 0)) agree++;
+  });
+  // Calls at untyped sites can't all be right, but most should be
+  ASSERT(agree >= 0.9 * 300, "Sparse imputation mostly wrong!");
+
+  free(T);
+  delete[] s;
+}
+
+void runPBWTTest() {
+  bigpanel F;
+  const hapmat* R = F.big->haps.get();
+  int m = R->nsnp;
+  int n = R->nhap;
+  pbwt P(F.big->haps);
+
+  // Every order is a permutation sorted by reversed prefix
+  for (int k = 0; k <= m; k += 50) {
+    std::vector<bool> seen(n, false);
+    for (int i = 0; i < n; i++) seen[P.a[k * n + i]] = true;
+    for (int i = 0; i < n; i++) ASSERT(seen[i], "PBWT order lost haplotypes!");
+  }
+
+  std::vector<uint8_t> z(m);
+  std::vector<int> start(m), hap(m);
+  for (int t = 0; t < 3; t++) {
+    // Two unrelated targets, and a reference itself
+    for (int i = 0; i < m; i++) {
+      z[i] = t < 2 ? F.sam->haps->get(i, t) : R->get(i, 17);
+    }
+
+    // Brute force: run[h][k] is where h's match with z ending at k starts
+    std::vector<int> run((size_t)n * m);
+    for (int h = 0; h < n; h++) {
+      for (int k = 0; k < m; k++) {
+        int prev = k > 0 ? run[h * m + k - 1] : 0;
+        run[h * m + k] = R->get(k, h) == z[k] ? prev : k + 1;
+      }
+    }
+
+    P.longest(z.data(), start.data(), hap.data());
+    for (int k = 0; k < m; k++) {
+      int best = k + 1;
+      for (int h = 0; h < n; h++) {
+        if (run[h * m + k] < best) best = run[h * m + k];
+      }
+      ASSERT(start[k] == best, "PBWT longest match has the wrong start!");
+      ASSERT(best > k ? hap[k] == -1 : run[hap[k] * m + k] == best,
+          "PBWT longest match has the wrong haplotype!");
+    }
+    if (t == 2) ASSERT(start[m - 1] == 0, "PBWT missed an exact match!");
+
+    // A match is set-maximal if it's a run nobody's run contains
+    std::vector<std::vector<int>> want, got;
+    for (int h = 0; h < n; h++) {
+      for (int k = 0; k < m; k++) {
+        int s = run[h * m + k];
+        if (s > k || (k + 1 < m && run[h * m + k + 1] == s)) continue;
+        bool contained = false;
+        for (int o = 0; o < n && !contained; o++) {
+          for (int e = k; e < m && !contained; e++) {
+            int so = run[o * m + e];
+            contained = so <= s && (so < s || e > k);
+          }
+        }
+        if (!contained) want.push_back({h, s, k + 1});
+      }
+    }
+    for (auto& x : P.setmaximal(z.data())) {
+      got.push_back({x.hap, x.start, x.end});
+    }
+    std::sort(want.begin(), want.end());
+    std::sort(got.begin(), got.end());
+    ASSERT(want.size() > 0, "PBWT test found no matches!");
+    ASSERT(want == got, "PBWT set-maximal matches incorrect!");
+  }
+
+  // Saved and loaded, it's the same transform
+  std::string fname = std::string(P_tmpdir) + "/lsimpute_pbwt.idx";
+  ASSERT(P.save(fname), "PBWT index could not be saved!");
+  pbwt* Q = pbwt::load(fname, F.big->haps);
+  ASSERT(Q != NULL, "PBWT index could not be loaded!");
+  ASSERT(Q->a == P.a && Q->d == P.d && Q->occ == P.occ &&
+      Q->below == P.below && Q->y.bits == P.y.bits,
+      "Loaded PBWT index differs!");
+  ASSERT(Q->bytes() == P.bytes() &&
+      P.bytes() >= 2 * sizeof(int32_t) * (size_t)(m + 1) * n,
+      "PBWT index size miscounted!");
+  std::vector<int> start2(m), hap2(m);
+  Q->longest(z.data(), start2.data(), hap2.data());
+  ASSERT(start2 == start && hap2 == hap, "Loaded PBWT index matches wrong!");
+  delete Q;
+
+  // ...but not against some other panel
+  genome_t other = randomGenome(203, 300, 3);
+  ASSERT(pbwt::load(fname, other->haps) == NULL,
+      "PBWT index loaded against the wrong panel!");
+  remove(fname.c_str());
+}
+
+void runKnnTest() {
+  bigpanel F;
+  int n = F.P.nsample;
+  int m = F.P.nsnp;
+  uint8_t* s = F.target(0);
+
+  // Nearest really are nearest
+  lsknn K(F.big, 20, 0.01f, 5.0f, 100, 40);
+  std::vector<int> sel = K.nearest(s, 60, 180);
+  ASSERT(sel.size() == 20, "Picked the wrong number of references!");
+  std::vector<int> dist(n, 0);
+  for (int j = 0; j < n; j++) {
+    for (int i = 60; i < 180; i++) dist[j] += F.big->haps->get(i, j) != s[i];
+  }
+  int far = 0;
+  for (int j : sel) far = std::max(far, dist[j]);
+  for (int j = 0; j < n; j++) {
+    if (!std::binary_search(sel.begin(), sel.end(), j)) {
+      ASSERT(dist[j] >= far, "Picked a reference that isn't nearest!");
+    }
+  }
+
+  // One window of every reference is just the linear-space engine
+  lsknn all(F.big, n, 0.01f, 5.0f, 1000, 0);
+  float* L = ls_lin(&F.P, s, true, NULL);
+  int next = 0;
+  all.run(s, true, [&](int i, const float* r) {
+    ASSERT(i == next, "Reduced state rows out of order!");
+    next++;
+    for (int j = 0; j < n; j++) {
+      ASSERT(FEQ(r[j], L[i * n + j]), "Unreduced result incorrect!");
+    }
+  });
+  ASSERT(next == m, "Reduced state run missed rows!");
+  double worst;
+  ASSERT(all.loss(s, &F.P, &worst) < 1e-6 && worst < 1e-6,
+      "Unreduced result lost accuracy!");
+
+  // Windows of 20 references each, stitched
+  next = 0;
+  std::vector<float> rows((size_t)m * n);
+  K.run(s, true, [&](int i, const float* r) {
+    ASSERT(i == next, "Reduced state rows out of order!");
+    next++;
+    double sum = 0.0;
+    int used = 0;
+    for (int j = 0; j < n; j++) {
+      sum += r[j];
+      used += r[j] != 0.0f;
+      rows[(size_t)i * n + j] = r[j];
+    }
+    ASSERT(fabs(sum - 1.0) < 1e-4, "Reduced state row does not sum to 1!");
+    ASSERT(used <= 40, "Reduced state row uses too many references!");
+  });
+  ASSERT(next == m, "Reduced state run missed rows!");
+  K.run(s, false, [&](int i, const float* r) {
+    for (int j = 0; j < n; j++) {
+      float x = rows[(size_t)i * n + j];
+      ASSERT(x == 0.0f ? r[j] == -INFINITY : fabs(exp(r[j]) - x) < 1e-6,
+          "Reduced state log rows incorrect!");
+    }
+  });
+
+  // The targets are mosaics of a few founders, so 20 states lose little.
+  // Rows themselves differ a lot, as copies of a founder trade mass.
+  double mean = K.loss(s, &F.P, &worst);
+  ASSERT(mean < 0.01, "Reduced state space lost too much accuracy!");
+  int agree = 0;
+  for (int i = 0; i < m; i++) {
+    impsnp a, b;
+    impute_row(&rows[(size_t)i * n], true, F.big->haps.get(), i, &a);
+    impute_row(&L[(size_t)i * n], true, F.big->haps.get(), i, &b);
+    agree += a.call == b.call;
+  }
+  ASSERT(agree >= 0.98 * m, "Reduced state imputation disagrees!");
+
+  free(L);
+  delete[] s;
+}
+
+void runChunkHMMTest() {
+  bigpanel F;
+  int n = F.P.nsample;
+  int m = F.P.nsnp;
+  uint8_t* s = F.target(1);
+  float* L = ls_lin(&F.P, s, true, NULL);
+  workpool pool(3);
+
+  // A range of the whole panel is the whole thing
+  float* R = ls_lin(&F.P, s, 0, m, true);
+  for (int k = 0; k < m * n; k++) {
+    ASSERT(R[k] == L[k], "Whole-panel range incorrect!");
+  }
+  free(R);
+
+  // One window is ls_lin() itself. The sink runs on pool threads, where a
+  // failed ASSERT can't unwind to the test, so sinks only count what's wrong.
+  int next = 0;
+  int unordered = 0;
+  int wrong = 0;
+  ls_chunk(&F.P, s, 1000.0f, 0.0f, &pool, true, [&](int i, const float* r) {
+    unordered += i != next;
+    next++;
+    for (int j = 0; j < n; j++) wrong += r[j] != L[i * n + j];
+  });
+  ASSERT(unordered == 0, "Chunked rows out of order!");
+  ASSERT(wrong == 0, "Single chunk result incorrect!");
+  ASSERT(next == m, "Chunked run missed rows!");
+
+  // Windows of about 30 SNPs, with 1/theta of burn-in on either side, come
+  // out nearly the same
+  next = 0;
+  unordered = 0;
+  int unnormal = 0;
+  int agree = 0;
+  double tv = 0.0;
+  ls_chunk(&F.P, s, 0.3f, 0.2f, &pool, true, [&](int i, const float* r) {
+    unordered += i != next;
+    next++;
+    double sum = 0.0;
+    for (int j = 0; j < n; j++) sum += r[j];
+    unnormal += fabs(sum - 1.0) >= 1e-4;
+
+    impsnp a, b;
+    impute_row(r, true, F.big->haps.get(), i, &a);
+    impute_row(&L[i * n], true, F.big->haps.get(), i, &b);
+    agree += a.call == b.call;
+    for (int k = 0; k < 4; k++) tv += fabs(a.p[k] - b.p[k]) / 2;
+  });
+  ASSERT(unordered == 0, "Chunked rows out of order!");
+  ASSERT(unnormal == 0, "Chunked row does not sum to 1!");
+  ASSERT(next == m, "Chunked run missed rows!");
+  ASSERT(agree >= 0.99 * m, "Chunked imputation disagrees!");
+  ASSERT(tv / m < 0.01, "Chunked imputation lost too much accuracy!");
+
+  // Log rows are the logs of linear ones
+  std::vector<float> rows((size_t)m * n);
+  ls_chunk(&F.P, s, 0.3f, 0.2f, &pool, true, [&](int i, const float* r) {
+    for (int j = 0; j < n; j++) rows[(size_t)i * n + j] = r[j];
+  });
+  wrong = 0;
+  ls_chunk(&F.P, s, 0.3f, 0.2f, &pool, false, [&](int i, const float* r) {
+    for (int j = 0; j < n; j++) {
+      wrong += fabs(exp(r[j]) - rows[(size_t)i * n + j]) >= 1e-6;
+    }
+  });
+  ASSERT(wrong == 0, "Chunked log rows incorrect!");
+
+  free(L);
+  delete[] s;
+}
+
+void runMeetHMMTest() {
+  bigpanel F;
+  int n = F.P.nsample;
+  uint8_t* s = F.target(0);
+  float* L = ls(&F.P, s);
+
+  // Same arithmetic in the same order, so exactly the same
+  int nthreads[] = { 1, 2, 3 };
+  for (int t : nthreads) {
+    workpool pool(t);
+    float* M = ls_meet(&F.P, s, &pool);
+    for (int k = 0; k < F.P.nsnp * n; k++) {
+      ASSERT(M[k] == L[k], "Meet-in-the-middle result incorrect!");
+    }
+    free(M);
+  }
+  free(L);
+
+  // Including when the halves are a row or less
+  workpool pool(2);
+  for (int m = 1; m <= 3; m++) {
+    genome_t tiny = randomGenome(70, m, 1);
+    lspanel Q(tiny, 0.01f, 5.0f);
+    L = ls(&Q, s);
+    float* M = ls_meet(&Q, s, &pool);
+    for (int k = 0; k < m * Q.nsample; k++) {
+      ASSERT(M[k] == L[k], "Short meet-in-the-middle result incorrect!");
+    }
+    free(L);
+    free(M);
+  }
+  delete[] s;
+}
+
+void runDedupHMMTest() {
+  bigpanel F;
+  int n = F.P.nsample;
+  int m = F.P.nsnp;
+  uint8_t* s = F.target(0);
+  float* L = ls_lin(&F.P, s, true, NULL);
+  float* Lg = ls_lin(&F.P, s);
+  impsnp* calls = impute(L, true, F.big);
+
+  // Windows that don't divide the panel, one-SNP windows (which don't merge
+  // much) and a single window over everything (which merges nothing)
+  int windows[] = { 16, 7, 1, 300 };
+  for (int len : windows) {
+    lsdedup D(&F.P, len);
+    ASSERT(D.start.back() == m, "Dedup windows don't cover the panel!");
+    for (size_t w = 0; w < D.size.size(); w++) {
+      int total = 0;
+      for (int x : D.size[w]) total += x;
+      ASSERT(total == n, "Dedup states lost references!");
+      for (int j = 0; j < n; j++) {
+        int g = D.group[w][j];
+        for (int i = D.start[w]; i < D.start[w+1]; i++) {
+          int k = i - D.start[w];
+          ASSERT(D.allele[w][k * D.size[w].size() + g] ==
+              F.big->haps->get(i, j),
+              "Dedup merged references that differ!");
+        }
+      }
+    }
+    if (len == 16) ASSERT(D.states() < 0.5 * n, "Dedup merged too little!");
+
+    float* R = D.run(s, true);
+    for (int k = 0; k < m * n; k++) {
+      ASSERT(fabs(R[k] - L[k]) < 1e-4, "Dedup result incorrect!");
+    }
+    free(R);
+    R = D.run(s, false);
+    for (int k = 0; k < m * n; k++) {
+      ASSERT(fabs(exp(R[k]) - exp(Lg[k])) < 1e-4,
+          "Dedup log result incorrect!");
+    }
+    free(R);
+
+    float* A = D.alleles(s);
+    impsnp* dc = impute_alleles(A, m);
+    for (int i = 0; i < m; i++) {
+      for (int a = 0; a < 4; a++) {
+        ASSERT(fabs(dc[i].p[a] - calls[i].p[a]) < 1e-4,
+            "Dedup allele posteriors incorrect!");
+      }
+    }
+    free(dc);
+    free(A);
+  }
+
+  free(calls);
+  free(L);
+  free(Lg);
+  delete[] s;
+}
+
+void runBeamHMMTest() {
+  bigpanel F;
+  int n = F.P.nsample;
+  int m = F.P.nsnp;
+  uint8_t* s = F.target(1);
+  float* L = ls_lin(&F.P, s, true, NULL);
+  std::vector<float> lost(m);
+
+  // A beam as wide as the panel prunes nothing
+  float* B = ls_beam(&F.P, s, n, 0.0f, true, lost.data());
+  for (int k = 0; k < m * n; k++) {
+    ASSERT(fabs(B[k] - L[k]) < 1e-5, "Unpruned beam incorrect!");
+  }
+  for (int i = 0; i < m; i++) {
+    ASSERT(lost[i] < 1e-6, "Unpruned beam lost mass!");
+  }
+  free(B);
+
+  // Narrow beams and thresholds stay close, and report what they moved
+  int widths[] = { 8, 32, n };
+  float epss[] = { 0.0f, 0.0f, 1e-3f };
+  double moved[3];
+  int pruned[3];
+  for (int t = 0; t < 3; t++) {
+    B = ls_beam(&F.P, s, widths[t], epss[t], true, lost.data());
+    double tv = 0.0;
+    int agree = 0;
+    moved[t] = 0.0;
+    pruned[t] = 0;
+    for (int i = 0; i < m; i++) {
+      double sum = 0.0;
+      for (int j = 0; j < n; j++) sum += B[i * n + j];
+      ASSERT(fabs(sum - 1.0) < 1e-4, "Beam row does not sum to 1!");
+      ASSERT(lost[i] >= 0.0f && lost[i] <= 2.0f, "Beam lost mass invalid!");
+      moved[t] += lost[i];
+      pruned[t] += lost[i] > 0.0f;
+
+      impsnp a, b;
+      impute_row(&B[i * n], true, F.big->haps.get(), i, &a);
+      impute_row(&L[i * n], true, F.big->haps.get(), i, &b);
+      agree += a.call == b.call;
+      for (int k = 0; k < 4; k++) tv += fabs(a.p[k] - b.p[k]) / 2;
+    }
+    ASSERT(agree >= 0.99 * m, "Beam imputation disagrees!");
+    ASSERT(tv / m < 0.01, "Beam imputation lost too much accuracy!");
+
+    // Log rows are the logs of linear ones
+    float* G = ls_beam(&F.P, s, widths[t], epss[t], false, NULL);
+    for (int k = 0; k < m * n; k++) {
+      ASSERT(fabs(exp(G[k]) - B[k]) < 1e-6, "Beam log rows incorrect!");
+    }
+    free(G);
+    free(B);
+  }
+
+  // A beam of 8 can't hold what 203 references spread over, so it has to
+  // move mass, and more of it than a beam of 32
+  ASSERT(pruned[0] > 0, "Narrow beam reported no lost mass!");
+  ASSERT(moved[0] > moved[1] && moved[1] > 0.0,
+      "Beam lost mass doesn't grow as the beam narrows!");
+
+  free(L);
+  delete[] s;
+}
+
+void runTopHMMTest() {
+  bigpanel F;
+  int n = F.P.nsample;
+  int m = F.P.nsnp;
+  uint8_t* s = F.target(1);
+  float* L = ls_lin(&F.P, s, true, NULL);
+  impsnp* exact = impute(L, true, F.big);
+
+  int ks[] = { n, 5, 0 };
+  float epss[] = { 0.0f, 0.0f, 1e-3f };
+  for (int t = 0; t < 3; t++) {
+    lscsr* R = ls_top(&F.P, s, ks[t], epss[t]);
+    ASSERT(R != NULL, "Sparse posteriors failed!");
+    ASSERT(R->nsnp == m && R->nref == n, "Sparse posteriors wrong size!");
+    ASSERT(R->ptr[0] == 0, "Sparse posteriors wrong offsets!");
+    for (int i = 0; i < m; i++) {
+      int len = R->ptr[i+1] - R->ptr[i];
+      ASSERT(len >= 0, "Sparse posteriors wrong offsets!");
+      if (ks[t] > 0) ASSERT(len <= ks[t], "Sparse row too long!");
+
+      // Kept entries are ls_lin()'s, likeliest first, and nothing left out
+      // beats them
+      double kept = 0.0;
+      float least = 1.0f;
+      for (int c = R->ptr[i]; c < R->ptr[i+1]; c++) {
+        int j = R->col[c];
+        ASSERT(fabs(R->val[c] - L[i * n + j]) < 1e-6, "Sparse entry wrong!");
+        ASSERT(R->val[c] >= epss[t], "Sparse entry under threshold!");
+        if (c > R->ptr[i]) {
+          ASSERT(R->val[c] <= R->val[c-1], "Sparse row out of order!");
+        }
+        kept += R->val[c];
+        least = R->val[c];
+      }
+      ASSERT(fabs(kept + R->rest[i] - 1.0) < 1e-4, "Sparse rest wrong!");
+      if (len == ks[t]) {
+        int above = 0;
+        for (int j = 0; j < n; j++) above += L[i * n + j] > least + 1e-6;
+        ASSERT(above < len, "Sparse row missed a likelier state!");
+      }
+    }
+
+    // Imputing from them loses next to nothing
+    impsnp* calls = impute_csr(R, F.big);
+    double tv = 0.0;
+    int agree = 0;
+    for (int i = 0; i < m; i++) {
+      agree += calls[i].call == exact[i].call;
+      for (int a = 0; a < 4; a++) {
+        tv += fabs(calls[i].p[a] - exact[i].p[a]) / 2;
+      }
+    }
+    ASSERT(agree >= 0.99 * m, "Sparse imputation disagrees!");
+    ASSERT(tv / m < (t == 0 ? 1e-5 : 5e-3), "Sparse imputation inaccurate!");
+    free(calls);
+    lscsr_free(R);
+  }
+
+  free(exact);
+  free(L);
+  delete[] s;
+}
+
 void exportBasicHMMTests() {
     auto basicTest = new TestCase();
     basicTest->name = (char*)"Basic Sequential HMM Functionality";
@@ -174,7 +1188,91 @@ void exportBasicHMMTests() {
     gpuTest->name = (char*)"Basic GPU HMM Functionality";
     gpuTest->run = &runGPUHMMBasicTest;
 
+    auto parTest = new TestCase();
+    parTest->name = (char*)"Basic Parallel CPU HMM Functionality";
+    parTest->run = &runParHMMBasicTest;
+
+    auto batchTest = new TestCase();
+    batchTest->name = (char*)"Batch HMM Driver";
+    batchTest->run = &runBatchHMMTest;
+
+    auto panelTest = new TestCase();
+    panelTest->name = (char*)"Prepared Panel HMM";
+    panelTest->run = &runPanelHMMTest;
+
+    auto vecTest = new TestCase();
+    vecTest->name = (char*)"Vectorized HMM Kernels";
+    vecTest->run = &runVecHMMTest;
+
+    auto linTest = new TestCase();
+    linTest->name = (char*)"Linear-space HMM";
+    linTest->run = &runLinHMMTest;
+
+    auto ckptTest = new TestCase();
+    ckptTest->name = (char*)"Checkpointed HMM";
+    ckptTest->run = &runCkptHMMTest;
+
+    auto fusedTest = new TestCase();
+    fusedTest->name = (char*)"Fused Smoothing HMM";
+    fusedTest->run = &runFusedHMMTest;
+
+    auto multiTest = new TestCase();
+    multiTest->name = (char*)"Multi-target HMM";
+    multiTest->run = &runMultiHMMTest;
+
+    auto imputeTest = new TestCase();
+    imputeTest->name = (char*)"Imputation";
+    imputeTest->run = &runImputeTest;
+
+    auto sparseTest = new TestCase();
+    sparseTest->name = (char*)"Sparse Target HMM";
+    sparseTest->run = &runSparseTest;
+
+    auto pbwtTest = new TestCase();
+    pbwtTest->name = (char*)"PBWT Index";
+    pbwtTest->run = &runPBWTTest;
+
+    auto knnTest = new TestCase();
+    knnTest->name = (char*)"Reduced State HMM";
+    knnTest->run = &runKnnTest;
+
+    auto chunkTest = new TestCase();
+    chunkTest->name = (char*)"Chunked HMM";
+    chunkTest->run = &runChunkHMMTest;
+
+    auto meetTest = new TestCase();
+    meetTest->name = (char*)"Meet-in-the-middle HMM";
+    meetTest->run = &runMeetHMMTest;
+
+    auto dedupTest = new TestCase();
+    dedupTest->name = (char*)"Deduplicated HMM";
+    dedupTest->run = &runDedupHMMTest;
+
+    auto beamTest = new TestCase();
+    beamTest->name = (char*)"Beam-pruned HMM";
+    beamTest->run = &runBeamHMMTest;
+
+    auto topTest = new TestCase();
+    topTest->name = (char*)"Sparse Posterior Output";
+    topTest->run = &runTopHMMTest;
+
     alltests.registerTest(basicTest);
     alltests.registerTest(gpuTest);
+    alltests.registerTest(parTest);
+    alltests.registerTest(batchTest);
+    alltests.registerTest(panelTest);
+    alltests.registerTest(vecTest);
+    alltests.registerTest(linTest);
+    alltests.registerTest(ckptTest);
+    alltests.registerTest(fusedTest);
+    alltests.registerTest(multiTest);
+    alltests.registerTest(imputeTest);
+    alltests.registerTest(sparseTest);
+    alltests.registerTest(pbwtTest);
+    alltests.registerTest(knnTest);
+    alltests.registerTest(chunkTest);
+    alltests.registerTest(meetTest);
+    alltests.registerTest(dedupTest);
+    alltests.registerTest(beamTest);
+    alltests.registerTest(topTest);
 }
-
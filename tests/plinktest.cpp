@@ -1,7 +1,15 @@
 
 #include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+#include <zlib.h>
+
+#include "../src/cycleTimer.h"
 
 #include "../src/plinker/genome_c.h"
+#include "../src/plinker/hapmat.h"
 #include "infrastructure.h"
 #include "lassert.h"
 
@@ -42,11 +50,509 @@ void runPlinkBasicTest() {
     ASSERT(FEQ(g_rec_dist(g, 1), 0.2), "failure fetching genetic distance");
 }
 
+void runHapmatTest() {
+    // Spans three words, the last one partial
+    hapmat m(5, 150);
+    ASSERT(m.nword == 3, "hapmat should pad haplotypes to whole words");
+
+    for (int i = 0 ; i < 5 ; i += 1) {
+        for (int j = 0 ; j < 150 ; j += 1) {
+            m.set(i, j, (allele)((i * 7 + j * 3) % 4));
+        }
+    }
+    // Overwriting must clear old bits as well as set new ones
+    m.set(2, 70, T);
+    m.set(2, 70, A);
+
+    for (int i = 0 ; i < 5 ; i += 1) {
+        for (int j = 0 ; j < 150 ; j += 1) {
+            allele want = (i == 2 && j == 70) ?
+                A : (allele)((i * 7 + j * 3) % 4);
+            ASSERT(m.get(i, j) == want, "hapmat lost an allele");
+        }
+    }
+
+    for (int a = 0 ; a < 4 ; a += 1) {
+        for (int w = 0 ; w < m.nword ; w += 1) {
+            uint64_t mis = m.mismatch(3, w, a);
+            for (int b = 0 ; b < 64 ; b += 1) {
+                int j = 64 * w + b;
+                bool want = j >= 150 || m.get(3, j) != a;
+                ASSERT((((mis >> b) & 1) != 0) == want,
+                        "hapmat mismatch mask incorrect");
+            }
+        }
+    }
+
+    genome_t g = g_fromfile(std::string(PED_TEST_01), std::string(MAP_TEST_01));
+    ASSERT(g->haps->nhap == 4, "genome should pack every haplotype");
+    ASSERT(g_indlookup(g, "01_01_2", 2) == C,
+            "packed lookup by index incorrect");
+    ASSERT(g_indlookup(g, "01_02_2", 1) == G,
+            "packed lookup by index incorrect");
+}
+
+// True if a and b hold the same SNPs and the same haplotypes in the same
+// columns
+bool sameGenome(genome_t a, genome_t b) {
+    if (g_nsnp(a) != g_nsnp(b) || g_nsample(a) != g_nsample(b)) {
+        return false;
+    }
+    for (int i = 0 ; i < g_nsnp(a) ; i += 1) {
+        if ((*a->map.data)[i].id != (*b->map.data)[i].id) { return false; }
+        if (!FEQ((*a->map.data)[i].gdist, (*b->map.data)[i].gdist)) {
+            return false;
+        }
+    }
+    return a->samples == b->samples && a->names == b->names &&
+        a->haps->bits == b->haps->bits;
+}
+
+void runFastParserTest() {
+    const char* peds[] = { "data/01.ped", "data/02.ped", "data/03.ped" };
+    const char* maps[] = { "data/01.map", "data/02.map", "data/03.map" };
+
+    for (int i = 0 ; i < 3 ; i += 1) {
+        genome_t f = g_fromfile(std::string(peds[i]), std::string(maps[i]));
+        genome_t s = g_fromfile_stream(std::string(peds[i]),
+                std::string(maps[i]));
+        ASSERT(f != NULL, "mmap parser failed on test data");
+        ASSERT(sameGenome(f, s), "mmap and stream parsers disagree");
+    }
+
+    ASSERT(g_fromfile(std::string("data/nonexistent.ped"),
+                std::string(MAP_TEST_01)) == NULL,
+            "mmap parser should fail on a missing file");
+}
+
+void runSampleIndexTest() {
+    genome_t g = g_fromfile(std::string("data/02.ped"),
+            std::string("data/02.map"));
+    genome_t orig = g_fromfile(std::string("data/02.ped"),
+            std::string("data/02.map"));
+
+    // Iteration follows the file, and every id maps back to its column
+    const char* order[] = { "01_01_1", "01_01_2", "01_02_1", "01_02_2" };
+    int i = 0;
+    for (auto id : *g) {
+        ASSERT(id == order[i], "haplotypes should iterate in file order");
+        ASSERT(g_hapindex(g, id) == i, "id should map to its column");
+        i += 1;
+    }
+    ASSERT(i == 4, "should iterate over every haplotype");
+    ASSERT(g_hapindex(g, "nobody") == -1, "unknown ids should give -1");
+
+    // Filtering packs the survivors into the leading columns, in order
+    std::string keep[] = { "01_02_2", "01_01_2" };
+    g_filterindiv(g, keep, 2);
+    ASSERT(g_nsample(g) == 2, "filter should leave two haplotypes");
+    ASSERT(g->haps->nhap == 2, "filter should shrink the matrix");
+    ASSERT(g->names[0] == "01_01_2" && g->names[1] == "01_02_2",
+            "filter should keep column order");
+    ASSERT(g_hapindex(g, "01_01_1") == -1, "filtered id should be gone");
+    for (auto id : *g) {
+        auto a = g_plookup(g, id);
+        auto b = g_plookup(orig, id);
+        for (int j = 0 ; j < g_nsnp(g) ; j += 1) {
+            ASSERT(a[j] == b[j], "filter should keep alleles");
+        }
+        delete[] a;
+        delete[] b;
+    }
+}
+
+// Writes a random PED/MAP pair of nind individuals and nsnp SNPs
+void writeBenchFiles(std::string ped, std::string map, int nind, int nsnp) {
+    const char alleles[] = "ACGT";
+    FILE* f = fopen(map.c_str(), "w");
+    for (int i = 0 ; i < nsnp ; i += 1) {
+        fprintf(f, "1 rs%d %f %d\n", i, 0.001 * i, 100 * i);
+    }
+    fclose(f);
+
+    f = fopen(ped.c_str(), "w");
+    srand(418);
+    for (int j = 0 ; j < nind ; j += 1) {
+        fprintf(f, "%d %d 0 0 1 -9", j, j);
+        for (int i = 0 ; i < 2 * nsnp ; i += 1) {
+            fprintf(f, " %c", alleles[rand() % 4]);
+        }
+        fprintf(f, "\n");
+    }
+    fclose(f);
+}
+
+void runParserBenchmark() {
+    std::string ped = std::string(P_tmpdir) + "/lsimpute_bench.ped";
+    std::string map = std::string(P_tmpdir) + "/lsimpute_bench.map";
+    writeBenchFiles(ped, map, 500, 4000);
+
+    double t0 = CycleTimer::currentSeconds();
+    genome_t s = g_fromfile_stream(ped, map);
+    double t1 = CycleTimer::currentSeconds();
+    genome_t f = g_fromfile(ped, map, 1);
+    double t2 = CycleTimer::currentSeconds();
+    genome_t p = g_fromfile(ped, map);
+    double t3 = CycleTimer::currentSeconds();
+
+    fprintf(stderr, "  stream parser: %.4fs\n", t1 - t0);
+    fprintf(stderr, "  mmap parser:   %.4fs (x%.2f)\n", t2 - t1,
+            (t1 - t0) / (t2 - t1));
+    fprintf(stderr, "  mmap, sharded: %.4fs (x%.2f)\n", t3 - t2,
+            (t1 - t0) / (t3 - t2));
+
+    remove(ped.c_str());
+    remove(map.c_str());
+
+    ASSERT(sameGenome(f, s), "mmap and stream parsers disagree");
+    ASSERT(sameGenome(p, s), "sharded and stream parsers disagree");
+}
+
+void runShardedParserTest() {
+    std::string ped = std::string(P_tmpdir) + "/lsimpute_shard.ped";
+    std::string map = std::string(P_tmpdir) + "/lsimpute_shard.map";
+    // Big enough for several shards; an odd number of individuals puts shard
+    // edges in the middle of words of the packed matrix
+    writeBenchFiles(ped, map, 203, 300);
+
+    genome_t s = g_fromfile_stream(ped, map);
+    int nthreads[] = { 1, 2, 3, 7 };
+    for (int n : nthreads) {
+        genome_t f = g_fromfile(ped, map, n);
+        ASSERT(f != NULL, "sharded parser failed");
+        ASSERT(sameGenome(f, s), "sharded and stream parsers disagree");
+    }
+
+    remove(ped.c_str());
+    remove(map.c_str());
+}
+
+/* Writes the same random biallelic genotypes as a binary fileset (prefix.bed,
+ * .bim, .fam) and a text one (prefix.ped, .map), with heterozygotes written
+ * A1 first and missing genotypes as A2 in the text version. SNPs are written
+ * in reverse bp order, and SNP 0 is monomorphic with A1 given as 0.
+ */
+void writeBedFiles(std::string prefix, int nind, int nsnp) {
+    const char alleles[] = "ACGT";
+    std::vector<char> a1(nsnp);
+    std::vector<char> a2(nsnp);
+    std::vector<uint8_t> geno((size_t)nind * nsnp);
+    srand(15418);
+    for (int i = 0 ; i < nsnp ; i += 1) {
+        int x = rand() % 4;
+        a1[i] = alleles[x];
+        a2[i] = alleles[(x + 1 + rand() % 3) % 4];
+        for (int j = 0 ; j < nind ; j += 1) {
+            // 00 hom. A1, 01 missing, 10 het., 11 hom. A2
+            int r = rand() % 16;
+            int x = r == 0 ? 1 : r < 6 ? 0 : r < 11 ? 2 : 3;
+            geno[(size_t)i * nind + j] = x;
+            if (i == 0) { geno[j] = 3; }
+        }
+    }
+    a1[0] = '0';
+
+    FILE* map = fopen((prefix + ".map").c_str(), "w");
+    FILE* bim = fopen((prefix + ".bim").c_str(), "w");
+    for (int i = 0 ; i < nsnp ; i += 1) {
+        fprintf(map, "1 rs%d %f %d\n", i, 0.001 * (nsnp - i), 100 * (nsnp - i));
+        fprintf(bim, "1\trs%d\t%f\t%d\t%c\t%c\n", i, 0.001 * (nsnp - i),
+                100 * (nsnp - i), a1[i], a2[i]);
+    }
+    fclose(map);
+    fclose(bim);
+
+    FILE* ped = fopen((prefix + ".ped").c_str(), "w");
+    FILE* fam = fopen((prefix + ".fam").c_str(), "w");
+    for (int j = 0 ; j < nind ; j += 1) {
+        fprintf(ped, "f%d %d 0 0 1 -9", j, j);
+        fprintf(fam, "f%d %d 0 0 1 -9\n", j, j);
+        for (int i = 0 ; i < nsnp ; i += 1) {
+            int x = geno[(size_t)i * nind + j];
+            fprintf(ped, " %c %c", x == 0 || x == 2 ? a1[i] : a2[i],
+                    x == 0 ? a1[i] : a2[i]);
+        }
+        fprintf(ped, "\n");
+    }
+    fclose(ped);
+    fclose(fam);
+
+    FILE* bed = fopen((prefix + ".bed").c_str(), "wb");
+    fputc(0x6c, bed);
+    fputc(0x1b, bed);
+    fputc(0x01, bed);
+    for (int i = 0 ; i < nsnp ; i += 1) {
+        for (int j = 0 ; j < nind ; j += 4) {
+            int b = 0;
+            for (int k = 0 ; k < 4 && j + k < nind ; k += 1) {
+                b |= geno[(size_t)i * nind + j + k] << (2 * k);
+            }
+            fputc(b, bed);
+        }
+    }
+    fclose(bed);
+}
+
+void runBedReaderTest() {
+    std::string prefix = std::string(P_tmpdir) + "/lsimpute_bedtest";
+    const char* exts[] = { ".bed", ".bim", ".fam", ".ped", ".map" };
+
+    // Sizes around the 4-per-byte and 32-per-word boundaries of the format
+    int ninds[] = { 1, 4, 31, 32, 77 };
+    for (int nind : ninds) {
+        writeBedFiles(prefix, nind, 40);
+        genome_t b = g_frombed(prefix + ".bed", prefix + ".bim",
+                prefix + ".fam");
+        genome_t t = g_fromfile(prefix + ".ped", prefix + ".map");
+        ASSERT(b != NULL, "bed reader failed");
+        ASSERT(sameGenome(b, t), "bed and text readers disagree");
+    }
+
+    // A .bed that doesn't match its .fam is an error
+    writeBedFiles(prefix, 8, 40);
+    FILE* fam = fopen((prefix + ".fam").c_str(), "a");
+    fprintf(fam, "extra 1 0 0 1 -9\n");
+    fclose(fam);
+    ASSERT(g_frombed(prefix + ".bed", prefix + ".bim", prefix + ".fam")
+            == NULL, "bed reader should check the file size");
+
+    for (const char* e : exts) { remove((prefix + e).c_str()); }
+}
+
+/* Writes the same random phased haplotypes as prefix.ped and as a VCF file
+ * (prefix.vcf, or gzipped as two gzip members like bgzip writes if gz),
+ * with a prefix.map for both. SNPs are written in reverse bp order, missing
+ * alleles in the VCF are REF in the PED file, and the VCF has an indel and a
+ * multiallelic record that should be skipped.
+ */
+void writeVcfFiles(std::string prefix, int nind, int nsnp, bool gz) {
+    const char alleles[] = "ACGT";
+    std::string vcf;
+    std::vector<char> ref(nsnp);
+    std::vector<char> alt(nsnp);
+    std::vector<char> gt((size_t)2 * nind * nsnp);
+    srand(15618);
+
+    vcf += "##fileformat=VCFv4.2\n";
+    vcf += "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+    for (int j = 0 ; j < nind ; j += 1) {
+        vcf += "\tf" + std::to_string(j) + "_" + std::to_string(j);
+    }
+    vcf += "\n";
+    vcf += "chr1\t5\tindel\tA\tAT\t.\tPASS\t.\tGT";
+    for (int j = 0 ; j < nind ; j += 1) { vcf += "\t0|1"; }
+    vcf += "\n";
+
+    for (int i = 0 ; i < nsnp ; i += 1) {
+        int x = rand() % 4;
+        ref[i] = alleles[x];
+        alt[i] = alleles[(x + 1 + rand() % 3) % 4];
+        vcf += "chr1\t" + std::to_string(100 * (nsnp - i)) + "\trs" +
+            std::to_string(i) + "\t" + ref[i] + "\t" + alt[i] +
+            "\t.\tPASS\t.\tGT:DS";
+        for (int j = 0 ; j < 2 * nind ; j += 1) {
+            int r = rand() % 16;
+            char c = r == 0 ? '.' : r < 8 ? '0' : '1';
+            gt[(size_t)i * 2 * nind + j] = c;
+            vcf += ((j & 1) ? "|" : "\t");
+            vcf += c;
+            if (j & 1) { vcf += ":0.5"; }
+        }
+        vcf += "\n";
+    }
+    vcf += "1\t7\tmulti\tA\tC,G\t.\tPASS\t.\tGT";
+    for (int j = 0 ; j < nind ; j += 1) { vcf += "\t1|2"; }
+    vcf += "\n";
+
+    if (gz) {
+        size_t h = vcf.find("\nchr1") + 1;
+        gzFile f = gzopen((prefix + ".vcf.gz").c_str(), "wb");
+        gzwrite(f, vcf.data(), h);
+        gzclose(f);
+        f = gzopen((prefix + ".vcf.gz").c_str(), "ab");
+        gzwrite(f, vcf.data() + h, vcf.size() - h);
+        gzclose(f);
+    }
+    else {
+        FILE* f = fopen((prefix + ".vcf").c_str(), "w");
+        fwrite(vcf.data(), 1, vcf.size(), f);
+        fclose(f);
+    }
+
+    FILE* map = fopen((prefix + ".map").c_str(), "w");
+    for (int i = 0 ; i < nsnp ; i += 1) {
+        fprintf(map, "1 rs%d %f %d\n", i, 0.001 * (nsnp - i), 100 * (nsnp - i));
+    }
+    fclose(map);
+
+    FILE* ped = fopen((prefix + ".ped").c_str(), "w");
+    for (int j = 0 ; j < nind ; j += 1) {
+        fprintf(ped, "f%d %d 0 0 1 -9", j, j);
+        for (int i = 0 ; i < nsnp ; i += 1) {
+            for (int h = 0 ; h < 2 ; h += 1) {
+                char c = gt[(size_t)i * 2 * nind + 2 * j + h];
+                fprintf(ped, " %c", c == '1' ? alt[i] : ref[i]);
+            }
+        }
+        fprintf(ped, "\n");
+    }
+    fclose(ped);
+}
+
+void runVcfReaderTest() {
+    std::string prefix = std::string(P_tmpdir) + "/lsimpute_vcftest";
+    std::string sparse = prefix + "_sparse.map";
+
+    for (int gz = 0 ; gz < 2 ; gz += 1) {
+        writeVcfFiles(prefix, 45, 30, gz);
+        std::string vcf = prefix + (gz ? ".vcf.gz" : ".vcf");
+        genome_t t = g_fromfile(prefix + ".ped", prefix + ".map");
+
+        // A tiny buffer exercises lines split across (and longer than) chunks
+        size_t chunks[] = { 100, 1 << 20 };
+        for (size_t chunk : chunks) {
+            genome_t v = g_fromvcf(vcf, prefix + ".map", chunk);
+            ASSERT(v != NULL, "vcf reader failed");
+            ASSERT(sameGenome(v, t), "vcf and text readers disagree");
+        }
+
+        // Distances are linear in bp, so interpolating a sparser map that
+        // keeps both ends should give them all back
+        FILE* f = fopen(sparse.c_str(), "w");
+        for (int i = 0 ; i < 30 ; i += 1) {
+            if (i % 4 == 0 || i == 29) {
+                fprintf(f, "1 rs%d %f %d\n", i, 0.001 * (30 - i),
+                        100 * (30 - i));
+            }
+        }
+        fclose(f);
+        genome_t v = g_fromvcf(vcf, sparse);
+        ASSERT(v != NULL, "vcf reader failed");
+        ASSERT(sameGenome(v, t), "interpolated genetic distances are wrong");
+
+        remove(vcf.c_str());
+    }
+
+    ASSERT(g_fromvcf(prefix + ".vcf", prefix + ".map") == NULL,
+            "vcf reader should fail on a missing file");
+
+    remove(sparse.c_str());
+    remove((prefix + ".map").c_str());
+    remove((prefix + ".ped").c_str());
+}
+
+void runSnpFilterTest() {
+    std::string ped = std::string(P_tmpdir) + "/lsimpute_filter.ped";
+    std::string map = std::string(P_tmpdir) + "/lsimpute_filter.map";
+    std::string fped = std::string(P_tmpdir) + "/lsimpute_filter_f.ped";
+    std::string fmap = std::string(P_tmpdir) + "/lsimpute_filter_f.map";
+    writeBenchFiles(ped, map, 6, 200);
+    writeBenchFiles(fped, fmap, 2, 50);
+
+    // Put odd SNPs on chromosome 2
+    FILE* f = fopen(map.c_str(), "w");
+    for (int i = 0 ; i < 200 ; i += 1) {
+        fprintf(f, "%d rs%d %f %d\n", 1 + (i & 1), i, 0.001 * i, 100 * i);
+    }
+    fclose(f);
+
+    genome_t orig = g_fromfile(ped, map);
+    genome_t filt = g_fromfile(fped, fmap);
+    ASSERT(g_snpindex(orig, "rs17") == 17, "SNP index should find rs17");
+    ASSERT(g_snpindex(orig, "rs200") == -1, "SNP index should miss rs200");
+
+    // Filtered genomes keep the alleles of the SNPs they keep
+    auto sameAlleles = [&](genome_t g) {
+        for (auto id : *g) {
+            for (int i = 0 ; i < g_nsnp(g) ; i += 1) {
+                std::string sid = (*g->map.data)[i].id;
+                if (g_sidlookup(g, id, sid) != g_sidlookup(orig, id, sid)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    genome_t g = g_fromfile(ped, map);
+    g_filterby(g, filt);
+    ASSERT(g_nsnp(g) == 50, "filterby should keep the 50 shared SNPs");
+    ASSERT(g->haps->nsnp == 50, "filterby should drop rows of the matrix");
+    ASSERT(g_snpindex(g, "rs49") == 49 && g_snpindex(g, "rs50") == -1,
+            "filterby should rebuild the SNP index");
+    ASSERT(sameAlleles(g), "filterby should keep alleles");
+
+    g = g_fromfile(ped, map);
+    g_filterchrom(g, 2);
+    ASSERT(g_nsnp(g) == 100, "filterchrom should keep chromosome 2");
+    ASSERT(g_snpindex(g, "rs3") == 1 && g_snpindex(g, "rs2") == -1,
+            "filterchrom should rebuild the SNP index");
+    ASSERT(FEQ(g_rec_dist(g, 0), 0.002), "filterchrom should keep distances");
+    ASSERT(sameAlleles(g), "filterchrom should keep alleles");
+
+    g = g_fromfile(ped, map);
+    genome_t h = g_fromfile(fped, fmap);
+    g_filterchrom(h, 1);
+    g_intersect(g, h);
+    ASSERT(g_nsnp(g) == 25 && g_nsnp(h) == 25,
+            "intersect should keep the shared SNPs");
+    for (int i = 0 ; i < 25 ; i += 1) {
+        ASSERT((*g->map.data)[i].id == (*h->map.data)[i].id,
+                "intersect should leave the same SNPs in the same order");
+    }
+    ASSERT(sameAlleles(g), "intersect should keep alleles");
+
+    remove(ped.c_str());
+    remove(map.c_str());
+    remove(fped.c_str());
+    remove(fmap.c_str());
+}
+
 void exportBasicPlinkerTests() {
     auto basicTest = new TestCase();
     basicTest->name = (char*)"Basic Plinker Functionality";
     basicTest->run = &runPlinkBasicTest;
 
+    auto hapmatTest = new TestCase();
+    hapmatTest->name = (char*)"Packed Haplotype Matrix";
+    hapmatTest->run = &runHapmatTest;
+
+    auto indexTest = new TestCase();
+    indexTest->name = (char*)"Contiguous Sample Index";
+    indexTest->run = &runSampleIndexTest;
+
+    auto filterTest = new TestCase();
+    filterTest->name = (char*)"SNP Index and Filters";
+    filterTest->run = &runSnpFilterTest;
+
+    auto fastTest = new TestCase();
+    fastTest->name = (char*)"Memory-mapped Parser";
+    fastTest->run = &runFastParserTest;
+
+    auto shardTest = new TestCase();
+    shardTest->name = (char*)"Sharded Parser";
+    shardTest->run = &runShardedParserTest;
+
+    auto bedTest = new TestCase();
+    bedTest->name = (char*)"Binary Fileset Reader";
+    bedTest->run = &runBedReaderTest;
+
+    auto vcfTest = new TestCase();
+    vcfTest->name = (char*)"Streaming VCF Reader";
+    vcfTest->run = &runVcfReaderTest;
+
+    auto parseBench = new TestCase();
+    parseBench->name = (char*)"Parser Benchmark";
+    parseBench->run = &runParserBenchmark;
+
     alltests.registerTest(basicTest);
+    alltests.registerTest(hapmatTest);
+    alltests.registerTest(indexTest);
+    alltests.registerTest(filterTest);
+    alltests.registerTest(fastTest);
+    alltests.registerTest(shardTest);
+    alltests.registerTest(bedTest);
+    alltests.registerTest(vcfTest);
+    alltests.registerTest(parseBench);
 }
 